@@ -0,0 +1,1163 @@
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION pg_background" to load this file. \quit
+DROP ROLE IF EXISTS pgbackground_role;
+CREATE FUNCTION pg_background_launch(sql pg_catalog.text,
+					   queue_size pg_catalog.int4 DEFAULT 65536)
+    RETURNS pg_catalog.int4 STRICT
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION pg_background_result(pid pg_catalog.int4)
+    RETURNS SETOF pg_catalog.record STRICT
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION pg_background_result_into(pid pg_catalog.int4,
+					   target pg_catalog.regclass)
+    RETURNS pg_catalog.int8 STRICT
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION pg_background_detach(pid pg_catalog.int4)
+    RETURNS pg_catalog.void STRICT
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION pg_background_cancel(pid pg_catalog.int4)
+    RETURNS pg_catalog.bool STRICT
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION pg_background_wait_any(pids pg_catalog.int4[])
+    RETURNS pg_catalog.int4 STRICT
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION pg_background_launch_chunked(job_id pg_catalog.text,
+					   sql pg_catalog.text,
+					   queue_size pg_catalog.int4 DEFAULT 65536)
+    RETURNS pg_catalog.int4 STRICT
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION pg_background_selfbench(iterations pg_catalog.int4,
+					   row_width pg_catalog.int4,
+					   rows pg_catalog.int4)
+    RETURNS TABLE (metric pg_catalog.text, value pg_catalog.float8,
+		   unit pg_catalog.text) STRICT
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION pg_background_stats()
+    RETURNS TABLE (queryid pg_catalog.int8, command pg_catalog.text,
+		   query pg_catalog.text, calls pg_catalog.int8,
+		   parse_ms pg_catalog.float8, analyze_ms pg_catalog.float8,
+		   plan_ms pg_catalog.float8, portal_start_ms pg_catalog.float8,
+		   portal_run_ms pg_catalog.float8, send_blocked_ms pg_catalog.float8,
+		   temp_bytes pg_catalog.int8, peak_memory pg_catalog.int8,
+		   queue_fill pg_catalog.int8[], queue_blocked pg_catalog.int8)
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION pg_background_stats_reset()
+    RETURNS pg_catalog.void
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE TABLE pg_background_checkpoints (
+    job_id pg_catalog.text PRIMARY KEY,
+    owner pg_catalog.regrole NOT NULL DEFAULT CURRENT_USER::pg_catalog.regrole,
+    lock_key serial UNIQUE,
+    last_key pg_catalog.text,
+    chunks pg_catalog.int8 NOT NULL DEFAULT 0,
+    completed pg_catalog.bool NOT NULL DEFAULT false,
+    updated_at pg_catalog.timestamptz NOT NULL DEFAULT pg_catalog.now()
+);
+SELECT pg_catalog.pg_extension_config_dump('pg_background_checkpoints', '');
+SELECT pg_catalog.pg_extension_config_dump('pg_background_checkpoints_lock_key_seq', '');
+
+-- A job belongs to the role that first ran it.
+ALTER TABLE pg_background_checkpoints ENABLE ROW LEVEL SECURITY;
+CREATE POLICY pg_background_checkpoints_owner ON pg_background_checkpoints
+    USING (pg_catalog.pg_has_role(owner::pg_catalog.oid, 'MEMBER'));
+
+CREATE FUNCTION pg_background_prewarm_blocks(relation pg_catalog.regclass,
+					   first_block pg_catalog.int8,
+					   last_block pg_catalog.int8,
+					   hot pg_catalog.bool)
+    RETURNS pg_catalog.int8 STRICT
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE TABLE pg_background_hot_blocks (
+    relation pg_catalog.regclass NOT NULL,
+    block pg_catalog.int8 NOT NULL,
+    PRIMARY KEY (relation, block)
+);
+SELECT pg_catalog.pg_extension_config_dump('pg_background_hot_blocks', '');
+
+CREATE TABLE pg_background_verify_problems (
+    run_started pg_catalog.timestamptz NOT NULL,
+    owner pg_catalog.regrole NOT NULL DEFAULT CURRENT_USER::pg_catalog.regrole,
+    relation pg_catalog.regclass NOT NULL,
+    kind pg_catalog.text NOT NULL,
+    block pg_catalog.int8,
+    message pg_catalog.text
+);
+SELECT pg_catalog.pg_extension_config_dump('pg_background_verify_problems', '');
+
+-- What a run found is only shown to the role that ran it.
+ALTER TABLE pg_background_verify_problems ENABLE ROW LEVEL SECURITY;
+CREATE POLICY pg_background_verify_problems_owner ON pg_background_verify_problems
+    USING (pg_catalog.pg_has_role(owner::pg_catalog.oid, 'MEMBER'));
+
+CREATE FUNCTION pg_background_prewarm(relations pg_catalog.regclass[],
+				      degree pg_catalog.int4 DEFAULT 4)
+RETURNS pg_catalog.int8
+LANGUAGE plpgsql
+AS $function$
+/*
+ * Description: Loads the main fork of each relation into shared buffers
+ *              using degree background workers at once.  Each worker
+ *              gets an equal range of blocks of every relation.  The
+ *              blocks listed in pg_background_hot_blocks are loaded
+ *              first, for all relations, then the rest; loading stops
+ *              once shared buffers are full.
+ *
+ * Returns:
+ *     The number of blocks loaded.
+ */
+DECLARE
+    rel pg_catalog.regclass;
+    nblocks pg_catalog.int8;
+    first_block pg_catalog.int8;
+    last_block pg_catalog.int8;
+    calls pg_catalog.text[];
+    pids pg_catalog.int4[] := '{}';
+    pid pg_catalog.int4;
+    blocks pg_catalog.int8;
+    total pg_catalog.int8 := 0;
+    hot pg_catalog.bool;
+BEGIN
+    IF degree < 1 THEN
+      RAISE EXCEPTION 'degree must be at least 1';
+    END IF;
+
+    FOREACH hot IN ARRAY ARRAY[true, false] LOOP
+      pids := '{}';
+      FOR i IN 0 .. degree - 1 LOOP
+        calls := '{}';
+        FOREACH rel IN ARRAY relations LOOP
+          nblocks := pg_catalog.pg_relation_size(rel, 'main') /
+                     pg_catalog.current_setting('block_size')::pg_catalog.int8;
+          first_block := nblocks * i / degree;
+          last_block := nblocks * (i + 1) / degree - 1;
+          IF last_block >= first_block THEN
+            calls := calls || format('(pg_background_prewarm_blocks(%L::pg_catalog.regclass, %s, %s, %L))',
+                                     rel::pg_catalog.oid, first_block, last_block, hot);
+          END IF;
+        END LOOP;
+
+        IF pg_catalog.cardinality(calls) > 0 THEN
+          pids := pids || pg_background_launch(
+                    format('SELECT pg_catalog.sum(n)::pg_catalog.int8 FROM (VALUES %s) AS v(n)',
+                           pg_catalog.array_to_string(calls, ', ')));
+        END IF;
+      END LOOP;
+
+      FOREACH pid IN ARRAY pids LOOP
+        SELECT * INTO blocks FROM pg_background_result(pid) AS (blocks pg_catalog.int8);
+        total := total + blocks;
+      END LOOP;
+    END LOOP;
+
+    RETURN total;
+END;
+$function$;
+
+CREATE FUNCTION pg_background_table_diff(a pg_catalog.regclass,
+					 b pg_catalog.regclass,
+					 key pg_catalog.text,
+					 degree pg_catalog.int4 DEFAULT 4,
+					 leaf_rows pg_catalog.int8 DEFAULT 1000)
+RETURNS TABLE (key_value pg_catalog.text, difference pg_catalog.text)
+LANGUAGE plpgsql
+AS $function$
+/*
+ * Description: Compares tables a and b, which must have the same columns,
+ *              row by row on the column key, using up to degree
+ *              background workers at once.  Both tables are split into
+ *              key ranges whose rows are hashed by the workers; ranges
+ *              that differ are split again until they hold no more than
+ *              leaf_rows rows, and then compared row by row.  Ranges are
+ *              chosen from a sample of the keys, taken with TABLESAMPLE,
+ *              unless they hold few rows.  Rows with a NULL key are
+ *              ignored.
+ *
+ * Returns:
+ *     One row per differing key: 'only in a', 'only in b' or
+ *     'different'.
+ */
+DECLARE
+    keytype pg_catalog.text;
+    q_kind pg_catalog.text[] := ARRAY['split'];
+    q_lo pg_catalog.text[] := ARRAY[NULL];
+    q_hi pg_catalog.text[] := ARRAY[NULL];
+    q_cond pg_catalog.text[];
+    q_rows pg_catalog.float8[];
+    next_job pg_catalog.int4 := 1;
+    running_pid pg_catalog.int4[] := '{}';
+    running_job pg_catalog.int4[] := '{}';
+    pid pg_catalog.int4;
+    i pg_catalog.int4;
+    j pg_catalog.int4;
+    sample_rows pg_catalog.float8 := degree * 4 * 64;
+    sample pg_catalog.text;
+    bounds pg_catalog.text[];
+    lo pg_catalog.text;
+    count_a pg_catalog.int8;
+    count_b pg_catalog.int8;
+    hash_a pg_catalog.numeric;
+    hash_b pg_catalog.numeric;
+    row_hash CONSTANT pg_catalog.text :=
+      '(''x'' || pg_catalog.substr(pg_catalog.md5(t::pg_catalog.text), 1, 16))::pg_catalog.bit(64)::pg_catalog.int8::pg_catalog.numeric';
+BEGIN
+    IF degree < 1 OR leaf_rows < 1 THEN
+      RAISE EXCEPTION 'degree and leaf_rows must be at least 1'
+        USING ERRCODE = 'invalid_parameter_value';
+    END IF;
+
+    SELECT pg_catalog.format_type(atttypid, atttypmod) INTO keytype
+      FROM pg_catalog.pg_attribute
+     WHERE attrelid = a AND attname = key AND attnum > 0 AND NOT attisdropped;
+    IF keytype IS NULL THEN
+      RAISE EXCEPTION 'column "%" of relation % does not exist', key, a
+        USING ERRCODE = 'undefined_column';
+    END IF;
+    q_cond := ARRAY[format('t.%I IS NOT NULL', key)];
+
+    -- The planner's estimate of the rows in both tables, if it has one.
+    q_rows := ARRAY[(SELECT CASE WHEN pg_catalog.min(c.reltuples) > 0
+                                 THEN pg_catalog.sum(c.reltuples)::pg_catalog.float8 END
+                       FROM pg_catalog.pg_class c WHERE c.oid IN (a, b))];
+
+    WHILE next_job <= pg_catalog.cardinality(q_kind) OR
+          pg_catalog.cardinality(running_pid) > 0 LOOP
+      -- Split a range into sub-ranges holding about the same number of keys.
+      -- Sorting all the keys of a large range would hold up the workers, so
+      -- look at a sample of them instead, unless that finds no place to
+      -- split the range.
+      IF next_job <= pg_catalog.cardinality(q_kind) AND q_kind[next_job] = 'split' THEN
+        j := next_job;
+        next_job := next_job + 1;
+        sample := CASE WHEN q_rows[j] > 2 * sample_rows THEN
+                    format(' TABLESAMPLE SYSTEM (%s)', 100 * sample_rows / q_rows[j])
+                  ELSE '' END;
+        LOOP
+          EXECUTE format('SELECT pg_catalog.array_agg(m::pg_catalog.text ORDER BY m) FROM '
+                         '(SELECT DISTINCT pg_catalog.max(k) AS m FROM '
+                         '(SELECT k, pg_catalog.ntile(%s) OVER (ORDER BY k) AS n FROM '
+                         '(SELECT t.%I AS k FROM %s t%s WHERE %s '
+                         'UNION ALL SELECT t.%I FROM %s t%s WHERE %s) u) s GROUP BY n) s2',
+                         degree * 4, key, a, sample, q_cond[j], key, b, sample, q_cond[j])
+            INTO bounds;
+          EXIT WHEN sample = '' OR pg_catalog.cardinality(bounds) > 1;
+          sample := '';
+        END LOOP;
+        IF bounds IS NULL THEN
+          CONTINUE;
+        END IF;
+        -- A range holding a single key can't be narrowed down any further.
+        IF pg_catalog.cardinality(bounds) = 1 THEN
+          q_kind := q_kind || 'keys'::pg_catalog.text;
+          q_lo := q_lo || q_lo[j];
+          q_hi := q_hi || q_hi[j];
+          q_cond := q_cond || q_cond[j];
+          q_rows := q_rows || q_rows[j];
+          CONTINUE;
+        END IF;
+        lo := q_lo[j];
+        FOR i IN 1 .. pg_catalog.cardinality(bounds) LOOP
+          q_kind := q_kind || 'hash'::pg_catalog.text;
+          q_rows := q_rows || NULL::pg_catalog.float8;
+          q_lo := q_lo || lo;
+          q_hi := q_hi || CASE WHEN i = pg_catalog.cardinality(bounds) THEN q_hi[j] ELSE bounds[i] END;
+          q_cond := q_cond || (format('t.%I IS NOT NULL', key) ||
+                    CASE WHEN lo IS NULL THEN '' ELSE format(' AND t.%I > %L::%s', key, lo, keytype) END ||
+                    CASE WHEN q_hi[pg_catalog.cardinality(q_hi)] IS NULL THEN ''
+                         ELSE format(' AND t.%I <= %L::%s', key, q_hi[pg_catalog.cardinality(q_hi)], keytype) END);
+          lo := bounds[i];
+        END LOOP;
+        CONTINUE;
+      END IF;
+
+      -- Keep up to degree workers busy.
+      IF next_job <= pg_catalog.cardinality(q_kind) AND
+         pg_catalog.cardinality(running_pid) < degree THEN
+        IF q_kind[next_job] = 'hash' THEN
+          running_pid := running_pid || pg_background_launch(format(
+            'SELECT (SELECT pg_catalog.count(*) FROM %1$s t WHERE %3$s), '
+            '(SELECT pg_catalog.sum(%4$s) FROM %1$s t WHERE %3$s), '
+            '(SELECT pg_catalog.count(*) FROM %2$s t WHERE %3$s), '
+            '(SELECT pg_catalog.sum(%4$s) FROM %2$s t WHERE %3$s)',
+            a, b, q_cond[next_job], row_hash));
+        ELSE
+          running_pid := running_pid || pg_background_launch(format(
+            'SELECT COALESCE(x.k, y.k)::pg_catalog.text, '
+            'CASE WHEN x.k IS NULL THEN ''only in b'' WHEN y.k IS NULL THEN ''only in a'' '
+            'ELSE ''different'' END '
+            'FROM (SELECT t.%3$I AS k, pg_catalog.md5(t::pg_catalog.text) AS h FROM %1$s t WHERE %4$s) x '
+            'FULL JOIN (SELECT t.%3$I AS k, pg_catalog.md5(t::pg_catalog.text) AS h FROM %2$s t WHERE %4$s) y '
+            'ON x.k = y.k WHERE x.h IS DISTINCT FROM y.h',
+            a, b, key, q_cond[next_job]));
+        END IF;
+        running_job := running_job || next_job;
+        next_job := next_job + 1;
+        CONTINUE;
+      END IF;
+
+      -- Collect whichever running job finishes first.
+      pid := pg_background_wait_any(running_pid);
+      i := pg_catalog.array_position(running_pid, pid);
+      j := running_job[i];
+      running_pid := running_pid[1:i - 1] || running_pid[i + 1:pg_catalog.cardinality(running_pid)];
+      running_job := running_job[1:i - 1] || running_job[i + 1:pg_catalog.cardinality(running_job)];
+      IF q_kind[j] = 'hash' THEN
+        SELECT * INTO count_a, hash_a, count_b, hash_b
+          FROM pg_background_result(pid)
+               AS r(count_a pg_catalog.int8, hash_a pg_catalog.numeric,
+                    count_b pg_catalog.int8, hash_b pg_catalog.numeric);
+        IF count_a <> count_b OR hash_a IS DISTINCT FROM hash_b THEN
+          q_kind := q_kind ||
+            CASE WHEN GREATEST(count_a, count_b) <= leaf_rows THEN 'keys' ELSE 'split' END;
+          q_lo := q_lo || q_lo[j];
+          q_hi := q_hi || q_hi[j];
+          q_cond := q_cond || q_cond[j];
+          q_rows := q_rows || (count_a + count_b)::pg_catalog.float8;
+        END IF;
+      ELSE
+        RETURN QUERY
+          SELECT * FROM pg_background_result(pid)
+                   AS r(key_value pg_catalog.text, difference pg_catalog.text);
+      END IF;
+    END LOOP;
+END;
+$function$;
+
+CREATE FUNCTION pg_background_validate_constraints(relations pg_catalog.regclass[] DEFAULT NULL,
+						   degree pg_catalog.int4 DEFAULT 4)
+RETURNS TABLE (relation pg_catalog.regclass, constraint_name pg_catalog.name,
+	       duration pg_catalog.interval, result pg_catalog.text)
+LANGUAGE plpgsql
+AS $function$
+/*
+ * Description: Validates the foreign key and check constraints created
+ *              NOT VALID on the given relations (or in the whole
+ *              database, if relations is NULL), up to degree at once in
+ *              background workers, those on the largest tables first.
+ *              Validating takes a SHARE UPDATE EXCLUSIVE lock on the
+ *              table, so two constraints of the same table are never
+ *              validated at the same time.
+ *
+ * Returns:
+ *     One row per constraint, with the time its validation took and
+ *     'valid' or the error it failed with.
+ */
+DECLARE
+    job_rel pg_catalog.regclass[];
+    job_name pg_catalog.name[];
+    started pg_catalog.bool[];
+    started_at pg_catalog.timestamptz[];
+    running_pid pg_catalog.int4[] := '{}';
+    running_job pg_catalog.int4[] := '{}';
+    remaining pg_catalog.int4;
+    pid pg_catalog.int4;
+    i pg_catalog.int4;
+    j pg_catalog.int4;
+    k pg_catalog.int4;
+    took pg_catalog.interval;
+BEGIN
+    IF degree < 1 THEN
+      RAISE EXCEPTION 'degree must be at least 1'
+        USING ERRCODE = 'invalid_parameter_value';
+    END IF;
+
+    SELECT pg_catalog.array_agg(c.conrelid::pg_catalog.regclass ORDER BY pg_catalog.pg_relation_size(c.conrelid) DESC, c.oid),
+           pg_catalog.array_agg(c.conname ORDER BY pg_catalog.pg_relation_size(c.conrelid) DESC, c.oid)
+      INTO job_rel, job_name
+      FROM pg_catalog.pg_constraint c
+     WHERE c.contype IN ('f', 'c') AND NOT c.convalidated AND c.conrelid <> 0
+       AND (relations IS NULL OR c.conrelid = ANY (relations));
+    remaining := COALESCE(pg_catalog.cardinality(job_rel), 0);
+    started := pg_catalog.array_fill(false, ARRAY[remaining]);
+    started_at := pg_catalog.array_fill(NULL::pg_catalog.timestamptz, ARRAY[remaining]);
+
+    WHILE remaining > 0 OR pg_catalog.cardinality(running_pid) > 0 LOOP
+      -- Start the next constraint whose table nobody is validating yet.
+      k := NULL;
+      IF pg_catalog.cardinality(running_pid) < degree THEN
+        FOR i IN 1 .. pg_catalog.cardinality(job_rel) LOOP
+          IF NOT started[i] AND
+             NOT EXISTS (SELECT FROM pg_catalog.unnest(running_job) AS r(job)
+                          WHERE job_rel[r.job] = job_rel[i]) THEN
+            k := i;
+            EXIT;
+          END IF;
+        END LOOP;
+      END IF;
+
+      IF k IS NOT NULL THEN
+        running_pid := running_pid || pg_background_launch(format(
+          'ALTER TABLE %s VALIDATE CONSTRAINT %I; '
+          'SELECT pg_catalog.clock_timestamp() - pg_catalog.now()',
+          job_rel[k], job_name[k]));
+        running_job := running_job || k;
+        started[k] := true;
+        started_at[k] := pg_catalog.clock_timestamp();
+        remaining := remaining - 1;
+        CONTINUE;
+      END IF;
+
+      -- A worker that failed can't tell us how long it took, but since we
+      -- collect whichever finishes first, our own clock is close enough.
+      pid := pg_background_wait_any(running_pid);
+      i := pg_catalog.array_position(running_pid, pid);
+      j := running_job[i];
+      BEGIN
+        SELECT * INTO took FROM pg_background_result(pid)
+                                AS r(took pg_catalog.interval);
+        RETURN QUERY SELECT job_rel[j], job_name[j], took, 'valid'::pg_catalog.text;
+      EXCEPTION WHEN OTHERS THEN
+        RETURN QUERY SELECT job_rel[j], job_name[j],
+                            pg_catalog.clock_timestamp() - started_at[j], SQLERRM;
+      END;
+      running_pid := running_pid[1:i - 1] || running_pid[i + 1:pg_catalog.cardinality(running_pid)];
+      running_job := running_job[1:i - 1] || running_job[i + 1:pg_catalog.cardinality(running_job)];
+    END LOOP;
+END;
+$function$;
+
+CREATE FUNCTION pg_background_insert_inbound(target pg_catalog.regclass,
+					   leaves pg_catalog.regclass[])
+    RETURNS pg_catalog.int8 STRICT
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION pg_background_insert_partitioned(target pg_catalog.regclass,
+					   source_sql pg_catalog.text,
+					   degree pg_catalog.int4 DEFAULT 4)
+    RETURNS pg_catalog.int8 STRICT
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION pg_background_repartition_capture()
+RETURNS trigger
+LANGUAGE plpgsql
+AS $function$
+/*
+ * Description: Trigger that pg_background_repartition puts on the
+ *              source table while it copies it, recording the key
+ *              (column TG_ARGV[0]) of every row inserted, updated or
+ *              deleted in the log table TG_ARGV[1], so the change can be
+ *              replayed on the target afterwards.  A TRUNCATE can't be
+ *              replayed that way, and is refused.
+ */
+BEGIN
+    IF TG_OP = 'TRUNCATE' THEN
+      RAISE EXCEPTION 'cannot truncate "%" while it is being repartitioned', TG_TABLE_NAME
+        USING ERRCODE = 'object_in_use',
+              HINT = 'Delete the rows instead, or wait for the switch-over.';
+    END IF;
+    IF TG_OP <> 'INSERT' THEN
+      EXECUTE format('INSERT INTO %s (key) VALUES ($1)', TG_ARGV[1])
+        USING pg_catalog.to_jsonb(OLD) OPERATOR(pg_catalog.->>) TG_ARGV[0];
+    END IF;
+    IF TG_OP <> 'DELETE' THEN
+      EXECUTE format('INSERT INTO %s (key) VALUES ($1)', TG_ARGV[1])
+        USING pg_catalog.to_jsonb(NEW) OPERATOR(pg_catalog.->>) TG_ARGV[0];
+    END IF;
+    RETURN NULL;
+END;
+$function$;
+
+CREATE FUNCTION pg_background_tree()
+    RETURNS TABLE (pid pg_catalog.int4, parent_pid pg_catalog.int4,
+		   depth pg_catalog.int4)
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION pg_background_trace(pid pg_catalog.int4)
+    RETURNS TABLE (event_time pg_catalog.timestamptz, event pg_catalog.text,
+		   detail pg_catalog.text) STRICT
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION grant_pg_background_privileges(
+    user_name TEXT,
+    print_commands BOOLEAN DEFAULT FALSE
+)
+RETURNS BOOLEAN
+LANGUAGE plpgsql
+SECURITY DEFINER
+AS $function$
+/*
+ * Description: Grants the necessary privileges to a role for
+ *              using the pg_background extension.
+ *
+ * Arguments:
+ *     user_name: The name of the role to grant privileges to.
+ *     print_commands: If TRUE, prints the executed SQL commands.
+ *
+ * Returns:
+ *     TRUE if successful, FALSE otherwise.
+ */
+DECLARE
+    func TEXT;
+BEGIN
+
+    -- Grant execute permissions on pg_background functions
+    FOREACH func IN ARRAY ARRAY[
+        'pg_background_launch(pg_catalog.text, pg_catalog.int4)',
+        'pg_background_result(pg_catalog.int4)',
+        'pg_background_result_into(pg_catalog.int4, pg_catalog.regclass)',
+        'pg_background_detach(pg_catalog.int4)',
+        'pg_background_cancel(pg_catalog.int4)',
+        'pg_background_wait_any(pg_catalog.int4[])',
+        'pg_background_launch_chunked(pg_catalog.text, pg_catalog.text, pg_catalog.int4)',
+        'pg_background_selfbench(pg_catalog.int4, pg_catalog.int4, pg_catalog.int4)',
+        'pg_background_stats()',
+        'pg_background_stats_reset()',
+        'pg_background_prewarm_blocks(pg_catalog.regclass, pg_catalog.int8, pg_catalog.int8, pg_catalog.bool)',
+        'pg_background_prewarm(pg_catalog.regclass[], pg_catalog.int4)',
+        'pg_background_table_diff(pg_catalog.regclass, pg_catalog.regclass, pg_catalog.text, pg_catalog.int4, pg_catalog.int8)',
+        'pg_background_validate_constraints(pg_catalog.regclass[], pg_catalog.int4)',
+        'pg_background_insert_inbound(pg_catalog.regclass, pg_catalog.regclass[])',
+        'pg_background_insert_partitioned(pg_catalog.regclass, pg_catalog.text, pg_catalog.int4)',
+        'pg_background_repartition_capture()',
+        'pg_background_tree()',
+        'pg_background_trace(pg_catalog.int4)'
+    ]
+    LOOP
+      EXECUTE format('GRANT EXECUTE ON FUNCTION %s TO %I', func, user_name);
+      IF print_commands THEN
+        RAISE INFO 'Executed command: GRANT EXECUTE ON FUNCTION % TO %', func, user_name;
+      END IF;
+    END LOOP;
+
+    -- Chunked jobs record their progress as the launching role
+    EXECUTE format('GRANT SELECT, INSERT, UPDATE ON TABLE pg_background_checkpoints TO %I', user_name);
+    IF print_commands THEN
+      RAISE INFO 'Executed command: GRANT SELECT, INSERT, UPDATE ON TABLE pg_background_checkpoints TO %', user_name;
+    END IF;
+    EXECUTE format('GRANT USAGE ON SEQUENCE pg_background_checkpoints_lock_key_seq TO %I', user_name);
+    IF print_commands THEN
+      RAISE INFO 'Executed command: GRANT USAGE ON SEQUENCE pg_background_checkpoints_lock_key_seq TO %', user_name;
+    END IF;
+
+    -- Prewarming reads the hot blocks list as the launching role
+    EXECUTE format('GRANT SELECT, INSERT, DELETE ON TABLE pg_background_hot_blocks TO %I', user_name);
+    IF print_commands THEN
+      RAISE INFO 'Executed command: GRANT SELECT, INSERT, DELETE ON TABLE pg_background_hot_blocks TO %', user_name;
+    END IF;
+
+    -- Verify records its findings as the role running it
+    EXECUTE format('GRANT SELECT, INSERT, DELETE ON TABLE pg_background_verify_problems TO %I', user_name);
+    IF print_commands THEN
+      RAISE INFO 'Executed command: GRANT SELECT, INSERT, DELETE ON TABLE pg_background_verify_problems TO %', user_name;
+    END IF;
+
+    -- Procedures exist only from PostgreSQL 11 on
+    FOREACH func IN ARRAY ARRAY[
+        'pg_background_stream(pg_catalog.int4)',
+        'pg_background_verify(pg_catalog.text, pg_catalog.int4, pg_catalog.int8, pg_catalog.int8)',
+        'pg_background_repartition(pg_catalog.regclass, pg_catalog.regclass, pg_catalog.text, pg_catalog.int4, pg_catalog.int8, pg_catalog.bool)'
+    ]
+    LOOP
+      CONTINUE WHEN to_regprocedure(func) IS NULL;
+      EXECUTE format('GRANT EXECUTE ON PROCEDURE %s TO %I', func, user_name);
+      IF print_commands THEN
+        RAISE INFO 'Executed command: GRANT EXECUTE ON PROCEDURE % TO %', func, user_name;
+      END IF;
+    END LOOP;
+
+    RETURN TRUE;
+  EXCEPTION WHEN OTHERS THEN
+    RAISE NOTICE 'Error granting pg_background privileges to %: %', user_name, SQLERRM;
+    RETURN FALSE;
+END;
+$function$;
+
+CREATE OR REPLACE FUNCTION revoke_pg_background_privileges(
+    user_name TEXT,
+    print_commands BOOLEAN DEFAULT FALSE
+)
+RETURNS BOOLEAN
+LANGUAGE plpgsql
+SECURITY DEFINER
+AS $function$
+/*
+ * Description: Revokes the privileges previously granted to a role for
+ *              using the pg_background extension.
+ *
+ * Arguments:
+ *     user_name: The name of the role to revoke privileges from.
+ *     print_commands: If TRUE, prints the executed SQL commands.
+ *
+ * Returns:
+ *     TRUE if successful, FALSE otherwise.
+ */
+DECLARE
+    func TEXT;
+BEGIN
+  -- Enclose the main logic in a BEGIN block for exception handling
+  BEGIN
+    -- Revoke execute permissions on pg_background functions
+    FOREACH func IN ARRAY ARRAY[
+        'pg_background_launch(pg_catalog.text, pg_catalog.int4)',
+        'pg_background_result(pg_catalog.int4)',
+        'pg_background_result_into(pg_catalog.int4, pg_catalog.regclass)',
+        'pg_background_detach(pg_catalog.int4)',
+        'pg_background_cancel(pg_catalog.int4)',
+        'pg_background_wait_any(pg_catalog.int4[])',
+        'pg_background_launch_chunked(pg_catalog.text, pg_catalog.text, pg_catalog.int4)',
+        'pg_background_selfbench(pg_catalog.int4, pg_catalog.int4, pg_catalog.int4)',
+        'pg_background_stats()',
+        'pg_background_stats_reset()',
+        'pg_background_prewarm_blocks(pg_catalog.regclass, pg_catalog.int8, pg_catalog.int8, pg_catalog.bool)',
+        'pg_background_prewarm(pg_catalog.regclass[], pg_catalog.int4)',
+        'pg_background_table_diff(pg_catalog.regclass, pg_catalog.regclass, pg_catalog.text, pg_catalog.int4, pg_catalog.int8)',
+        'pg_background_validate_constraints(pg_catalog.regclass[], pg_catalog.int4)',
+        'pg_background_insert_inbound(pg_catalog.regclass, pg_catalog.regclass[])',
+        'pg_background_insert_partitioned(pg_catalog.regclass, pg_catalog.text, pg_catalog.int4)',
+        'pg_background_repartition_capture()',
+        'pg_background_tree()',
+        'pg_background_trace(pg_catalog.int4)'
+    ]
+    LOOP
+      EXECUTE format('REVOKE EXECUTE ON FUNCTION %s FROM %I', func, user_name);
+      IF print_commands THEN
+        RAISE INFO 'Executed command: REVOKE EXECUTE ON FUNCTION % FROM %', func, user_name;
+      END IF;
+    END LOOP;
+
+    EXECUTE format('REVOKE SELECT, INSERT, UPDATE ON TABLE pg_background_checkpoints FROM %I', user_name);
+    IF print_commands THEN
+      RAISE INFO 'Executed command: REVOKE SELECT, INSERT, UPDATE ON TABLE pg_background_checkpoints FROM %', user_name;
+    END IF;
+    EXECUTE format('REVOKE USAGE ON SEQUENCE pg_background_checkpoints_lock_key_seq FROM %I', user_name);
+    IF print_commands THEN
+      RAISE INFO 'Executed command: REVOKE USAGE ON SEQUENCE pg_background_checkpoints_lock_key_seq FROM %', user_name;
+    END IF;
+
+    EXECUTE format('REVOKE SELECT, INSERT, DELETE ON TABLE pg_background_hot_blocks FROM %I', user_name);
+    IF print_commands THEN
+      RAISE INFO 'Executed command: REVOKE SELECT, INSERT, DELETE ON TABLE pg_background_hot_blocks FROM %', user_name;
+    END IF;
+
+    EXECUTE format('REVOKE SELECT, INSERT, DELETE ON TABLE pg_background_verify_problems FROM %I', user_name);
+    IF print_commands THEN
+      RAISE INFO 'Executed command: REVOKE SELECT, INSERT, DELETE ON TABLE pg_background_verify_problems FROM %', user_name;
+    END IF;
+
+    -- Procedures exist only from PostgreSQL 11 on
+    FOREACH func IN ARRAY ARRAY[
+        'pg_background_stream(pg_catalog.int4)',
+        'pg_background_verify(pg_catalog.text, pg_catalog.int4, pg_catalog.int8, pg_catalog.int8)',
+        'pg_background_repartition(pg_catalog.regclass, pg_catalog.regclass, pg_catalog.text, pg_catalog.int4, pg_catalog.int8, pg_catalog.bool)'
+    ]
+    LOOP
+      CONTINUE WHEN to_regprocedure(func) IS NULL;
+      EXECUTE format('REVOKE EXECUTE ON PROCEDURE %s FROM %I', func, user_name);
+      IF print_commands THEN
+        RAISE INFO 'Executed command: REVOKE EXECUTE ON PROCEDURE % FROM %', func, user_name;
+      END IF;
+    END LOOP;
+
+    RETURN TRUE;
+  EXCEPTION WHEN OTHERS THEN
+    RAISE NOTICE 'Error revoking pg_background privileges from %: %', user_name, SQLERRM;
+    RETURN FALSE;
+  END;
+END;
+$function$;
+
+REVOKE ALL ON FUNCTION revoke_pg_background_privileges(pg_catalog.text, boolean)
+        FROM public;
+REVOKE ALL ON FUNCTION grant_pg_background_privileges(pg_catalog.text, boolean)
+        FROM public;
+REVOKE ALL ON FUNCTION pg_background_launch(pg_catalog.text, pg_catalog.int4)
+	FROM public;
+REVOKE ALL ON FUNCTION pg_background_result(pg_catalog.int4)
+	FROM public;
+REVOKE ALL ON FUNCTION pg_background_result_into(pg_catalog.int4, pg_catalog.regclass)
+	FROM public;
+REVOKE ALL ON FUNCTION pg_background_detach(pg_catalog.int4)
+	FROM public;
+REVOKE ALL ON FUNCTION pg_background_cancel(pg_catalog.int4)
+	FROM public;
+REVOKE ALL ON FUNCTION pg_background_wait_any(pg_catalog.int4[])
+	FROM public;
+REVOKE ALL ON FUNCTION pg_background_launch_chunked(pg_catalog.text, pg_catalog.text, pg_catalog.int4)
+	FROM public;
+REVOKE ALL ON FUNCTION pg_background_selfbench(pg_catalog.int4, pg_catalog.int4, pg_catalog.int4)
+	FROM public;
+REVOKE ALL ON FUNCTION pg_background_stats()
+	FROM public;
+REVOKE ALL ON FUNCTION pg_background_stats_reset()
+	FROM public;
+REVOKE ALL ON FUNCTION pg_background_prewarm_blocks(pg_catalog.regclass, pg_catalog.int8, pg_catalog.int8, pg_catalog.bool)
+	FROM public;
+REVOKE ALL ON FUNCTION pg_background_prewarm(pg_catalog.regclass[], pg_catalog.int4)
+	FROM public;
+REVOKE ALL ON FUNCTION pg_background_table_diff(pg_catalog.regclass, pg_catalog.regclass, pg_catalog.text, pg_catalog.int4, pg_catalog.int8)
+	FROM public;
+REVOKE ALL ON FUNCTION pg_background_validate_constraints(pg_catalog.regclass[], pg_catalog.int4)
+	FROM public;
+REVOKE ALL ON FUNCTION pg_background_insert_inbound(pg_catalog.regclass, pg_catalog.regclass[])
+	FROM public;
+REVOKE ALL ON FUNCTION pg_background_insert_partitioned(pg_catalog.regclass, pg_catalog.text, pg_catalog.int4)
+	FROM public;
+REVOKE ALL ON FUNCTION pg_background_repartition_capture()
+	FROM public;
+REVOKE ALL ON FUNCTION pg_background_tree()
+	FROM public;
+REVOKE ALL ON FUNCTION pg_background_trace(pg_catalog.int4)
+	FROM public;
+REVOKE ALL ON TABLE pg_background_checkpoints FROM public;
+REVOKE ALL ON SEQUENCE pg_background_checkpoints_lock_key_seq FROM public;
+REVOKE ALL ON TABLE pg_background_hot_blocks FROM public;
+REVOKE ALL ON TABLE pg_background_verify_problems FROM public;
+
+-- pg_background_stream relies on CALL not sending a result set of its own,
+-- and pg_background_verify and pg_background_repartition commit as they go,
+-- so they can only be created as procedures (PostgreSQL 11 and later).
+DO $do$
+BEGIN
+  IF current_setting('server_version_num')::int >= 110000 THEN
+    EXECUTE $sql$
+      CREATE PROCEDURE pg_background_stream(pid pg_catalog.int4)
+        AS 'MODULE_PATHNAME' LANGUAGE C
+    $sql$;
+    EXECUTE $sql$
+      REVOKE ALL ON PROCEDURE pg_background_stream(pg_catalog.int4)
+        FROM public
+    $sql$;
+    EXECUTE $sql$
+      CREATE PROCEDURE pg_background_verify(
+              scope pg_catalog.text DEFAULT 'all',
+              degree pg_catalog.int4 DEFAULT 4,
+              chunk_blocks pg_catalog.int8 DEFAULT 131072,
+              max_rate pg_catalog.int8 DEFAULT 0)
+      LANGUAGE plpgsql
+      AS $procedure$
+      /*
+       * Description: Checks the integrity of the current database with amcheck,
+       *              using up to degree background workers at once.  Heap
+       *              checks (verify_heapam) are split into ranges of
+       *              chunk_blocks blocks; each btree index is checked as a
+       *              whole (bt_index_check).  If max_rate is not 0, each
+       *              worker pauses so as to check at most max_rate blocks
+       *              per second.  Each problem found is recorded in
+       *              pg_background_verify_problems, and committed as soon as
+       *              the check that found it is collected, so that a long run
+       *              holds no snapshot for longer than one check and whatever
+       *              it has found survives it being interrupted.  An index
+       *              check that fails reports its error as the message.
+       */
+      DECLARE
+          started_at pg_catalog.timestamptz := pg_catalog.now();
+          problems pg_catalog.int8 := 0;
+          found_now pg_catalog.int8;
+          job_sql pg_catalog.text[] := '{}';
+          job_rel pg_catalog.regclass[] := '{}';
+          job_kind pg_catalog.text[] := '{}';
+          job_blocks pg_catalog.int8[] := '{}';
+          running_pid pg_catalog.int4[] := '{}';
+          running_job pg_catalog.int4[] := '{}';
+          next_job pg_catalog.int4 := 1;
+          done_blocks pg_catalog.int8 := 0;
+          pid pg_catalog.int4;
+          i pg_catalog.int4;
+          j pg_catalog.int4;
+          r record;
+          nblocks pg_catalog.int8;
+          first_block pg_catalog.int8;
+      BEGIN
+          IF scope NOT IN ('heap', 'indexes', 'all') THEN
+            RAISE EXCEPTION 'scope must be "heap", "indexes" or "all"'
+              USING ERRCODE = 'invalid_parameter_value';
+          END IF;
+          IF degree < 1 OR chunk_blocks < 1 OR max_rate < 0 THEN
+            RAISE EXCEPTION 'degree and chunk_blocks must be at least 1, and max_rate must not be negative'
+              USING ERRCODE = 'invalid_parameter_value';
+          END IF;
+          -- bt_index_check is overloaded, so to_regproc() can't find it.
+          IF to_regprocedure('bt_index_check(pg_catalog.regclass)') IS NULL OR
+             (scope <> 'indexes' AND
+              to_regprocedure('verify_heapam(pg_catalog.regclass, pg_catalog.bool, pg_catalog.bool, pg_catalog.text, pg_catalog.int8, pg_catalog.int8)') IS NULL) THEN
+            RAISE EXCEPTION 'pg_background_verify requires the amcheck extension'
+              USING HINT = 'Heap checks need amcheck 1.3 (PostgreSQL 14) or later.';
+          END IF;
+
+          IF scope <> 'indexes' THEN
+            FOR r IN SELECT c.oid::pg_catalog.regclass AS rel,
+                            pg_catalog.pg_relation_size(c.oid, 'main') /
+                            pg_catalog.current_setting('block_size')::pg_catalog.int8 AS nblocks
+                       FROM pg_catalog.pg_class c
+                      WHERE c.relkind IN ('r', 'm', 't') AND c.relpersistence <> 't'
+                      ORDER BY 2 DESC
+            LOOP
+              first_block := 0;
+              WHILE first_block < r.nblocks LOOP
+                -- TOAST tables are on the list themselves, so don't follow TOAST
+                -- pointers as well.
+                job_sql := job_sql ||
+                           format('SELECT blkno, msg FROM verify_heapam(%L::pg_catalog.regclass, check_toast := false, startblock := %s, endblock := %s)',
+                                  r.rel::pg_catalog.oid, first_block,
+                                  LEAST(first_block + chunk_blocks, r.nblocks) - 1);
+                job_rel := job_rel || r.rel;
+                job_kind := job_kind || 'heap'::pg_catalog.text;
+                job_blocks := job_blocks || LEAST(chunk_blocks, r.nblocks - first_block);
+                first_block := first_block + chunk_blocks;
+              END LOOP;
+            END LOOP;
+          END IF;
+
+          IF scope <> 'heap' THEN
+            FOR r IN SELECT c.oid::pg_catalog.regclass AS rel,
+                            pg_catalog.pg_relation_size(c.oid, 'main') /
+                            pg_catalog.current_setting('block_size')::pg_catalog.int8 AS nblocks
+                       FROM pg_catalog.pg_class c
+                       JOIN pg_catalog.pg_index i ON i.indexrelid = c.oid
+                       JOIN pg_catalog.pg_am a ON a.oid = c.relam
+                      WHERE a.amname = 'btree' AND i.indisvalid AND i.indisready
+                        AND c.relpersistence <> 't'
+                      ORDER BY 2 DESC
+            LOOP
+              job_sql := job_sql ||
+                         format('SELECT bt_index_check(%L::pg_catalog.regclass); SELECT NULL::pg_catalog.int8, NULL::pg_catalog.text WHERE false',
+                                r.rel::pg_catalog.oid);
+              job_rel := job_rel || r.rel;
+              job_kind := job_kind || 'index'::pg_catalog.text;
+              job_blocks := job_blocks || r.nblocks;
+            END LOOP;
+          END IF;
+
+          -- Keep up to degree workers busy, collecting whichever finishes first.
+          -- To keep to max_rate, a worker taking over from one that has finished
+          -- first pauses for as long as checking its predecessor's blocks should
+          -- have taken; the first degree checks start right away.
+          WHILE next_job <= pg_catalog.cardinality(job_sql) OR
+                pg_catalog.cardinality(running_pid) > 0 LOOP
+            IF next_job <= pg_catalog.cardinality(job_sql) AND
+               pg_catalog.cardinality(running_pid) < degree THEN
+              running_pid := running_pid || pg_background_launch(
+                CASE WHEN max_rate > 0 AND done_blocks > 0 THEN
+                  format('SELECT pg_catalog.pg_sleep(%s); ',
+                         done_blocks::pg_catalog.float8 / max_rate)
+                ELSE '' END || job_sql[next_job]);
+              running_job := running_job || next_job;
+              next_job := next_job + 1;
+              done_blocks := 0;
+              CONTINUE;
+            END IF;
+
+            pid := pg_background_wait_any(running_pid);
+            i := pg_catalog.array_position(running_pid, pid);
+            j := running_job[i];
+            BEGIN
+              INSERT INTO pg_background_verify_problems (run_started, relation, kind, block, message)
+                SELECT started_at, job_rel[j], job_kind[j], v.block, v.message
+                  FROM pg_background_result(pid)
+                       AS v(block pg_catalog.int8, message pg_catalog.text);
+              GET DIAGNOSTICS found_now = ROW_COUNT;
+            EXCEPTION WHEN OTHERS THEN
+              INSERT INTO pg_background_verify_problems (run_started, relation, kind, message)
+                VALUES (started_at, job_rel[j], job_kind[j], SQLERRM);
+              found_now := 1;
+            END;
+            COMMIT;
+            problems := problems + found_now;
+            running_pid := running_pid[1:i - 1] || running_pid[i + 1:pg_catalog.cardinality(running_pid)];
+            running_job := running_job[1:i - 1] || running_job[i + 1:pg_catalog.cardinality(running_job)];
+            done_blocks := job_blocks[j];
+          END LOOP;
+
+          IF problems > 0 THEN
+            RAISE WARNING 'problems found by pg_background_verify: %', problems
+              USING HINT = format('They are listed in pg_background_verify_problems with run_started %s.', started_at);
+          END IF;
+      END;
+      $procedure$;
+    $sql$;
+    EXECUTE $sql$
+      REVOKE ALL ON PROCEDURE pg_background_verify(pg_catalog.text, pg_catalog.int4, pg_catalog.int8, pg_catalog.int8)
+        FROM public
+    $sql$;
+    EXECUTE $sql$
+      CREATE PROCEDURE pg_background_repartition(
+        src pg_catalog.regclass,
+        dst pg_catalog.regclass,
+        key pg_catalog.text,
+        degree pg_catalog.int4 DEFAULT 4,
+        chunk_rows pg_catalog.int8 DEFAULT 10000,
+        switch_over pg_catalog.bool DEFAULT true)
+      LANGUAGE plpgsql
+      AS $procedure$
+      /*
+       * Description: Copies the plain table src into the partitioned table dst
+       *              while src stays in use.  The key range of src is split
+       *              into degree parts, each copied by a resumable chunked job
+       *              committing every chunk_rows rows; a trigger on src logs
+       *              the keys of rows changed meanwhile (and refuses TRUNCATE),
+       *              and those rows are copied again afterwards, in up to
+       *              max_passes passes.  Each phase commits on its own, so no
+       *              snapshot is held for longer than one of them.  If
+       *              switch_over is true and the log has been caught up, src is
+       *              then locked, the last changes are copied, and dst takes
+       *              the place of src, which is renamed to <name>_old: dst
+       *              gets the owner and privileges of src, views on src are
+       *              redefined over dst, and foreign keys referring to src
+       *              are recreated NOT VALID referring to dst.  The split is
+       *              taken from a sample of the keys.  Calling it again for
+       *              the same tables resumes where it stopped, using the
+       *              split chosen by the first call.
+       */
+      DECLARE
+          max_passes CONSTANT pg_catalog.int4 := 10;
+          job pg_catalog.text;
+          log_table pg_catalog.text;
+          key_type pg_catalog.text;
+          key_not_null pg_catalog.bool;
+          cols pg_catalog.text;
+          src_cols pg_catalog.text;
+          plan pg_catalog.text;
+          bounds pg_catalog.text[];
+          lo pg_catalog.text;
+          hi pg_catalog.text;
+          pids pg_catalog.int4[] := '{}';
+          pid pg_catalog.int4;
+          replayed pg_catalog.int8;
+          pass pg_catalog.int4 := 0;
+          replay_sql pg_catalog.text;
+          src_schema pg_catalog.name;
+          src_name pg_catalog.name;
+          dst_schema pg_catalog.name;
+          writers pg_catalog.text;
+          est_rows pg_catalog.float8;
+          sample_rows pg_catalog.float8 := degree * 256;
+          sample pg_catalog.text;
+          fixups pg_catalog.text[];
+          fixup pg_catalog.text;
+      BEGIN
+          IF degree < 1 THEN
+            RAISE EXCEPTION 'degree must be at least 1'
+              USING ERRCODE = 'invalid_parameter_value';
+          END IF;
+          IF chunk_rows < 1 THEN
+            RAISE EXCEPTION 'chunk_rows must be at least 1'
+              USING ERRCODE = 'invalid_parameter_value';
+          END IF;
+          IF (SELECT c.relkind FROM pg_catalog.pg_class c WHERE c.oid = dst) <> 'p' THEN
+            RAISE EXCEPTION '"%" is not a partitioned table', dst
+              USING ERRCODE = 'wrong_object_type';
+          END IF;
+
+          SELECT pg_catalog.format_type(a.atttypid, a.atttypmod), a.attnotnull
+            INTO key_type, key_not_null
+            FROM pg_catalog.pg_attribute a
+           WHERE a.attrelid = src AND a.attname = key AND a.attnum > 0 AND NOT a.attisdropped;
+          IF NOT FOUND THEN
+            RAISE EXCEPTION 'column "%" of relation "%" does not exist', key, src
+              USING ERRCODE = 'undefined_column';
+          END IF;
+          IF NOT key_not_null THEN
+            RAISE EXCEPTION 'column "%" of relation "%" must be NOT NULL', key, src
+              USING ERRCODE = 'invalid_parameter_value';
+          END IF;
+
+          SELECT pg_catalog.string_agg(pg_catalog.quote_ident(a.attname), ', ' ORDER BY a.attnum),
+                 pg_catalog.string_agg('s.' || pg_catalog.quote_ident(a.attname), ', ' ORDER BY a.attnum)
+            INTO cols, src_cols
+            FROM pg_catalog.pg_attribute a
+           WHERE a.attrelid = src AND a.attnum > 0 AND NOT a.attisdropped;
+          SELECT n.nspname, c.relname INTO src_schema, src_name
+            FROM pg_catalog.pg_class c JOIN pg_catalog.pg_namespace n ON n.oid = c.relnamespace
+           WHERE c.oid = src;
+          SELECT n.nspname INTO dst_schema
+            FROM pg_catalog.pg_class c JOIN pg_catalog.pg_namespace n ON n.oid = c.relnamespace
+           WHERE c.oid = dst;
+          job := format('repartition_%s_%s', src::pg_catalog.oid, dst::pg_catalog.oid);
+          log_table := format('%I.%I', dst_schema, job || '_log');
+
+          -- The first call splits the key range, and sets up the change log,
+          -- committing all of it at once in a worker so that a rerun finds it.
+          -- The split only needs to be roughly even, so unless src is small it is
+          -- taken from a sample of its keys rather than by sorting all of them.
+          -- The trigger logs changes as the role making them, so whoever may
+          -- write to src, and nobody else, may add to the log.
+          SELECT c.last_key INTO plan FROM pg_background_checkpoints c WHERE c.job_id = job;
+          IF NOT FOUND THEN
+            SELECT GREATEST(c.reltuples,
+                            pg_catalog.pg_relation_size(c.oid) /
+                            pg_catalog.current_setting('block_size')::pg_catalog.int8)
+              INTO est_rows
+              FROM pg_catalog.pg_class c WHERE c.oid = src;
+            sample := CASE WHEN est_rows > 2 * sample_rows THEN
+                        format(' TABLESAMPLE SYSTEM (%s)', 100 * sample_rows / est_rows)
+                      ELSE '' END;
+            EXECUTE format('SELECT pg_catalog.array_agg(b::pg_catalog.text ORDER BY b)::pg_catalog.text
+                              FROM (SELECT pg_catalog.max(%1$I) AS b
+                                      FROM (SELECT %1$I, pg_catalog.ntile(%2$s) OVER (ORDER BY %1$I) AS t
+                                              FROM %3$s%4$s) s
+                                     GROUP BY t) s',
+                           key, degree, src, sample)
+              INTO plan;
+            plan := COALESCE(plan, '{}');
+
+            SELECT pg_catalog.string_agg(DISTINCT CASE WHEN w.grantee = 0 THEN 'PUBLIC'
+                                         ELSE pg_catalog.quote_ident(pg_catalog.pg_get_userbyid(w.grantee)) END,
+                                         ', ')
+              INTO writers
+              FROM (SELECT c.relowner AS grantee FROM pg_catalog.pg_class c WHERE c.oid = src
+                    UNION
+                    SELECT a.grantee
+                      FROM pg_catalog.pg_class c, pg_catalog.aclexplode(c.relacl) a
+                     WHERE c.oid = src AND a.privilege_type IN ('INSERT', 'UPDATE', 'DELETE')) w;
+
+            PERFORM * FROM pg_background_result(pg_background_launch(format(
+              'CREATE TABLE %1$s (key pg_catalog.text); '
+              'GRANT INSERT ON %1$s TO %7$s; '
+              'CREATE TRIGGER pg_background_repartition AFTER INSERT OR UPDATE OR DELETE ON %2$s '
+              'FOR EACH ROW EXECUTE PROCEDURE pg_background_repartition_capture(%3$L, %4$L); '
+              'CREATE TRIGGER pg_background_repartition_truncate BEFORE TRUNCATE ON %2$s '
+              'FOR EACH STATEMENT EXECUTE PROCEDURE pg_background_repartition_capture(%3$L, %4$L); '
+              'INSERT INTO pg_background_checkpoints (job_id, last_key) VALUES (%5$L, %6$L)',
+              log_table, src, key, log_table, job, plan, writers))) AS r(result pg_catalog.text);
+          END IF;
+          COMMIT;
+
+          -- Copy each range in its own chunked job; the last range's upper end
+          -- is open, so rows added since the split are copied too.
+          bounds := plan::pg_catalog.text[];
+          bounds := bounds[1:COALESCE(pg_catalog.cardinality(bounds), 0) - 1];
+          FOR i IN 1 .. COALESCE(pg_catalog.cardinality(bounds), 0) + 1 LOOP
+            IF i = 1 THEN
+              lo := format('($1 IS NULL OR s.%1$I > $1::%2$s)', key, key_type);
+            ELSE
+              lo := format('s.%1$I > COALESCE($1::%2$s, %3$L::%2$s)', key, key_type, bounds[i - 1]);
+            END IF;
+            IF i > COALESCE(pg_catalog.cardinality(bounds), 0) THEN
+              hi := 'true';
+            ELSE
+              hi := format('s.%1$I <= %2$L::%3$s', key, bounds[i], key_type);
+            END IF;
+            pids := pids || pg_background_launch_chunked(job || '_' || i, format(
+              'WITH upto AS ('
+              '  SELECT pg_catalog.max(k) AS k'
+              '    FROM (SELECT s.%1$I AS k FROM %2$s s WHERE %3$s AND %4$s'
+              '           ORDER BY s.%1$I LIMIT %5$s) c), '
+              'ins AS ('
+              '  INSERT INTO %6$s (%7$s)'
+              '  SELECT %8$s FROM %2$s s, upto WHERE %3$s AND s.%1$I <= upto.k) '
+              'SELECT k::pg_catalog.text FROM upto WHERE k IS NOT NULL',
+              key, src, lo, hi, chunk_rows, dst, cols, src_cols));
+          END LOOP;
+          COMMIT;
+          FOREACH pid IN ARRAY pids LOOP
+            PERFORM * FROM pg_background_result(pid) AS r(result pg_catalog.text);
+            COMMIT;
+          END LOOP;
+
+          -- Copy the rows changed since, until the log is nearly caught up.  If
+          -- src changes faster than that, max_passes passes are as far as it goes,
+          -- rather than chasing the log forever or locking src while it is long.
+          -- The %1$s left in replay_sql stands for the table listing the keys.
+          replay_sql := format(
+            'DELETE FROM %1$s WHERE %2$I IN (SELECT key::%3$s FROM %%1$s); '
+            'INSERT INTO %1$s (%4$s) SELECT %4$s FROM %5$s WHERE %2$I IN (SELECT key::%3$s FROM %%1$s)',
+            dst, key, key_type, cols, src);
+          LOOP
+            SELECT * INTO replayed FROM pg_background_result(pg_background_launch(format(
+              'CREATE TEMPORARY TABLE pg_background_replay (key pg_catalog.text) ON COMMIT DROP; '
+              'WITH d AS (DELETE FROM %1$s RETURNING key) '
+              'INSERT INTO pg_background_replay SELECT DISTINCT key FROM d; '
+              '%2$s; '
+              'SELECT pg_catalog.count(*) FROM pg_background_replay',
+              log_table, format(replay_sql, 'pg_background_replay')))) AS r(replayed pg_catalog.int8);
+            COMMIT;
+            pass := pass + 1;
+            EXIT WHEN replayed < chunk_rows OR pass >= max_passes;
+          END LOOP;
+
+          IF NOT switch_over THEN
+            RETURN;
+          END IF;
+          IF replayed >= chunk_rows THEN
+            RAISE EXCEPTION 'changes to "%" are coming in faster than they are copied', src_name
+              USING ERRCODE = 'object_in_use',
+                    HINT = 'Call pg_background_repartition again when there is less write traffic.';
+          END IF;
+
+          -- Stop all writes to src, copy the last changes, and swap the tables.
+          EXECUTE format('LOCK TABLE %s IN ACCESS EXCLUSIVE MODE', src);
+          EXECUTE format(replay_sql, log_table);
+          EXECUTE format('DROP TRIGGER pg_background_repartition ON %s', src);
+          EXECUTE format('DROP TRIGGER pg_background_repartition_truncate ON %s', src);
+          EXECUTE format('DROP TABLE %s', log_table);
+
+          -- Whatever refers to src does so by OID, and would follow it to its new
+          -- name.  Write down now, while their definitions still name src, how to
+          -- point views and foreign keys at dst once it has taken src's name.
+          SELECT pg_catalog.array_agg(f.cmd ORDER BY f.ord)
+            INTO fixups
+            FROM (SELECT 1 AS ord,
+                         format('ALTER TABLE %s DROP CONSTRAINT %I', c.conrelid::pg_catalog.regclass, c.conname) ||
+                         format('; ALTER TABLE %s ADD CONSTRAINT %I %s%s', c.conrelid::pg_catalog.regclass, c.conname,
+                                pg_catalog.pg_get_constraintdef(c.oid),
+                                CASE WHEN c.convalidated THEN ' NOT VALID' ELSE '' END) AS cmd
+                    FROM pg_catalog.pg_constraint c
+                   WHERE c.contype = 'f' AND c.confrelid = src AND c.conrelid <> src
+                  UNION ALL
+                  SELECT DISTINCT 0,
+                         format('CREATE OR REPLACE VIEW %s%s AS %s', v.oid::pg_catalog.regclass,
+                                CASE WHEN v.reloptions IS NULL THEN ''
+                                     ELSE format(' WITH (%s)', pg_catalog.array_to_string(v.reloptions, ', ')) END,
+                                pg_catalog.pg_get_viewdef(v.oid))
+                    FROM pg_catalog.pg_depend d
+                    JOIN pg_catalog.pg_rewrite r ON r.oid = d.objid
+                    JOIN pg_catalog.pg_class v ON v.oid = r.ev_class
+                   WHERE d.classid = 'pg_catalog.pg_rewrite'::pg_catalog.regclass
+                     AND d.refclassid = 'pg_catalog.pg_class'::pg_catalog.regclass
+                     AND d.refobjid = src AND v.oid <> src AND v.relkind = 'v') f;
+          PERFORM 1 FROM pg_catalog.pg_depend d
+            JOIN pg_catalog.pg_rewrite r ON r.oid = d.objid
+            JOIN pg_catalog.pg_class v ON v.oid = r.ev_class
+           WHERE d.classid = 'pg_catalog.pg_rewrite'::pg_catalog.regclass
+             AND d.refclassid = 'pg_catalog.pg_class'::pg_catalog.regclass
+             AND d.refobjid = src AND v.relkind = 'm';
+          IF FOUND THEN
+            RAISE WARNING 'materialized views on "%" still refer to the old table', src_name
+              USING HINT = 'Recreate them once the switch-over is done.';
+          END IF;
+
+          -- dst takes over the owner and privileges of src, too.
+          FOR fixup IN
+            SELECT format('GRANT %s ON %s TO %s%s', a.privilege_type, dst,
+                          CASE WHEN a.grantee = 0 THEN 'PUBLIC'
+                               ELSE pg_catalog.quote_ident(pg_catalog.pg_get_userbyid(a.grantee)) END,
+                          CASE WHEN a.is_grantable THEN ' WITH GRANT OPTION' ELSE '' END)
+              FROM pg_catalog.pg_class c, pg_catalog.aclexplode(c.relacl) a
+             WHERE c.oid = src AND a.grantee <> c.relowner
+          LOOP
+            EXECUTE fixup;
+          END LOOP;
+          EXECUTE format('ALTER TABLE %s OWNER TO %I', dst,
+                         (SELECT pg_catalog.pg_get_userbyid(c.relowner) FROM pg_catalog.pg_class c WHERE c.oid = src));
+
+          EXECUTE format('ALTER TABLE %s RENAME TO %I', src, src_name || '_old');
+          IF dst_schema <> src_schema THEN
+            EXECUTE format('ALTER TABLE %s SET SCHEMA %I', dst, src_schema);
+          END IF;
+          EXECUTE format('ALTER TABLE %s RENAME TO %I', dst, src_name);
+          FOREACH fixup IN ARRAY COALESCE(fixups, '{}') LOOP
+            EXECUTE fixup;
+          END LOOP;
+          DELETE FROM pg_background_checkpoints c
+           WHERE c.job_id = job OR c.job_id LIKE job || '\_%';
+      END;
+      $procedure$;
+    $sql$;
+    EXECUTE $sql$
+      REVOKE ALL ON PROCEDURE pg_background_repartition(pg_catalog.regclass, pg_catalog.regclass, pg_catalog.text, pg_catalog.int4, pg_catalog.int8, pg_catalog.bool)
+        FROM public
+    $sql$;
+  END IF;
+END;
+$do$;
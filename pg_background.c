@@ -13,51 +13,252 @@
 
 #include "postgres.h"
 
+#include <limits.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <sys/resource.h>
+#include <sys/time.h>
+#endif
+#include <unistd.h>
+
 #include "fmgr.h"
 
+#include "access/heapam.h"
 #include "access/htup_details.h"
 #include "access/printtup.h"
 #include "access/xact.h"
+#if PG_VERSION_NUM >= 120000
+#include "access/table.h"
+#include "access/tableam.h"
+#endif
+#include "catalog/namespace.h"
+#include "catalog/objectaddress.h"
+#include "catalog/pg_authid.h"
+#include "catalog/pg_inherits.h"
 #include "catalog/pg_type.h"
 #include "commands/async.h"
+#include "commands/trigger.h"
 #include "commands/dbcommands.h"
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#elif PG_VERSION_NUM >= 120000
+#include "utils/hashutils.h"
+#else
+#include "access/hash.h"
+#endif
+#include "executor/executor.h"
+#include "executor/spi.h"
+#if PG_VERSION_NUM >= 120000
+#include "executor/execPartition.h"
+#include "executor/nodeModifyTable.h"
+#endif
 #include "funcapi.h"
 #include "libpq/libpq.h"
 #include "libpq/pqformat.h"
 #include "libpq/pqmq.h"
 #include "miscadmin.h"
+#if PG_VERSION_NUM >= 160000
+#include "nodes/queryjumble.h"
+#elif PG_VERSION_NUM >= 140000
+#include "utils/queryjumble.h"
+#endif
 #include "parser/analyze.h"
+#if PG_VERSION_NUM >= 160000
+#include "parser/parse_relation.h"
+#endif
+#include "parser/scanner.h"
 #include "pgstat.h"
+#if PG_VERSION_NUM >= 150000
+#include "utils/pgstat_internal.h"
+#endif
+#include "portability/instr_time.h"
+#include "port/atomics.h"
+#include "storage/buf_internals.h"
+#include "storage/bufmgr.h"
 #include "storage/dsm.h"
+#include "storage/fd.h"
 #include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/procarray.h"
 #include "storage/shm_mq.h"
 #include "storage/shm_toc.h"
+#include "storage/spin.h"
 #include "tcop/pquery.h"
+#include "tcop/tcopprot.h"
 #include "tcop/utility.h"
 #include "utils/builtins.h"
+#include "utils/guc.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
 #include "utils/ps_status.h"
+#include "utils/rel.h"
+#include "utils/rls.h"
 #include "utils/snapmgr.h"
 #include "utils/timeout.h"
+#include "utils/timestamp.h"
 #include "utils/syscache.h"
 #include "utils/acl.h"
+#include "utils/array.h"
 #ifdef WIN32
 #include "windows/pg_background_win.h"
 #endif	/* // WIN32 */
 
 #include "pg_background.h"
+#include "pg_background_api.h"
 
 /*  Define constants for magic numbers */
 #define SQL_TERMINATOR_LEN 1
 
+/*
+ * Number of rows pg_background_result_into, and the workers of
+ * pg_background_insert_partitioned for each partition, buffer before writing
+ * them out with table_multi_insert.  Same as the batch size used by COPY FROM.
+ */
+#define PG_BACKGROUND_MULTI_INSERT_TUPLES	1000
+
+/*
+ * Size of the slot in which a worker hands back results small enough that
+ * they need not go through the message queue at all.  A command tag or a
+ * single narrow row fits comfortably.
+ */
+#define PG_BACKGROUND_INLINE_SIZE		512
+
+/*
+ * Messages in the inline slot and in the ring transport are framed as a type
+ * byte followed by a length word.
+ */
+#define PG_BACKGROUND_MSG_HDRSZ			(1 + sizeof(uint32))
+
 /* Table-of-contents constants for our dynamic shared memory segment. */
 #define PG_BACKGROUND_MAGIC				0x50674267
 #define PG_BACKGROUND_KEY_FIXED_DATA	0
 #define PG_BACKGROUND_KEY_SQL			1
 #define PG_BACKGROUND_KEY_GUC			2
 #define PG_BACKGROUND_KEY_QUEUE			3
-#define PG_BACKGROUND_NKEYS				4
+#define PG_BACKGROUND_KEY_CONTROL_TO_LAUNCHER	4
+#define PG_BACKGROUND_KEY_CONTROL_TO_WORKER		5
+#define PG_BACKGROUND_KEY_INBOUND		6
+#define PG_BACKGROUND_NKEYS				7
+
+/*
+ * Besides the queue (or ring) carrying the result, each worker gets a small
+ * control queue in each direction, so that control traffic never has to wait
+ * behind result rows the launcher hasn't read yet.  Every control message is
+ * a type byte followed by its payload.
+ */
+#define PG_BACKGROUND_CONTROL_QUEUE_SIZE	8192
+
+#define PG_BACKGROUND_CONTROL_ERROR		'E' /* worker's ErrorResponse */
+#define PG_BACKGROUND_CONTROL_STATS		'S' /* timings for one statement */
+
+/*
+ * Workers fed rows by pg_background_insert_partitioned get a further queue,
+ * on which the launcher sends a RowDescription, the DataRows and finally a
+ * CopyDone ('c') once there are no more.  The worker reads them back with
+ * pg_background_insert_inbound.
+ */
+#define PG_BACKGROUND_INBOUND_QUEUE_SIZE	(256 * 1024)
+
+/*
+ * Phases of executing a statement that workers time and report in their
+ * statistics messages.  Send-blocked time, spent waiting for the launcher to
+ * make room for result rows, is part of PortalRun time.
+ */
+typedef enum
+{
+	PG_BACKGROUND_PHASE_PARSE,
+	PG_BACKGROUND_PHASE_ANALYZE,
+	PG_BACKGROUND_PHASE_PLAN,
+	PG_BACKGROUND_PHASE_PORTAL_START,
+	PG_BACKGROUND_PHASE_PORTAL_RUN,
+	PG_BACKGROUND_PHASE_SEND_BLOCKED,
+	PG_BACKGROUND_NPHASES
+}			pg_background_phase;
+
+/* Bytes of a statement's text that go with its statistics, at most. */
+#define PG_BACKGROUND_STATS_QUERY_LEN	256
+
+/*
+ * Orphaned workers that spool their output write it to files in this
+ * directory, relative to the data directory.  Files are named after the
+ * worker's PID and the postmaster's start time, so that neither a file left
+ * from before a restart nor one left by an earlier worker with the same PID
+ * can pass for the output of a later worker.  Output is collected in a
+ * buffer of PG_BACKGROUND_SPOOL_BUFFER_SIZE bytes before being written.
+ */
+#define PG_BACKGROUND_SPOOL_DIR			"pg_background"
+#define PG_BACKGROUND_SPOOL_BUFFER_SIZE	65536
+
+/* What a worker does once the backend that launched it stops listening. */
+typedef enum
+{
+	PG_BACKGROUND_ORPHAN_CANCEL,
+	PG_BACKGROUND_ORPHAN_CONTINUE,
+	PG_BACKGROUND_ORPHAN_SPOOL
+}			pg_background_orphan_policy_type;
+
+/* Header of a spool file; the messages follow, framed as in the ring. */
+typedef struct pg_background_spool_header
+{
+	uint32		magic;
+	Oid			database_id;
+	Oid			user_id;
+}			pg_background_spool_header;
+
+/* Ways of getting protocol messages from the worker to the launcher. */
+typedef enum
+{
+	PG_BACKGROUND_TRANSPORT_SHM_MQ,
+	PG_BACKGROUND_TRANSPORT_RING
+}			pg_background_transport_type;
+
+/*
+ * Each worker records what it's doing in a small ring of events in its
+ * shared memory segment: the flight recorder.  Nothing reads it unless the
+ * worker fails, is slow, or pg_background_trace asks for it.
+ */
+#define PG_BACKGROUND_TRACE_EVENTS		32
+#define PG_BACKGROUND_TRACE_NAME_SIZE	24
+#define PG_BACKGROUND_TRACE_DETAIL_SIZE	96
+
+/* How many traces of finished workers a session holds on to. */
+#define PG_BACKGROUND_KEPT_TRACES		16
+
+/* Rows a worker sends between samples of its memory use. */
+#define PG_BACKGROUND_MEMORY_SAMPLE_ROWS	1024
+
+/*
+ * How full a worker's response queue is gets sampled this often, into one of
+ * PG_BACKGROUND_QUEUE_BUCKETS buckets by how full it is, or into a bucket of
+ * its own if the worker is waiting for room.
+ */
+#define PG_BACKGROUND_QUEUE_SAMPLE_MS	10
+#define PG_BACKGROUND_QUEUE_BUCKETS		4
+#define PG_BACKGROUND_QUEUE_BLOCKED		PG_BACKGROUND_QUEUE_BUCKETS
+
+/*
+ * The timeout handler takes each sample itself if the timer can repeat
+ * without our help and the queue's positions can be read without a lock.
+ * Otherwise it only asks for one, which is taken when the worker next sends
+ * a message or waits for room to.
+ */
+#if PG_VERSION_NUM >= 140000 && defined(PG_HAVE_8BYTE_SINGLE_COPY_ATOMICITY) && \
+	!defined(PG_HAVE_ATOMIC_U64_SIMULATION)
+#define PG_BACKGROUND_SAMPLE_IN_HANDLER
+#endif
+
+/* Space a message of n bytes takes up in a shm_mq. */
+#define PG_BACKGROUND_MQ_FOOTPRINT(n)	(MAXALIGN(sizeof(Size)) + MAXALIGN(n))
+
+/* Untranslated text of the server's message about temp_file_limit. */
+#define TEMP_FILE_LIMIT_MESSAGE	"temporary file size exceeds temp_file_limit (%dkB)"
+
+typedef struct pg_background_trace_event
+{
+	TimestampTz time;
+	char		event[PG_BACKGROUND_TRACE_NAME_SIZE];
+	char		detail[PG_BACKGROUND_TRACE_DETAIL_SIZE];
+}			pg_background_trace_event;
 
 /* Fixed-size data passed via our dynamic shared memory segment. */
 typedef struct pg_background_fixed_data
@@ -68,8 +269,111 @@ typedef struct pg_background_fixed_data
 	int			sec_context;
 	NameData	database;
 	NameData	authenticated_user;
+	int			transport;		/* pg_background_transport_type */
+	int			orphan_policy;	/* pg_background_orphan_policy_type */
+	bool		detached;		/* launcher called pg_background_detach */
+	bool		cancel_requested;	/* launcher called pg_background_cancel */
+	bool		orphaned;		/* launcher went away, and policy is cancel */
+	bool		chunked;		/* run sql as a resumable chunked job? */
+	bool		waiting_for_room;	/* worker blocked on a full response queue */
+	dsm_handle	tree_handle;	/* the launch tree this worker belongs to */
+	int			tree_slot;		/* our entry in the tree */
+	uint32		tree_generation;
+	int			depth;			/* 1 if launched by a regular session */
+	Size		queue_size;
+
+	/*
+	 * Bytes of the shm_mq the launcher has read so far, which tells the
+	 * worker how full the queue is; shm_mq doesn't say.
+	 */
+	pg_atomic_uint64 queue_read;
+	NameData	job_id;
+	NameData	checkpoint_schema;
+
+	/*
+	 * Protocol messages of a small result, filled in by the worker only if
+	 * nothing at all went through the queue.  inline_len is set just before
+	 * the worker goes away, so the launcher must not look at the slot until
+	 * it has seen the queue detached.
+	 */
+	uint32		inline_len;
+	char		inline_data[PG_BACKGROUND_INLINE_SIZE];
+
+	/*
+	 * The flight recorder, written only by the worker.  Event number n goes
+	 * in trace[n % PG_BACKGROUND_TRACE_EVENTS], and trace_count is advanced
+	 * once it is complete.  trace_kept asks the launcher to hold on to the
+	 * trace after the worker is gone.
+	 */
+	bool		trace_kept;
+	uint32		trace_count;
+	pg_background_trace_event trace[PG_BACKGROUND_TRACE_EVENTS];
 }			pg_background_fixed_data;
 
+/*
+ * One end of a pg_background_ring.  Only the owning process writes pos and
+ * sleeping; the other end reads them.  Each end gets a cache line to itself so
+ * that the two processes don't keep stealing it from each other.
+ */
+typedef struct pg_background_ring_end
+{
+	pg_atomic_uint64 pos;		/* bytes written (sender) or read (receiver) */
+	pg_atomic_uint32 sleeping;	/* waiting on our latch for the other end */
+	pg_atomic_uint32 detached;	/* this end has gone away */
+	PGPROC	   *proc;
+}			pg_background_ring_end;
+
+typedef union pg_background_ring_padded_end
+{
+	pg_background_ring_end end;
+	char		pad[PG_CACHE_LINE_SIZE];
+}			pg_background_ring_padded_end;
+
+/*
+ * Single-producer, single-consumer byte ring, an alternative to shm_mq for
+ * streaming large results.  Messages are written as a continuous byte
+ * stream, so one larger than the ring simply passes through in pieces.
+ * Unlike shm_mq, neither side sets the other's latch unless the other side
+ * is actually asleep waiting for it.
+ */
+typedef struct pg_background_ring
+{
+	pg_background_ring_padded_end sender;
+	pg_background_ring_padded_end receiver;
+	Size		size;
+	char		data[FLEXIBLE_ARRAY_MEMBER];
+}			pg_background_ring;
+
+/*
+ * Workers launched by a session, the workers they launch in turn and so on
+ * make up a launch tree, which shares a small segment listing its live
+ * workers.  It is created by the session at the root of the tree, whose
+ * pg_background.max_workers_per_tree setting caps the number of entries in
+ * use when a worker launches another, so that a recursive fan-out can't take
+ * up every worker process.  The session's own launches are counted but never
+ * refused, as they were before there were launch trees.
+ * Launchers reserve an entry before registering a worker, and the worker
+ * gives it back when it exits.
+ */
+typedef struct pg_background_tree_member
+{
+	pid_t		pid;			/* 0 until the worker has started */
+	pid_t		parent_pid;
+	int			depth;
+	uint32		generation;		/* bumped every time the entry is reused */
+	bool		in_use;
+}			pg_background_tree_member;
+
+typedef struct pg_background_launch_tree
+{
+	slock_t		mutex;
+	pid_t		root_pid;
+	int			budget;			/* 0 for no limit */
+	int			nworkers;		/* entries in use */
+	int			nmembers;
+	pg_background_tree_member members[FLEXIBLE_ARRAY_MEMBER];
+}			pg_background_launch_tree;
+
 /* Private state maintained by the launching backend for IPC. */
 typedef struct pg_background_worker_info
 {
@@ -77,46 +381,644 @@ typedef struct pg_background_worker_info
 	Oid			current_user_id;
 	dsm_segment *seg;
 	BackgroundWorkerHandle *handle;
-	shm_mq_handle *responseq;
+	shm_mq_handle *responseq;	/* NULL if using the ring transport */
+	pg_background_ring *ring;
+	shm_mq_handle *control_in;	/* control messages from the worker */
+	shm_mq_handle *control_out;	/* control messages to the worker */
+	shm_mq_handle *inbound;		/* rows for the worker to read, if any */
+	StringInfo	pending_error;	/* error to report once the rest is read */
+	pg_background_fixed_data *fdata;
 	bool		consumed;
+	bool		reading_inline; /* queue is drained, reading inline slot */
+	uint32		inline_offset;
 }			pg_background_worker_info;
 
 /* Private state maintained across calls to pg_background_result. */
 typedef struct pg_background_result_state
 {
 	pg_background_worker_info *info;
-	FmgrInfo   *receive_functions;
+	int16	   *formats;		/* per-column format codes */
+	FmgrInfo   *receive_functions;	/* binary receive or text input functions */
 	Oid		   *typioparams;
 	bool		has_row_description;
 	List	   *command_tags;
 	bool		complete;
+	FILE	   *spool;			/* reading an orphaned worker's spool file */
 }			pg_background_result_state;
 
+/*
+ * Per-session statistics collected from the workers this session launched,
+ * summed by statement: by query ID, or by a hash of the statement's text
+ * with its constants left out where there is no query ID.
+ */
+typedef struct pg_background_stats_entry
+{
+	uint64		queryid;		/* hash key */
+	char		command[NAMEDATALEN];
+	char		query[PG_BACKGROUND_STATS_QUERY_LEN];	/* as first seen */
+	int64		calls;
+	int64		usecs[PG_BACKGROUND_NPHASES];
+	int64		temp_bytes;
+	int64		peak_memory;	/* the most any one statement needed */
+	int64		queue_samples[PG_BACKGROUND_QUEUE_BUCKETS + 1];
+}			pg_background_stats_entry;
+
+static HTAB *pg_background_stats_hash = NULL;
+
+/* The flight recorder of a worker that failed or was slow, saved for later. */
+typedef struct pg_background_kept_trace
+{
+	int32		pid;
+	Oid			user_id;		/* who launched the worker */
+	int			nevents;
+	pg_background_trace_event events[PG_BACKGROUND_TRACE_EVENTS];
+}			pg_background_kept_trace;
+
+static List *kept_traces = NIL;
+
+/* Which of pg_background_insert_partitioned's workers owns a partition. */
+typedef struct pg_background_partition_entry
+{
+	Oid			relid;			/* hash key */
+	int			worker;
+	int			index;			/* among the partitions the worker owns */
+}			pg_background_partition_entry;
+
+/* Rows a pg_background_insert_partitioned worker has yet to write out. */
+#if PG_VERSION_NUM >= 120000
+typedef struct pg_background_partition_batch
+{
+	ResultRelInfo *resultRelInfo;
+	AttrNumber *attmap;			/* partition column of each inbound column */
+	bool		one_at_a_time;	/* row triggers must see the rows before */
+	BulkInsertState bistate;
+	int			nbuffered;
+	TupleTableSlot *slots[PG_BACKGROUND_MULTI_INSERT_TUPLES];
+}			pg_background_partition_batch;
+#endif
+
+/* Result row formats, numbered like the protocol's format codes. */
+typedef enum
+{
+	PG_BACKGROUND_FORMAT_TEXT = 0,
+	PG_BACKGROUND_FORMAT_BINARY = 1
+}			pg_background_result_format_type;
+
+static const struct config_enum_entry result_format_options[] = {
+	{"text", PG_BACKGROUND_FORMAT_TEXT, false},
+	{"binary", PG_BACKGROUND_FORMAT_BINARY, false},
+	{NULL, 0, false}
+};
+
+static const struct config_enum_entry orphan_policy_options[] = {
+	{"cancel", PG_BACKGROUND_ORPHAN_CANCEL, false},
+	{"continue", PG_BACKGROUND_ORPHAN_CONTINUE, false},
+	{"continue_and_spool", PG_BACKGROUND_ORPHAN_SPOOL, false},
+	{NULL, 0, false}
+};
+
+static const struct config_enum_entry transport_options[] = {
+	{"shm_mq", PG_BACKGROUND_TRANSPORT_SHM_MQ, false},
+	{"ring", PG_BACKGROUND_TRANSPORT_RING, false},
+	{NULL, 0, false}
+};
+
 static HTAB *worker_hash;
 
+/* What the C API hands out as a task; just the worker's PID for now. */
+struct PgBackgroundTask
+{
+	int32		pid;
+};
+
+/* GUC variables. */
+static int	pg_background_result_format = PG_BACKGROUND_FORMAT_BINARY;
+static int	pg_background_transport = PG_BACKGROUND_TRANSPORT_SHM_MQ;
+static int	pg_background_orphan_policy = PG_BACKGROUND_ORPHAN_CONTINUE;
+static int	pg_background_spool_limit = 1048576;
+static int	pg_background_max_workers_per_tree = 0;
+static char *pg_background_on_success = NULL;
+static char *pg_background_on_failure = NULL;
+static char *pg_background_outcome_sqlstate = NULL;
+static char *pg_background_outcome_message = NULL;
+static char *pg_background_outcome_command = NULL;
+static int	pg_background_trace_min_duration = -1;
+static bool pg_background_trace_errors = false;
+static int	pg_background_cpu_limit = 0;
+static int	pg_background_temp_limit = -1;
+static int	pg_background_script_workers = 0;
+
+/* The launch tree this backend belongs to, if it has launched or is a worker. */
+static pg_background_launch_tree *task_tree = NULL;
+static dsm_segment *task_tree_seg = NULL;
+static int	worker_depth = 0;	/* 0 in a regular session */
+static uint32 worker_tree_generation; /* of our own entry in the tree */
+static bool worker_failing = false; /* worker has reported an error */
+
 static void cleanup_worker_info(dsm_segment *, Datum pid_datum);
 static pg_background_worker_info * find_worker_info(pid_t pid);
 static void check_rights(pg_background_worker_info * info);
+static void check_user_rights(Oid user_id, int32 pid);
 static void save_worker_info(pid_t pid, dsm_segment *seg,
 							 BackgroundWorkerHandle *handle,
-							 shm_mq_handle *responseq);
+							 shm_mq_handle *responseq,
+							 pg_background_ring *ring,
+							 shm_mq_handle *control_in,
+							 shm_mq_handle *control_out,
+							 shm_mq_handle *inbound,
+							 pg_background_fixed_data *fdata);
+static bool receive_worker_message(pg_background_worker_info * info,
+								   StringInfo msg);
+static bool receive_result_message(pg_background_worker_info * info,
+								   StringInfo msg);
+static void process_control_messages(pg_background_worker_info * info);
+static void record_statement_stats(StringInfo msg);
+static void copy_worker_message(StringInfo msg, const void *data,
+								Size nbytes);
+static FILE *open_spooled_result(int32 pid);
+static bool read_spooled_message(FILE *spool, StringInfo msg);
 static void pg_background_error_callback(void *arg);
-
+static void rethrow_worker_message(StringInfo msg, int32 pid);
+static char dispatch_worker_message(StringInfo msg, int32 pid,
+									bool *complete);
+
+static pg_background_worker_info * claim_worker_info(int32 pid);
+static void setup_receive_functions(pg_background_result_state * state,
+									TupleDesc tupdesc);
+static void check_row_description(pg_background_result_state * state,
+								  TupleDesc tupdesc, StringInfo msg);
 static HeapTuple form_result_tuple(pg_background_result_state * state,
 								   TupleDesc tupdesc, StringInfo msg);
+static void read_data_row(pg_background_result_state * state,
+						  TupleDesc tupdesc, StringInfo msg,
+						  Datum *values, bool *isnull);
+#if PG_VERSION_NUM >= 120000
+static ResultRelInfo *init_result_relation(EState *estate, Relation rel);
+static ResultRelInfo **init_result_relations(EState *estate, Relation *rels,
+											 int nrels);
+static void flush_result_batch(ResultRelInfo *resultRelInfo, EState *estate,
+							   TupleTableSlot **slots, int nslots,
+							   CommandId mycid, int ti_options,
+							   BulkInsertState bistate);
+#endif
+
+static int32 launch_worker(text *sql, int32 queue_size, int transport,
+						   const char *job_id, const char *checkpoint_schema,
+						   int32 inbound_size);
+static void send_inbound_message(int32 pid, StringInfo msg);
+static void relay_available_output(pg_background_worker_info * info);
+static void detach_worker(int32 pid);
+static bool cancel_worker(int32 pid);
+static bool worker_ready(pg_background_worker_info * info);
+static PgBackgroundTask *api_launch(const char *sql, int32 queue_size);
+static int32 api_pid(PgBackgroundTask *task);
+static int64 api_fetch(PgBackgroundTask *task, TupleDesc tupdesc,
+					   const PgBackgroundCallbacks *callbacks, void *arg);
+static int64 api_wait(PgBackgroundTask *task);
+static bool api_cancel(PgBackgroundTask *task);
+static void api_detach(PgBackgroundTask *task);
+static pg_background_launch_tree *get_task_tree(void);
+static void reserve_tree_slot(pg_background_fixed_data * fdata);
+static void release_tree_slot(int slot, uint32 generation);
+static void set_tree_slot_pid(int slot, uint32 generation, pid_t pid);
+static void attach_task_tree(pg_background_fixed_data * fdata);
+static void release_own_tree_slot(dsm_segment *seg, Datum arg);
+static int64 drain_worker(int32 pid, int64 *nbytes);
+static Tuplestorestate *begin_materialized_result(FunctionCallInfo fcinfo,
+												  TupleDesc *tupdesc);
+static void add_selfbench_metric(Tuplestorestate *tupstore, TupleDesc tupdesc,
+								 const char *metric, double value,
+								 const char *unit);
 
 static void handle_sigterm(SIGNAL_ARGS);
+static void handle_sigint(SIGNAL_ARGS);
+static void allow_cancel(bool allow);
+static void rethrow_cancel_error(void);
+static void start_cpu_limit(void);
+static void stop_cpu_limit(void);
+static void report_cpu_limit(ErrorData *edata);
+#ifndef WIN32
+static double cpu_limit_used(double *user_ms, double *system_ms);
+#endif
+static void apply_temp_limit(void);
+static void rethrow_temp_limit_error(void);
+static int64 pending_temp_bytes(void);
+static void account_temp_bytes(void);
+static void report_worker_stats(bool force);
+static void report_temp_limit(ErrorData *edata);
+#ifndef WIN32
+static void handle_sigprof(SIGNAL_ARGS);
+#endif
 static void execute_sql_string(const char *sql);
+static int64 lap_usec(instr_time *since);
+static uint64 statement_id(List *querytree_list, const char *stmt_sql);
+static uint64 hash_normalized_statement(const char *stmt_sql);
+static void send_statement_stats(const char *command, uint64 queryid,
+								 const char *query, int64 *usecs,
+								 int64 temp_bytes, int64 peak_memory);
+static void start_memory_sampling(void);
+static void sample_memory(void);
+static const char *run_script_in_parallel(const char *sql);
+static void run_script_statements(const char *sql);
+static int32 launch_script_worker(const char *sql);
+static void drain_script_worker(int32 pid);
+static Oid	statement_relation(Node *stmt);
+static void handle_queue_sample_timeout(void);
+static void sample_queue(void);
+static void reset_queue_samples(void);
+static void execute_chunked_job(pg_background_fixed_data * fdata,
+								const char *sql);
+static void execute_script(pg_background_fixed_data * fdata, const char *sql);
+static void detach_from_launcher(void);
+static void execute_follow_up(const char *name, const char *sql,
+							  const char *sqlstate, const char *message,
+							  const char *command);
+static void trace_event(const char *event, const char *fmt,...)
+			pg_attribute_printf(2, 3);
+static void trace_send_blocked(int64 usec);
+static void record_send_blocked(void);
+static int	copy_trace(pg_background_fixed_data * fdata,
+					   pg_background_trace_event * events);
+static char *format_trace(pg_background_trace_event * events, int nevents);
+static void keep_trace(pid_t pid, pg_background_fixed_data * fdata);
+static void trace_emit_log(ErrorData *edata);
+static const char *trace_error(const char *s, size_t *len);
+static const char *notice_message(const char *s, size_t len);
 static bool exists_binary_recv_fn(Oid type);
 
+static void pg_background_comm_reset(void);
+static int	pg_background_flush(void);
+static int	pg_background_flush_if_writable(void);
+static bool pg_background_is_send_pending(void);
+static int	pg_background_putmessage(char msgtype, const char *s, size_t len);
+static void pg_background_putmessage_noblock(char msgtype, const char *s,
+											 size_t len);
+#if PG_VERSION_NUM < 140000
+static void pg_background_startcopyout(void);
+static void pg_background_endcopyout(bool errorAbort);
+#endif
+static void flush_inline_messages(void);
+static int	send_to_launcher(char msgtype, const char *s, size_t len);
+static int	queue_putmessage(char msgtype, const char *s, size_t len);
+static void check_for_control_messages(void);
+static void cleanup_worker_queues(dsm_segment *seg, Datum arg);
+static void handle_orphaned_worker(void);
+static void note_waiting_for_room(PGPROC *receiver);
+static void spool_path(char *path, int pid, bool partial);
+static void remove_stale_spools(void);
+static void forget_spool(void);
+static void abandon_spool(const char *why);
+static bool flush_spool(void);
+static void start_spool(void);
+static int	spool_putmessage(char msgtype, const char *s, size_t len);
+
+static void ring_init(pg_background_ring * ring, Size size);
+static bool ring_send_bytes(pg_background_ring * ring, const char *data,
+							Size len);
+static bool ring_receive_bytes(pg_background_worker_info * info, char *dest,
+							   Size len);
+static bool ring_receive_message(pg_background_worker_info * info,
+								 StringInfo msg);
+static bool ring_wait(pg_background_ring_end * me, pg_background_ring_end * peer,
+					  uint64 peer_pos, BackgroundWorkerHandle *handle);
+static void ring_wake(pg_background_ring_end * peer);
+static void ring_detach_end(pg_background_ring_end * me,
+							pg_background_ring_end * peer);
+static void ring_cleanup_sender(dsm_segment *seg, Datum arg);
+static void ring_cleanup_receiver(dsm_segment *seg, Datum arg);
+static int	ring_putmessage(char msgtype, const char *s, size_t len);
+
+/* The C API for other extensions; see pg_background_api.h. */
+static const PgBackgroundAPI pg_background_api = {
+	PG_BACKGROUND_API_VERSION,
+	api_launch,
+	api_pid,
+	api_fetch,
+	api_wait,
+	api_cancel,
+	api_detach
+};
+
+/*
+ * Protocol output routines used by the worker.  They hold back a small
+ * result in the inline slot and pass everything else on to the launcher
+ * through the queue, the ring or, for errors, the control queue.
+ */
+static PQcommMethods pg_background_comm_methods = {
+	pg_background_comm_reset,
+	pg_background_flush,
+	pg_background_flush_if_writable,
+	pg_background_is_send_pending,
+	pg_background_putmessage,
+	pg_background_putmessage_noblock
+#if PG_VERSION_NUM < 140000
+	,pg_background_startcopyout,
+	pg_background_endcopyout
+#endif
+};
+
+/* Worker-side state for the protocol output routines above. */
+static pg_background_fixed_data *inline_fdata;	/* NULL once not inlining */
+static uint32 inline_used;
+static shm_mq_handle *worker_responseq;	/* NULL if detached or using ring */
+static bool worker_responseq_busy = false;
+static pg_background_ring *sender_ring;	/* NULL once detached */
+static bool sender_ring_busy = false;
+static shm_mq_handle *worker_control_in;	/* NULL once detached */
+static shm_mq_handle *worker_control_out;	/* NULL once detached */
+static shm_mq_handle *worker_inbound;	/* NULL unless launcher sends rows */
+static pg_background_fixed_data *worker_fdata;
+static bool receiver_gone = false;	/* launcher stopped listening */
+static bool orphan_handled = false;
+static StringInfo last_row_description;	/* kept for the spool file */
+static int	spool_fd = -1;
+static StringInfo spool_buffer;	/* output not yet written to spool_fd */
+static int64 spool_bytes = 0;	/* size of the spool file so far */
+static bool spool_repeated_description = false;	/* last thing spooled */
+static int64 send_blocked_usec = 0;	/* time spent waiting for the launcher */
+static StringInfo pending_stats;	/* statistics the control queue had no
+									 * room for yet */
+static char last_command_tag[NAMEDATALEN];	/* of the script's last statement */
+static bool discard_output = false; /* running follow-up SQL */
+static TimestampTz worker_start_time;
+static TimestampTz trace_blocked_start;	/* of the current run of waits for
+											 * the launcher, if any */
+static int64 trace_blocked_waits;
+static int64 trace_blocked_usec;
+static emit_log_hook_type prev_emit_log_hook = NULL;
+static const PQcommMethods *prev_comm_methods = NULL;
+static volatile sig_atomic_t cancel_allowed = false;	/* command running */
+static volatile sig_atomic_t cpu_limit_exceeded = false;
+#ifndef WIN32
+static struct rusage cpu_limit_start;	/* usage when the limit was set */
+#endif
+static bool temp_limit_applies = false; /* temp_file_limit is our temp_limit */
+static int64 temp_bytes_written = 0;
+static int64 temp_bytes_seen = 0;	/* of pending_temp_bytes(), counted already */
+static int64 statement_peak_memory = 0; /* of the statement being run */
+static int64 statement_base_memory = 0; /* allocated when it started */
+static uint32 rows_since_memory_sample = 0;
+static TimeoutId queue_sample_timeout;
+static volatile sig_atomic_t queue_sample_pending = false;
+static uint64 queue_written = 0;	/* bytes of the shm_mq we have used */
+static volatile int64 queue_samples[PG_BACKGROUND_QUEUE_BUCKETS + 1];	/* of the
+																 * statement
+																 * being run */
+
 PG_MODULE_MAGIC;
 
 PG_FUNCTION_INFO_V1(pg_background_launch);
+PG_FUNCTION_INFO_V1(pg_background_launch_chunked);
 PG_FUNCTION_INFO_V1(pg_background_result);
+PG_FUNCTION_INFO_V1(pg_background_result_into);
+PG_FUNCTION_INFO_V1(pg_background_stream);
 PG_FUNCTION_INFO_V1(pg_background_detach);
-
+PG_FUNCTION_INFO_V1(pg_background_cancel);
+PG_FUNCTION_INFO_V1(pg_background_wait_any);
+PG_FUNCTION_INFO_V1(pg_background_selfbench);
+PG_FUNCTION_INFO_V1(pg_background_stats);
+PG_FUNCTION_INFO_V1(pg_background_stats_reset);
+PG_FUNCTION_INFO_V1(pg_background_tree);
+PG_FUNCTION_INFO_V1(pg_background_trace);
+PG_FUNCTION_INFO_V1(pg_background_prewarm_blocks);
+PG_FUNCTION_INFO_V1(pg_background_insert_inbound);
+PG_FUNCTION_INFO_V1(pg_background_insert_partitioned);
+
+void		_PG_init(void);
 PGDLLEXPORT void pg_background_worker_main(Datum);
 
+/*
+ * Module load callback.
+ */
+void
+_PG_init(void)
+{
+	DefineCustomEnumVariable("pg_background.result_format",
+							 "Sets the format in which background workers send result rows.",
+							 "Workers inherit this setting from the launching session. "
+							 "Text format is mainly useful with pg_background_stream.",
+							 &pg_background_result_format,
+							 PG_BACKGROUND_FORMAT_BINARY,
+							 result_format_options,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomEnumVariable("pg_background.orphan_policy",
+							 "Sets what newly launched background workers do if their launching session goes away.",
+							 "\"cancel\" aborts the worker's command, \"continue\" lets it "
+							 "finish and discards its results, and \"continue_and_spool\" "
+							 "lets it finish and saves its results for pg_background_result "
+							 "in another session.  Workers passed to pg_background_detach "
+							 "always continue.",
+							 &pg_background_orphan_policy,
+							 PG_BACKGROUND_ORPHAN_CONTINUE,
+							 orphan_policy_options,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_background.spool_limit",
+							"Sets the maximum size of the file an orphaned background worker spools its results to.",
+							"A worker whose results outgrow it removes the file and "
+							"throws the rest of its results away.  -1 means no limit.",
+							&pg_background_spool_limit,
+							1048576,
+							-1,
+							INT_MAX,
+							PGC_SUSET,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomEnumVariable("pg_background.transport",
+							 "Sets how newly launched background workers send back results.",
+							 "\"shm_mq\" uses a regular shared memory queue; \"ring\" uses a "
+							 "lock-free ring that only wakes the reader when it is asleep, "
+							 "which is faster for large results.",
+							 &pg_background_transport,
+							 PG_BACKGROUND_TRANSPORT_SHM_MQ,
+							 transport_options,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomStringVariable("pg_background.on_success",
+							   "Sets SQL for newly launched background workers to run after their command succeeds.",
+							   "It runs in a new transaction once the command has committed. "
+							   "Its output is discarded, but its errors are reported.",
+							   &pg_background_on_success,
+							   "",
+							   PGC_USERSET,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomStringVariable("pg_background.on_failure",
+							   "Sets SQL for newly launched background workers to run after their command fails.",
+							   "It runs in a new transaction once the command has been "
+							   "rolled back.  Its output is discarded.",
+							   &pg_background_on_failure,
+							   "",
+							   PGC_USERSET,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomStringVariable("pg_background.outcome_sqlstate",
+							   "Shows the SQLSTATE a background worker's command ended with.",
+							   "Set while the worker runs pg_background.on_success or "
+							   "pg_background.on_failure.",
+							   &pg_background_outcome_sqlstate,
+							   "",
+							   PGC_INTERNAL,
+							   GUC_NOT_IN_SAMPLE | GUC_DISALLOW_IN_FILE,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomStringVariable("pg_background.outcome_message",
+							   "Shows the error message a background worker's command failed with.",
+							   "Set while the worker runs pg_background.on_failure.",
+							   &pg_background_outcome_message,
+							   "",
+							   PGC_INTERNAL,
+							   GUC_NOT_IN_SAMPLE | GUC_DISALLOW_IN_FILE,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomStringVariable("pg_background.outcome_command",
+							   "Shows the command tag of the last statement of a background worker's command.",
+							   "Set while the worker runs pg_background.on_success.",
+							   &pg_background_outcome_command,
+							   "",
+							   PGC_INTERNAL,
+							   GUC_NOT_IN_SAMPLE | GUC_DISALLOW_IN_FILE,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomIntVariable("pg_background.trace_min_duration",
+							"Sets the run time above which background workers log their recent events.",
+							"A worker that takes at least this long logs its flight "
+							"recorder when it finishes, and its launching session keeps "
+							"it for pg_background_trace.  -1 disables this.",
+							&pg_background_trace_min_duration,
+							-1,
+							-1,
+							INT_MAX,
+							PGC_USERSET,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_background.trace_errors",
+							 "Attaches background workers' recent events to their errors.",
+							 "A worker that fails adds its flight recorder to the "
+							 "detail of its error.",
+							 &pg_background_trace_errors,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_background.cpu_limit",
+							"Sets the maximum CPU time newly launched background workers may use for their command.",
+							"A worker whose command uses more CPU time than this is "
+							"canceled, however long it has spent waiting.  Zero means "
+							"no limit.",
+							&pg_background_cpu_limit,
+							0,
+							0,
+							INT_MAX,
+							PGC_USERSET,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_background.temp_limit",
+							"Sets the maximum amount of temporary file space newly launched background workers may use.",
+							"Applies in addition to temp_file_limit, and can only lower "
+							"it.  Like temp_file_limit, it caps the space in use at any "
+							"one time, not the total written.  -1 means no limit.",
+							&pg_background_temp_limit,
+							-1,
+							-1,
+							INT_MAX,
+							PGC_USERSET,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_background.script_workers",
+							"Sets the number of statements of a newly launched background worker's script that may run at once.",
+							"If set, maintenance statements that each affect a different "
+							"relation run concurrently in workers of their own, each in a "
+							"transaction of its own.  Zero runs the script as usual.",
+							&pg_background_script_workers,
+							0,
+							0,
+							INT_MAX,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	/*
+	 * By default, leave half of the worker processes to everyone else, so
+	 * that a runaway tree can't starve parallel query, replication and the
+	 * session's other trees.  Only launches from inside a worker are held to
+	 * it, so plain sessions launch as many workers as they always could.
+	 */
+	DefineCustomIntVariable("pg_background.max_workers_per_tree",
+							"Sets the maximum number of background workers a session and the workers it launches may run at once.",
+							"Counts every live worker launched by the session, directly "
+							"or from inside another worker, but only refuses launches "
+							"from inside a worker.  Only the setting in the session at "
+							"the root of the tree applies.  Zero means no limit.",
+							&pg_background_max_workers_per_tree,
+							Max(max_worker_processes / 2, 1),
+							0,
+							INT_MAX,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	MarkGUCPrefixReserved_compat("pg_background");
+
+	/* Let other extensions find the C API. */
+	*find_rendezvous_variable(PG_BACKGROUND_API_RENDEZVOUS) =
+		(void *) &pg_background_api;
+}
+
+/*
+ * Return the C API, for extensions that look it up with
+ * load_external_function.
+ */
+const PgBackgroundAPI *
+pg_background_get_api(void)
+{
+	return &pg_background_api;
+}
+
 /*
  * Start a dynamic background worker to run a user-specified SQL command.
  */
@@ -125,6 +1027,51 @@ pg_background_launch(PG_FUNCTION_ARGS)
 {
 	text	   *sql = PG_GETARG_TEXT_PP(0);
 	int32		queue_size = PG_GETARG_INT32(1);
+
+	PG_RETURN_INT32(launch_worker(sql, queue_size, pg_background_transport,
+								  NULL, NULL, 0));
+}
+
+/*
+ * Start a dynamic background worker to run a resumable chunked job.
+ *
+ * The SQL command processes one chunk of the job.  It is passed the key at
+ * which the previous chunk stopped as $1 (of type text, NULL for the first
+ * chunk), and must return the key at which this chunk stopped as the first
+ * column of its first row, or no row or NULL once there's nothing left to do.
+ * Progress is recorded in pg_background_checkpoints under job_id, so
+ * launching the same job again resumes after the last committed chunk.
+ */
+Datum
+pg_background_launch_chunked(PG_FUNCTION_ARGS)
+{
+	char	   *job_id = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	text	   *sql = PG_GETARG_TEXT_PP(1);
+	int32		queue_size = PG_GETARG_INT32(2);
+	char	   *checkpoint_schema;
+
+	if (strlen(job_id) >= NAMEDATALEN)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("job id must be shorter than %d bytes", NAMEDATALEN)));
+
+	/* The checkpoints table lives in the same schema as this function. */
+	checkpoint_schema =
+		get_namespace_name(get_func_namespace(fcinfo->flinfo->fn_oid));
+
+	PG_RETURN_INT32(launch_worker(sql, queue_size, pg_background_transport,
+								  job_id, checkpoint_schema, 0));
+}
+
+/*
+ * Common code for the launch functions.  job_id is NULL unless the worker
+ * is to run sql as a chunked job.  If inbound_size is positive, the worker
+ * also gets a queue of that size on which we can send it rows.
+ */
+static int32
+launch_worker(text *sql, int32 queue_size, int transport, const char *job_id,
+			  const char *checkpoint_schema, int32 inbound_size)
+{
 	int32		sql_len = VARSIZE_ANY_EXHDR(sql);
 	Size		guc_len;
 	Size		segsize;
@@ -137,8 +1084,12 @@ pg_background_launch(PG_FUNCTION_ARGS)
 	BackgroundWorker worker;
 	BackgroundWorkerHandle *worker_handle;
 	pg_background_fixed_data *fdata;
-	pid_t		pid;
-	shm_mq_handle *responseq;
+	pid_t		pid = 0;
+	shm_mq_handle *responseq = NULL;
+	pg_background_ring *ring = NULL;
+	shm_mq_handle *control_in;
+	shm_mq_handle *control_out;
+	shm_mq_handle *inbound = NULL;
 	MemoryContext oldcontext;
 
 	/* Ensure a valid queue size. */
@@ -148,13 +1099,29 @@ pg_background_launch(PG_FUNCTION_ARGS)
 				 errmsg("queue size must be at least %zu bytes",
 						shm_mq_minimum_size)));
 
+	/* Spool files take up room in the data directory, so not just anyone's. */
+	if (pg_background_orphan_policy == PG_BACKGROUND_ORPHAN_SPOOL &&
+		!may_write_server_files_compat())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("permission denied to spool the results of background workers"),
+				 errdetail("Only roles with privileges of the \"pg_write_server_files\" role may launch workers with pg_background.orphan_policy set to \"continue_and_spool\".")));
+
 	/* Create dynamic shared memory and table of contents. */
 	shm_toc_initialize_estimator(&e);
 	shm_toc_estimate_chunk(&e, sizeof(pg_background_fixed_data));
 	shm_toc_estimate_chunk(&e, sql_len + 1);
 	guc_len = EstimateGUCStateSpace();
 	shm_toc_estimate_chunk(&e, guc_len);
-	shm_toc_estimate_chunk(&e, (Size) queue_size);
+	if (transport == PG_BACKGROUND_TRANSPORT_RING)
+		shm_toc_estimate_chunk(&e, offsetof(pg_background_ring, data) +
+							   (Size) queue_size);
+	else
+		shm_toc_estimate_chunk(&e, (Size) queue_size);
+	shm_toc_estimate_chunk(&e, PG_BACKGROUND_CONTROL_QUEUE_SIZE);
+	shm_toc_estimate_chunk(&e, PG_BACKGROUND_CONTROL_QUEUE_SIZE);
+	if (inbound_size > 0)
+		shm_toc_estimate_chunk(&e, (Size) inbound_size);
 	shm_toc_estimate_keys(&e, PG_BACKGROUND_NKEYS);
 	segsize = shm_toc_estimate(&e);
 	seg = dsm_create(segsize, 0);
@@ -169,6 +1136,24 @@ pg_background_launch(PG_FUNCTION_ARGS)
 	namestrcpy(&fdata->database, get_database_name(MyDatabaseId));
 	namestrcpy(&fdata->authenticated_user,
 			   GetUserNameFromId(fdata->authenticated_user_id, false));
+	fdata->transport = transport;
+	fdata->orphan_policy = pg_background_orphan_policy;
+	fdata->detached = false;
+	fdata->cancel_requested = false;
+	fdata->orphaned = false;
+	fdata->waiting_for_room = false;
+	fdata->chunked = (job_id != NULL);
+	if (job_id != NULL)
+	{
+		namestrcpy(&fdata->job_id, job_id);
+		namestrcpy(&fdata->checkpoint_schema, checkpoint_schema);
+	}
+	fdata->inline_len = 0;
+	fdata->trace_kept = false;
+	fdata->trace_count = 0;
+	fdata->depth = worker_depth + 1;
+	fdata->queue_size = (Size) queue_size;
+	pg_atomic_init_u64(&fdata->queue_read, 0);
 	shm_toc_insert(toc, PG_BACKGROUND_KEY_FIXED_DATA, fdata);
 
 	/* Store SQL query in dynamic shared memory. */
@@ -185,19 +1170,54 @@ pg_background_launch(PG_FUNCTION_ARGS)
 	SerializeGUCState(guc_len, gucstate);
 	shm_toc_insert(toc, PG_BACKGROUND_KEY_GUC, gucstate);
 
-	/* Establish message queue in dynamic shared memory. */
-	mq = shm_mq_create(shm_toc_allocate(toc, (Size) queue_size),
-					   (Size) queue_size);
-	shm_toc_insert(toc, PG_BACKGROUND_KEY_QUEUE, mq);
-	shm_mq_set_receiver(mq, MyProc);
-
 	/*
-	 * Attach the queue before launching a worker, so that we'll automatically
-	 * detach the queue if we error out.  (Otherwise, the worker might sit
-	 * there trying to write the queue long after we've gone away.)
+	 * Establish message queue in dynamic shared memory, and attach to it
+	 * before launching a worker, so that we'll automatically detach the queue
+	 * if we error out.  (Otherwise, the worker might sit there trying to
+	 * write the queue long after we've gone away.)
 	 */
+	if (transport == PG_BACKGROUND_TRANSPORT_RING)
+	{
+		ring = shm_toc_allocate(toc, offsetof(pg_background_ring, data) +
+								(Size) queue_size);
+		ring_init(ring, (Size) queue_size);
+		shm_toc_insert(toc, PG_BACKGROUND_KEY_QUEUE, ring);
+		on_dsm_detach(seg, ring_cleanup_receiver, PointerGetDatum(ring));
+	}
+	else
+	{
+		mq = shm_mq_create(shm_toc_allocate(toc, (Size) queue_size),
+						   (Size) queue_size);
+		shm_toc_insert(toc, PG_BACKGROUND_KEY_QUEUE, mq);
+		shm_mq_set_receiver(mq, MyProc);
+
+		oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+		responseq = shm_mq_attach(mq, seg, NULL);
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	/* Likewise for the control queues. */
 	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
-	responseq = shm_mq_attach(mq, seg, NULL);
+	mq = shm_mq_create(shm_toc_allocate(toc, PG_BACKGROUND_CONTROL_QUEUE_SIZE),
+					   PG_BACKGROUND_CONTROL_QUEUE_SIZE);
+	shm_toc_insert(toc, PG_BACKGROUND_KEY_CONTROL_TO_LAUNCHER, mq);
+	shm_mq_set_receiver(mq, MyProc);
+	control_in = shm_mq_attach(mq, seg, NULL);
+
+	mq = shm_mq_create(shm_toc_allocate(toc, PG_BACKGROUND_CONTROL_QUEUE_SIZE),
+					   PG_BACKGROUND_CONTROL_QUEUE_SIZE);
+	shm_toc_insert(toc, PG_BACKGROUND_KEY_CONTROL_TO_WORKER, mq);
+	shm_mq_set_sender(mq, MyProc);
+	control_out = shm_mq_attach(mq, seg, NULL);
+
+	if (inbound_size > 0)
+	{
+		mq = shm_mq_create(shm_toc_allocate(toc, (Size) inbound_size),
+						   (Size) inbound_size);
+		shm_toc_insert(toc, PG_BACKGROUND_KEY_INBOUND, mq);
+		shm_mq_set_sender(mq, MyProc);
+		inbound = shm_mq_attach(mq, seg, NULL);
+	}
 	MemoryContextSwitchTo(oldcontext);
 
 	/* Configure a worker. */
@@ -225,14 +1245,23 @@ pg_background_launch(PG_FUNCTION_ARGS)
 	 * We switch contexts so that the background worker handle can outlast
 	 * this transaction.
 	 */
+	reserve_tree_slot(fdata);
 	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
 	if (!RegisterDynamicBackgroundWorker(&worker, &worker_handle))
+	{
+		release_tree_slot(fdata->tree_slot, fdata->tree_generation);
 		ereport(ERROR,
 				(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
 				 errmsg("could not register background process"),
 				 errhint("You may need to increase max_worker_processes.")));
+	}
 	MemoryContextSwitchTo(oldcontext);
-	shm_mq_set_handle(responseq, worker_handle);
+	if (responseq != NULL)
+		shm_mq_set_handle(responseq, worker_handle);
+	shm_mq_set_handle(control_in, worker_handle);
+	shm_mq_set_handle(control_out, worker_handle);
+	if (inbound != NULL)
+		shm_mq_set_handle(inbound, worker_handle);
 
 	/* Wait for the worker to start. */
 	switch (WaitForBackgroundWorkerStartup(worker_handle, &pid))
@@ -255,8 +1284,19 @@ pg_background_launch(PG_FUNCTION_ARGS)
 			break;
 	}
 
+	/*
+	 * Wait for the worker to map the segment, which it does first thing, so
+	 * that the segment outlives us if we let go of it straight away, as a
+	 * worker that returns the PID of one it launched does on exiting.  A
+	 * worker that exits early just detaches its end of the queue.
+	 */
+	(void) shm_mq_wait_for_attach(control_in);
+	if (pid != 0)
+		set_tree_slot_pid(fdata->tree_slot, fdata->tree_generation, pid);
+
 	/* Store the relevant details about this worker for future use. */
-	save_worker_info(pid, seg, worker_handle, responseq);
+	save_worker_info(pid, seg, worker_handle, responseq, ring,
+					 control_in, control_out, inbound, fdata);
 
 	/*
 	 * Now that the worker info is saved, we do not need to, and should not,
@@ -265,7 +1305,186 @@ pg_background_launch(PG_FUNCTION_ARGS)
 	dsm_pin_mapping(seg);
 
 	/* Return the worker's PID. */
-	PG_RETURN_INT32(pid);
+	return pid;
+}
+
+/*
+ * Get the launch tree this backend belongs to, creating a new one with us at
+ * the root if need be.
+ */
+static pg_background_launch_tree *
+get_task_tree(void)
+{
+	dsm_segment *seg;
+	pg_background_launch_tree *tree;
+	Size		size;
+	int			i;
+
+	if (task_tree != NULL)
+		return task_tree;
+
+	/* No more workers than max_worker_processes can be alive at once. */
+	size = offsetof(pg_background_launch_tree, members) +
+		mul_size(max_worker_processes, sizeof(pg_background_tree_member));
+	seg = dsm_create(size, 0);
+	tree = dsm_segment_address(seg);
+	SpinLockInit(&tree->mutex);
+	tree->root_pid = MyProcPid;
+	tree->budget = pg_background_max_workers_per_tree;
+	tree->nworkers = 0;
+	tree->nmembers = max_worker_processes;
+	for (i = 0; i < tree->nmembers; ++i)
+	{
+		tree->members[i].pid = 0;
+		tree->members[i].generation = 0;
+		tree->members[i].in_use = false;
+	}
+
+	/* Keep the tree until we exit, so that our workers can find it. */
+	dsm_pin_mapping(seg);
+	task_tree_seg = seg;
+	task_tree = tree;
+
+	return tree;
+}
+
+/*
+ * Reserve an entry in our launch tree for a worker we are about to register,
+ * and note it in the worker's fixed data.  Errors out if the tree already
+ * has as many workers as its budget allows.
+ */
+static void
+reserve_tree_slot(pg_background_fixed_data * fdata)
+{
+	pg_background_launch_tree *tree = get_task_tree();
+	int			budget;
+	int			slot = -1;
+	int			i;
+
+	SpinLockAcquire(&tree->mutex);
+	if (tree->root_pid == MyProcPid)
+	{
+		tree->budget = pg_background_max_workers_per_tree;
+		budget = 0;
+	}
+	else
+		budget = tree->budget;
+	if (budget <= 0 || tree->nworkers < budget)
+	{
+		for (i = 0; i < tree->nmembers; ++i)
+		{
+			if (!tree->members[i].in_use)
+			{
+				slot = i;
+				break;
+			}
+		}
+	}
+	if (slot >= 0)
+	{
+		pg_background_tree_member *member = &tree->members[slot];
+
+		member->in_use = true;
+		member->pid = 0;
+		member->parent_pid = MyProcPid;
+		member->depth = fdata->depth;
+		member->generation++;
+		tree->nworkers++;
+		fdata->tree_generation = member->generation;
+	}
+	SpinLockRelease(&tree->mutex);
+
+	if (slot < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+				 errmsg("too many background workers in this launch tree"),
+				 budget > 0 ?
+				 errdetail("The tree already has %d workers running.", budget) : 0,
+				 errhint("You may need to increase pg_background.max_workers_per_tree.")));
+
+	fdata->tree_handle = dsm_segment_handle(task_tree_seg);
+	fdata->tree_slot = slot;
+}
+
+/*
+ * Fill in the PID of a worker we have just started, so that it is listed in
+ * our launch tree from the moment we return it, rather than once it gets
+ * round to joining the tree.  Does nothing if the worker has already given
+ * its entry back.
+ */
+static void
+set_tree_slot_pid(int slot, uint32 generation, pid_t pid)
+{
+	pg_background_tree_member *member = &task_tree->members[slot];
+
+	SpinLockAcquire(&task_tree->mutex);
+	if (member->in_use && member->generation == generation)
+		member->pid = pid;
+	SpinLockRelease(&task_tree->mutex);
+}
+
+/*
+ * Give back an entry in our launch tree, unless it has been given back (and
+ * perhaps reused) already.
+ */
+static void
+release_tree_slot(int slot, uint32 generation)
+{
+	pg_background_tree_member *member;
+
+	if (task_tree == NULL)
+		return;
+
+	member = &task_tree->members[slot];
+	SpinLockAcquire(&task_tree->mutex);
+	if (member->in_use && member->generation == generation)
+	{
+		member->in_use = false;
+		member->pid = 0;
+		task_tree->nworkers--;
+	}
+	SpinLockRelease(&task_tree->mutex);
+}
+
+/*
+ * Join the launch tree of the backend that launched us, so that workers we
+ * launch ourselves count against its budget.  If the tree has gone away
+ * along with its root, we just start a new one should we need it.
+ */
+static void
+attach_task_tree(pg_background_fixed_data * fdata)
+{
+	dsm_segment *seg;
+	pg_background_tree_member *member;
+
+	worker_depth = fdata->depth;
+
+	seg = dsm_attach(fdata->tree_handle);
+	if (seg == NULL)
+		return;
+	dsm_pin_mapping(seg);
+	task_tree_seg = seg;
+	task_tree = dsm_segment_address(seg);
+
+	member = &task_tree->members[fdata->tree_slot];
+	SpinLockAcquire(&task_tree->mutex);
+	if (member->in_use && member->generation == fdata->tree_generation)
+		member->pid = MyProcPid;
+	SpinLockRelease(&task_tree->mutex);
+
+	worker_tree_generation = fdata->tree_generation;
+	on_dsm_detach(seg, release_own_tree_slot, Int32GetDatum(fdata->tree_slot));
+}
+
+/*
+ * Give back our entry in the launch tree as we exit.
+ */
+static void
+release_own_tree_slot(dsm_segment *seg, Datum arg)
+{
+	release_tree_slot(DatumGetInt32(arg), worker_tree_generation);
+	task_tree = NULL;
+	task_tree_seg = NULL;
 }
 
 /*
@@ -299,51 +1518,115 @@ throw_untranslated_error(ErrorData translated_edata)
 }
 
 /*
- * Retrieve the results of a background query previously launched in this
- * session.
+ * Rethrow an ErrorResponse or NoticeResponse received from the worker with
+ * the given PID.
  */
-Datum
-pg_background_result(PG_FUNCTION_ARGS)
+static void
+rethrow_worker_message(StringInfo msg, int32 pid)
 {
-	int32		pid = PG_GETARG_INT32(0);
-	shm_mq_result res;
-	FuncCallContext *funcctx;
-	TupleDesc	tupdesc;
-	StringInfoData msg;
-	pg_background_result_state *state;
+	ErrorData	edata;
+	ErrorContextCallback context;
 
-	/* First-time setup. */
-	if (SRF_IS_FIRSTCALL())
-	{
-		MemoryContext oldcontext;
-		pg_background_worker_info *info;
-		dsm_segment *seg;
+	/* Parse ErrorResponse or NoticeResponse. */
+	pq_parse_errornotice(msg, &edata);
 
-		funcctx = SRF_FIRSTCALL_INIT();
-		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+	/*
+	 * Limit the maximum error level to ERROR.  We don't want a FATAL inside
+	 * the background worker to kill the user session.
+	 */
+	if (edata.elevel > ERROR)
+		edata.elevel = ERROR;
 
-		/* See if we have a connection to the specified PID. */
-		if ((info = find_worker_info(pid)) == NULL)
-			ereport(ERROR,
-					(errcode(ERRCODE_UNDEFINED_OBJECT),
-					 errmsg("PID %d is not attached to this session", pid)));
-		check_rights(info);
+	/*
+	 * Rethrow the error with an appropriate context method.
+	 */
+	context.callback = pg_background_error_callback;
+	context.arg = (void *) &pid;
+	context.previous = error_context_stack;
+	error_context_stack = &context;
+	throw_untranslated_error(edata);
+	error_context_stack = context.previous;
+}
+
+/*
+ * Handle a message received from the worker with the given PID the way every
+ * reader of a worker's result does, setting *complete on ReadyForQuery.
+ * RowDescription, DataRow and CommandComplete messages are left to the
+ * caller: their type is returned, with the cursor just past it.  Anything
+ * else was dealt with here, and '\0' is returned.
+ */
+static char
+dispatch_worker_message(StringInfo msg, int32 pid, bool *complete)
+{
+	char		msgtype = pq_getmsgbyte(msg);
 
-		/* Can't read results twice. */
-		if (info->consumed)
+	switch (msgtype)
+	{
+		case 'E':
+		case 'N':
+			rethrow_worker_message(msg, pid);
+			break;
+		case 'A':
+			/* Propagate NotifyResponse. */
+			pq_putmessage(msg->data[0], &msg->data[1], msg->len - 1);
+			break;
+		case 'T':
+		case 'D':
+		case 'C':
+			return msgtype;
+		case 'G':
+		case 'H':
+		case 'W':
 			ereport(ERROR,
-					(errcode(ERRCODE_UNDEFINED_OBJECT),
-					 errmsg("results for PID %d have already been consumed", pid)));
-		info->consumed = true;
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("COPY protocol not allowed in pg_background")));
+			break;
+		case 'Z':
+			/* Handle ReadyForQuery message. */
+			*complete = true;
+			break;
+		default:
+			elog(WARNING, "unknown message type: %c (%d bytes)",
+				 msg->data[0], msg->len);
+			break;
+	}
+
+	return '\0';
+}
+
+/*
+ * Retrieve the results of a background query previously launched in this
+ * session.
+ */
+Datum
+pg_background_result(PG_FUNCTION_ARGS)
+{
+	int32		pid = PG_GETARG_INT32(0);
+	FuncCallContext *funcctx;
+	TupleDesc	tupdesc;
+	StringInfoData msg;
+	pg_background_result_state *state;
+
+	/* First-time setup. */
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext oldcontext;
+		pg_background_worker_info *info;
+		FILE	   *spool = NULL;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
 
 		/*
-		 * Whether we succeed or fail, a future invocation of this function
-		 * may not try to read from the DSM once we've begun to do so.
-		 * Accordingly, make arrangements to clean things up at end of query.
+		 * Claim the worker's results; they'll be cleaned up at end of query.
+		 * If we never launched this worker, it may be an orphan that spooled
+		 * its results for someone else to pick up.
 		 */
-		seg = info->seg;
-
-		dsm_unpin_mapping(seg);
+		if (find_worker_info(pid) == NULL &&
+			(spool = open_spooled_result(pid)) != NULL)
+			info = NULL;
+		else
+			info = claim_worker_info(pid);
 
 		/* Set up tuple-descriptor based on colum definition list. */
 		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
@@ -358,25 +1641,7 @@ pg_background_result(PG_FUNCTION_ARGS)
 		/* Cache state that will be needed on every call. */
 		state = palloc0(sizeof(pg_background_result_state));
 		state->info = info;
-		if (funcctx->tuple_desc->natts > 0)
-		{
-			int			natts = funcctx->tuple_desc->natts;
-			int			i;
-
-			state->receive_functions = palloc(sizeof(FmgrInfo) * natts);
-			state->typioparams = palloc(sizeof(Oid) * natts);
-
-			for (i = 0; i < natts; ++i)
-			{
-				Oid			receive_function_id;
-
-				getTypeBinaryInputInfo(TupleDescAttr(funcctx->tuple_desc, i)->atttypid,
-									   &receive_function_id,
-									   &state->typioparams[i]);
-
-				fmgr_info(receive_function_id, &state->receive_functions[i]);
-			}
-		}
+		state->spool = spool;
 		funcctx->user_fctx = state;
 
 		MemoryContextSwitchTo(oldcontext);
@@ -388,115 +1653,21 @@ pg_background_result(PG_FUNCTION_ARGS)
 	/* Initialize message buffer. */
 	initStringInfo(&msg);
 
-	/* Read and processes messages from the shared memory queue. */
-	for (;;)
+	/* Read and processes messages from the worker. */
+	while (state->spool != NULL ? read_spooled_message(state->spool, &msg) :
+		   receive_worker_message(state->info, &msg))
 	{
-		char		msgtype;
-		Size		nbytes;
-		void	   *data;
-
-		/* Get next message. */
-		res = shm_mq_receive(state->info->responseq, &nbytes, &data, false);
-		if (res != SHM_MQ_SUCCESS)
-			break;
-
-		/*
-		 * Message-parsing routines operate on a null-terminated StringInfo,
-		 * so we must construct one.
-		 */
-		resetStringInfo(&msg);
-		enlargeStringInfo(&msg, nbytes);
-		msg.len = nbytes;
-		memcpy(msg.data, data, nbytes);
-		msg.data[nbytes] = '\0';
-		msgtype = pq_getmsgbyte(&msg);
-
 		/* Dispatch on message type. */
-		switch (msgtype)
+		switch (dispatch_worker_message(&msg, pid, &state->complete))
 		{
-			case 'E':
-			case 'N':
-				{
-					ErrorData	edata;
-					ErrorContextCallback context;
-
-					/* Parse ErrorResponse or NoticeResponse. */
-					pq_parse_errornotice(&msg, &edata);
-
-					/*
-					 * Limit the maximum error level to ERROR.  We don't want
-					 * a FATAL inside the background worker to kill the user
-					 * session.
-					 */
-					if (edata.elevel > ERROR)
-						edata.elevel = ERROR;
-
-					/*
-					 * Rethrow the error with an appropriate context method.
-					 */
-					context.callback = pg_background_error_callback;
-					context.arg = (void *) &pid;
-					context.previous = error_context_stack;
-					error_context_stack = &context;
-					throw_untranslated_error(edata);
-					error_context_stack = context.previous;
-
-					break;
-				}
-			case 'A':
-				{
-					/* Propagate NotifyResponse. */
-					pq_putmessage(msg.data[0], &msg.data[1], nbytes - 1);
-					break;
-				}
 			case 'T':
 				{
-					int16		natts = pq_getmsgint(&msg, 2);
-					int16		i;
-
-					if (state->has_row_description)
-						elog(ERROR, "multiple RowDescription messages");
-					state->has_row_description = true;
-					if (natts != tupdesc->natts)
-						ereport(ERROR,
-								(errcode(ERRCODE_DATATYPE_MISMATCH),
-								 errmsg("remote query result rowtype does not match "
-										"the specified FROM clause rowtype")));
-
-					for (i = 0; i < natts; ++i)
-					{
-						Oid			type_id;
-
-						(void) pq_getmsgstring(&msg);	/* name */
-						(void) pq_getmsgint(&msg, 4);	/* table OID */
-						(void) pq_getmsgint(&msg, 2);	/* table attnum */
-						type_id = pq_getmsgint(&msg, 4);	/* type OID */
-						(void) pq_getmsgint(&msg, 2);	/* type length */
-						(void) pq_getmsgint(&msg, 4);	/* typmod */
-						(void) pq_getmsgint(&msg, 2);	/* format code */
-
-						if (exists_binary_recv_fn(type_id))
-						{
-							if (type_id != TupleDescAttr(tupdesc, i)->atttypid)
-							{
-								ereport(ERROR,
-										(errcode(ERRCODE_DATATYPE_MISMATCH),
-										 errmsg("remote query result rowtype does not match "
-												"the specified FROM clause rowtype")));
-							}
-						}
-						else if (TupleDescAttr(tupdesc, i)->atttypid != TEXTOID)
-						{
-							ereport(ERROR,
-									(errcode(ERRCODE_DATATYPE_MISMATCH),
-									 errmsg("remote query result rowtype does not match "
-											"the specified FROM clause rowtype"),
-									 errhint("use text type instead")));
-						}
-					}
-
-					pq_getmsgend(&msg);
+					MemoryContext oldcontext;
 
+					oldcontext =
+						MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+					check_row_description(state, tupdesc, &msg);
+					MemoryContextSwitchTo(oldcontext);
 					break;
 				}
 			case 'D':
@@ -520,24 +1691,7 @@ pg_background_result(PG_FUNCTION_ARGS)
 					MemoryContextSwitchTo(oldcontext);
 					break;
 				}
-			case 'G':
-			case 'H':
-			case 'W':
-				{
-					ereport(ERROR,
-							(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-							 errmsg("COPY protocol not allowed in pg_background")));
-					break;
-				}
-			case 'Z':
-				{
-					/* Handle ReadyForQuery message. */
-					state->complete = true;
-					break;
-				}
 			default:
-				elog(WARNING, "unknown message type: %c (%zu bytes)",
-					 msg.data[0], nbytes);
 				break;
 		}
 	}
@@ -575,543 +1729,5773 @@ pg_background_result(PG_FUNCTION_ARGS)
 	}
 
 	/* We're done! */
-	dsm_detach(state->info->seg);
+	if (state->spool != NULL)
+		FreeFile(state->spool);
+	else
+		dsm_detach(state->info->seg);
 	SRF_RETURN_DONE(funcctx);
 }
 
 /*
- * Parse a DataRow message and form a result tuple.
+ * Look up the worker with the given PID and claim its results for reading.
+ *
+ * Whether we succeed or fail, a future caller may not try to read from the
+ * DSM once we've begun to do so.  Accordingly, hand the mapping back to the
+ * current resource owner so that it's cleaned up at end of query.
  */
-static HeapTuple
-form_result_tuple(pg_background_result_state * state, TupleDesc tupdesc,
-				  StringInfo msg)
+static pg_background_worker_info *
+claim_worker_info(int32 pid)
 {
-	/* Handle DataRow message. */
-	int16		natts = pq_getmsgint(msg, 2);
-	int16		i;
-	Datum	   *values = NULL;
-	bool	   *isnull = NULL;
-	StringInfoData buf;
+	pg_background_worker_info *info;
 
-	if (!state->has_row_description)
-		elog(ERROR, "DataRow not preceded by RowDescription");
-	if (natts != tupdesc->natts)
-		elog(ERROR, "malformed DataRow");
-	if (natts > 0)
+	/* See if we have a connection to the specified PID. */
+	if ((info = find_worker_info(pid)) == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("PID %d is not attached to this session", pid)));
+	check_rights(info);
+
+	/* Can't read results twice. */
+	if (info->consumed)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("results for PID %d have already been consumed", pid)));
+	info->consumed = true;
+
+	dsm_unpin_mapping(info->seg);
+
+	return info;
+}
+
+/*
+ * Read the next protocol message sent by a worker into msg.  Returns false
+ * once the worker has gone away and there is nothing more to read.
+ *
+ * Errors arrive through the control queue, so they can overtake result rows
+ * still in transit.  Once we have one, we throw away the rest of the result,
+ * but still pass on any notices the worker sent before the error.
+ */
+static bool
+receive_worker_message(pg_background_worker_info * info, StringInfo msg)
+{
+	process_control_messages(info);
+
+	while (receive_result_message(info, msg))
 	{
-		values = palloc(natts * sizeof(Datum));
-		isnull = palloc(natts * sizeof(bool));
+		/*
+		 * The statistics for the last statement went out before the worker
+		 * said it was ready, so pick them up before our caller stops reading.
+		 */
+		if (msg->data[0] == 'Z')
+			process_control_messages(info);
+
+		if (info->pending_error == NULL || msg->data[0] == 'N')
+			return true;
 	}
-	initStringInfo(&buf);
 
-	for (i = 0; i < natts; ++i)
+	/* The worker is gone, but may have reported an error on its way out. */
+	process_control_messages(info);
+	if (info->pending_error == NULL)
+		return false;
+
+	copy_worker_message(msg, info->pending_error->data,
+						info->pending_error->len);
+	pfree(info->pending_error->data);
+	pfree(info->pending_error);
+	info->pending_error = NULL;
+	return true;
+}
+
+/*
+ * Read the next message of the worker's result proper into msg.  Returns
+ * false once the worker has gone away and there is nothing more to read.
+ *
+ * Messages normally arrive through the shared memory queue or the ring,
+ * depending on the transport.  A worker whose whole output is tiny leaves it
+ * in the inline slot of the fixed data area instead, which we can only trust
+ * after the transport reports the worker has detached.
+ */
+static bool
+receive_result_message(pg_background_worker_info * info, StringInfo msg)
+{
+	pg_background_fixed_data *fdata = info->fdata;
+	uint32		len;
+
+	if (!info->reading_inline && info->ring != NULL)
 	{
-		int32		bytes = pq_getmsgint(msg, 4);
+		if (ring_receive_message(info, msg))
+			return true;
+
+		/* The worker is gone; see whether it left anything inline. */
+		info->reading_inline = true;
+		pg_read_barrier();
+	}
+	else if (!info->reading_inline)
+	{
+		shm_mq_result res;
+		Size		nbytes;
+		void	   *data;
 
-		if (bytes < 0)
+		/*
+		 * Don't block in shm_mq_receive: while we wait for the next result
+		 * message, the worker may be sending us control messages.
+		 */
+		for (;;)
 		{
-			values[i] = ReceiveFunctionCall(&state->receive_functions[i],
-											NULL,
-											state->typioparams[i],
-											TupleDescAttr(tupdesc, i)->atttypmod);
-			isnull[i] = true;
+			int			rc;
+
+			res = shm_mq_receive(info->responseq, &nbytes, &data, true);
+			if (res != SHM_MQ_WOULD_BLOCK)
+				break;
+
+			rc = WaitLatch_compat(MyLatch, WL_LATCH_SET | PG_BACKGROUND_WL_POSTMASTER,
+								  0, PG_WAIT_IPC);
+			if (rc & WL_POSTMASTER_DEATH)
+				proc_exit(1);
+			ResetLatch(MyLatch);
+			CHECK_FOR_INTERRUPTS();
+			process_control_messages(info);
 		}
-		else
+
+		if (res == SHM_MQ_SUCCESS)
 		{
-			resetStringInfo(&buf);
-			appendBinaryStringInfo(&buf, pq_getmsgbytes(msg, bytes), bytes);
-			values[i] = ReceiveFunctionCall(&state->receive_functions[i],
-											&buf,
-											state->typioparams[i],
-											TupleDescAttr(tupdesc, i)->atttypmod);
-			isnull[i] = false;
+			pg_atomic_write_u64(&info->fdata->queue_read,
+								pg_atomic_read_u64(&info->fdata->queue_read) +
+								PG_BACKGROUND_MQ_FOOTPRINT(nbytes));
+			copy_worker_message(msg, data, nbytes);
+			return true;
 		}
+
+		/* The worker is gone; see whether it left anything inline. */
+		info->reading_inline = true;
+		pg_read_barrier();
 	}
 
-	pq_getmsgend(msg);
+	if (info->inline_offset + PG_BACKGROUND_MSG_HDRSZ > fdata->inline_len)
+		return false;
 
-	return heap_form_tuple(tupdesc, values, isnull);
+	memcpy(&len, &fdata->inline_data[info->inline_offset + 1], sizeof(uint32));
+	if (info->inline_offset + PG_BACKGROUND_MSG_HDRSZ + len > fdata->inline_len)
+		elog(ERROR, "malformed inline result from background worker");
+
+	resetStringInfo(msg);
+	enlargeStringInfo(msg, len + 1);
+	msg->data[0] = fdata->inline_data[info->inline_offset];
+	memcpy(&msg->data[1],
+		   &fdata->inline_data[info->inline_offset + PG_BACKGROUND_MSG_HDRSZ],
+		   len);
+	msg->len = len + 1;
+	msg->data[msg->len] = '\0';
+	info->inline_offset += PG_BACKGROUND_MSG_HDRSZ + len;
+
+	return true;
 }
 
 /*
- * Detach from the dynamic shared memory segment used for communication with
- * a background worker.  This prevents the worker from stalling waiting for
- * us to read its results.
+ * Handle whatever the worker has sent us through its control queue.  An
+ * error is kept back until the rest of the result has been read; statistics
+ * are added to the session's totals.  Never waits.
  */
-Datum
-pg_background_detach(PG_FUNCTION_ARGS)
+static void
+process_control_messages(pg_background_worker_info * info)
 {
-	int32		pid = PG_GETARG_INT32(0);
-	pg_background_worker_info *info;
+	for (;;)
+	{
+		shm_mq_result res;
+		Size		nbytes;
+		void	   *data;
+		StringInfoData msg;
 
-	info = find_worker_info(pid);
-	if (info == NULL)
-		ereport(ERROR,
-				(errcode(ERRCODE_UNDEFINED_OBJECT),
-				 errmsg("PID %d is not attached to this session", pid)));
-	dsm_detach(info->seg);
+		res = shm_mq_receive(info->control_in, &nbytes, &data, true);
+		if (res != SHM_MQ_SUCCESS || nbytes == 0)
+			break;
 
-	PG_RETURN_VOID();
+		switch (*(char *) data)
+		{
+			case PG_BACKGROUND_CONTROL_ERROR:
+				if (info->pending_error != NULL)
+					break;		/* only the first error matters */
+				info->pending_error = MemoryContextAlloc(TopMemoryContext,
+														 sizeof(StringInfoData));
+				info->pending_error->data = MemoryContextAlloc(TopMemoryContext,
+															   nbytes + 1);
+				memcpy(info->pending_error->data, data, nbytes);
+				info->pending_error->data[nbytes] = '\0';
+				info->pending_error->len = nbytes;
+				break;
+			case PG_BACKGROUND_CONTROL_STATS:
+				initStringInfo(&msg);
+				copy_worker_message(&msg, data, nbytes);
+				msg.cursor = 1;
+				record_statement_stats(&msg);
+				pfree(msg.data);
+				break;
+			default:
+				elog(WARNING, "unknown control message type %d from background worker",
+					 *(char *) data);
+				break;
+		}
+	}
 }
 
 /*
- * When the dynamic shared memory segment associated with a worker is
- * cleaned up, we need to clean up our associated private data structures.
+ * Add the timings a worker reported for one statement to the session's
+ * totals for that statement.
  */
 static void
-cleanup_worker_info(dsm_segment *seg, Datum pid_datum)
+record_statement_stats(StringInfo msg)
 {
-	pid_t		pid = DatumGetInt32(pid_datum);
+	const char *command;
+	const char *query;
+	uint64		queryid;
+	pg_background_stats_entry *entry;
 	bool		found;
-	pg_background_worker_info *info;
-
-	/* Find any worker info entry for this PID.  If none, we're done. */
-	if ((info = find_worker_info(pid)) == NULL)
-		return;
+	int64		peak_memory;
+	int			i;
 
-	/* Free memory used by the BackgroundWorkerHandle. */
-	if (info->handle != NULL)
+	if (pg_background_stats_hash == NULL)
 	{
-		pfree(info->handle);
-		info->handle = NULL;
+		HASHCTL		ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(uint64);
+		ctl.entrysize = sizeof(pg_background_stats_entry);
+		pg_background_stats_hash = hash_create("pg_background statistics",
+											   16, &ctl,
+											   HASH_ELEM | HASH_BLOBS);
 	}
 
-	/* Remove the hashtable entry. */
-	hash_search(worker_hash, (void *) &pid, HASH_REMOVE, &found);
+	command = pq_getmsgstring(msg);
+	queryid = (uint64) pq_getmsgint64(msg);
+	query = pq_getmsgstring(msg);
+
+	entry = hash_search(pg_background_stats_hash, &queryid, HASH_ENTER, &found);
 	if (!found)
-		elog(ERROR, "pg_background worker_hash table corrupted");
+	{
+		strlcpy(entry->command, command, sizeof(entry->command));
+		strlcpy(entry->query, query, sizeof(entry->query));
+		entry->calls = 0;
+		memset(entry->usecs, 0, sizeof(entry->usecs));
+		entry->temp_bytes = 0;
+		entry->peak_memory = 0;
+		memset(entry->queue_samples, 0, sizeof(entry->queue_samples));
+	}
+
+	entry->calls++;
+	for (i = 0; i < PG_BACKGROUND_NPHASES; ++i)
+		entry->usecs[i] += pq_getmsgint64(msg);
+	entry->temp_bytes += pq_getmsgint64(msg);
+	peak_memory = pq_getmsgint64(msg);	/* Max() would read it twice */
+	entry->peak_memory = Max(entry->peak_memory, peak_memory);
+	for (i = 0; i <= PG_BACKGROUND_QUEUE_BUCKETS; ++i)
+		entry->queue_samples[i] += pq_getmsgint64(msg);
+	pq_getmsgend(msg);
 }
 
 /*
- * Find the background worker information for the worker with a given PID.
+ * Message-parsing routines operate on a null-terminated StringInfo, so we
+ * must construct one.
  */
-static pg_background_worker_info *
-find_worker_info(pid_t pid)
+static void
+copy_worker_message(StringInfo msg, const void *data, Size nbytes)
 {
-	pg_background_worker_info *info = NULL;
-
-	if (worker_hash != NULL)
-		info = hash_search(worker_hash, (void *) &pid, HASH_FIND, NULL);
-
-	return info;
+	resetStringInfo(msg);
+	enlargeStringInfo(msg, nbytes);
+	msg->len = nbytes;
+	memcpy(msg->data, data, nbytes);
+	msg->data[nbytes] = '\0';
 }
 
 /*
- * Check whether the current user has rights to manipulate the background
- * worker with the given PID.
+ * Open the spool file left by an orphaned worker with the given PID, or
+ * return NULL if there isn't one.  The file is removed straight away, so the
+ * results can be read only once, as with a worker we launched ourselves.
  */
-static void
-check_rights(pg_background_worker_info * info)
+static FILE *
+open_spooled_result(int32 pid)
 {
-	Oid			current_user_id;
-	int			sec_context;
+	char	   *path;
+	FILE	   *spool;
+	pg_background_spool_header hdr;
+
+	path = palloc(MAXPGPATH);
+	spool_path(path, pid, false);
+	spool = AllocateFile(path, PG_BINARY_R);
+	if (spool == NULL)
+	{
+		struct stat st;
 
-	GetUserIdAndSecContext(&current_user_id, &sec_context);
-	if (!has_privs_of_role(current_user_id, info->current_user_id))
+		if (errno != ENOENT)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not open file \"%s\": %m", path)));
+
+		spool_path(path, pid, true);
+		if (stat(path, &st) == 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+					 errmsg("background worker with PID %d is still spooling its results",
+							pid)));
+		return NULL;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, spool) != 1 ||
+		hdr.magic != PG_BACKGROUND_MAGIC)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("invalid spool file \"%s\"", path)));
+	if (hdr.database_id != MyDatabaseId)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("background worker with PID %d ran in another database",
+						pid)));
+	if (!has_privs_of_role(GetUserId(), hdr.user_id))
 		ereport(ERROR,
 				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
 				 errmsg("permission denied for background worker with PID \"%d\"",
-						info->pid)));
+						pid)));
+
+	if (unlink(path) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not remove file \"%s\": %m", path)));
+
+	return spool;
 }
 
 /*
- * Save worker information for future IPC.
+ * Read the next message from a spool file into msg.  Returns false at the
+ * end of the file.
  */
-static void
-save_worker_info(pid_t pid, dsm_segment *seg, BackgroundWorkerHandle *handle,
-				 shm_mq_handle *responseq)
+static bool
+read_spooled_message(FILE *spool, StringInfo msg)
 {
-	pg_background_worker_info *info;
-	Oid			current_user_id;
-	int			sec_context;
-
-	/* If the hash table hasn't been set up yet, do that now. */
-	if (worker_hash == NULL)
-	{
-		HASHCTL		ctl;
-
-		ctl.keysize = sizeof(pid_t);
-		ctl.entrysize = sizeof(pg_background_worker_info);
-		worker_hash = hash_create("pg_background worker_hash", 8, &ctl,
-								  HASH_BLOBS | HASH_ELEM);
-	}
+	char		hdr[PG_BACKGROUND_MSG_HDRSZ];
+	uint32		len;
 
-	/* Get current authentication information. */
-	GetUserIdAndSecContext(&current_user_id, &sec_context);
-
-	/*
-	 * In the unlikely event that there's an older worker with this PID, just
-	 * detach it - unless it has a different user ID than the currently-active
-	 * one, in which case someone might be trying to pull a fast one.  Let's
-	 * kill the backend to make sure we don't break anyone's expectations.
-	 */
-	if ((info = find_worker_info(pid)) != NULL)
-	{
-		if (current_user_id != info->current_user_id)
-			ereport(FATAL,
-					(errcode(ERRCODE_DUPLICATE_OBJECT),
-					 errmsg("background worker with PID \"%d\" already exists",
-							pid)));
-		dsm_detach(info->seg);
-	}
+	if (fread(hdr, PG_BACKGROUND_MSG_HDRSZ, 1, spool) != 1)
+		return false;
+	memcpy(&len, hdr + 1, sizeof(uint32));
 
-	/* When the DSM is unmapped, clean everything up. */
-	on_dsm_detach(seg, cleanup_worker_info, Int32GetDatum(pid));
+	resetStringInfo(msg);
+	enlargeStringInfo(msg, len + 1);
+	msg->data[0] = hdr[0];
+	if (len > 0 && fread(&msg->data[1], len, 1, spool) != 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("spool file of background worker is truncated")));
+	msg->len = len + 1;
+	msg->data[msg->len] = '\0';
 
-	/* Create a new entry for this worker. */
-	info = hash_search(worker_hash, (void *) &pid, HASH_ENTER, NULL);
-	info->seg = seg;
-	info->handle = handle;
-	info->current_user_id = current_user_id;
-	info->responseq = responseq;
-	info->consumed = false;
+	return true;
 }
 
 /*
- * Indicate that an error came from a particular background worker.
+ * Look up the functions needed to decode DataRow messages into tuples of the
+ * given descriptor: binary receive functions for columns sent in binary
+ * format, and text input functions for the others.  state->formats must
+ * already be filled in.
  */
 static void
-pg_background_error_callback(void *arg)
+setup_receive_functions(pg_background_result_state * state, TupleDesc tupdesc)
 {
-	pid_t		pid = *(pid_t *) arg;
+	int			natts = tupdesc->natts;
+	int			i;
 
-	errcontext("background worker, pid %d", pid);
+	if (natts <= 0)
+		return;
+
+	state->receive_functions = palloc(sizeof(FmgrInfo) * natts);
+	state->typioparams = palloc(sizeof(Oid) * natts);
+
+	for (i = 0; i < natts; ++i)
+	{
+		Oid			receive_function_id;
+
+		if (state->formats[i] == PG_BACKGROUND_FORMAT_TEXT)
+			getTypeInputInfo(TupleDescAttr(tupdesc, i)->atttypid,
+							 &receive_function_id,
+							 &state->typioparams[i]);
+		else
+			getTypeBinaryInputInfo(TupleDescAttr(tupdesc, i)->atttypid,
+								   &receive_function_id,
+								   &state->typioparams[i]);
+
+		fmgr_info(receive_function_id, &state->receive_functions[i]);
+	}
 }
 
 /*
- * Background worker entrypoint.
+ * Check a RowDescription message against the tuple descriptor the caller
+ * expects the remote query to return, and get ready to decode the DataRow
+ * messages that follow it.
  */
-void
-pg_background_worker_main(Datum main_arg)
+static void
+check_row_description(pg_background_result_state * state, TupleDesc tupdesc,
+					  StringInfo msg)
 {
-	dsm_segment *seg;
-	shm_toc    *toc;
-	pg_background_fixed_data *fdata;
-	char	   *sql;
-	char	   *gucstate;
-	shm_mq	   *mq;
-	shm_mq_handle *responseq;
-
-	/* Establish signal handlers. */
-	pqsignal(SIGTERM, handle_sigterm);
-	BackgroundWorkerUnblockSignals();
-
-	/* Set up a memory context and resource owner. */
-	Assert(CurrentResourceOwner == NULL);
-	CurrentResourceOwner = ResourceOwnerCreate(NULL, "pg_background");
-	CurrentMemoryContext = AllocSetContextCreate(TopMemoryContext,
-												 "pg_background session",
-												 ALLOCSET_DEFAULT_MINSIZE,
-												 ALLOCSET_DEFAULT_INITSIZE,
-												 ALLOCSET_DEFAULT_MAXSIZE);
-
+	int16		natts = pq_getmsgint(msg, 2);
+	int16		i;
 
-	/* Connect to the dynamic shared memory segment. */
-	seg = dsm_attach(DatumGetInt32(main_arg));
-	if (seg == NULL)
-		ereport(ERROR,
-				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-				 errmsg("unable to map dynamic shared memory segment")));
-	toc = shm_toc_attach(PG_BACKGROUND_MAGIC, dsm_segment_address(seg));
-	if (toc == NULL)
+	if (state->has_row_description)
+		elog(ERROR, "multiple RowDescription messages");
+	state->has_row_description = true;
+	if (natts != tupdesc->natts)
 		ereport(ERROR,
-				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-				 errmsg("bad magic number in dynamic shared memory segment")));
-
-	/* Find data structures in dynamic shared memory. */
-	fdata = shm_toc_lookup_compat(toc, PG_BACKGROUND_KEY_FIXED_DATA, false);
-	if (fdata == NULL)
-//Line 159:Added error handling
-			ereport(ERROR, (errmsg("Failed to allocate memory for fixed data")));
-	sql = shm_toc_lookup_compat(toc, PG_BACKGROUND_KEY_SQL, false);
-	gucstate = shm_toc_lookup_compat(toc, PG_BACKGROUND_KEY_GUC, false);
-	mq = shm_toc_lookup_compat(toc, PG_BACKGROUND_KEY_QUEUE, false);
-
-	shm_mq_set_sender(mq, MyProc);
-	responseq = shm_mq_attach(mq, seg, NULL);
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("remote query result rowtype does not match "
+						"the specified FROM clause rowtype")));
+	if (natts > 0)
+		state->formats = palloc(sizeof(int16) * natts);
 
-	/* Redirect protocol messages to responseq. */
-	/* pq_redirect_to_shm_mq(mq, responseq); */
-	pq_redirect_to_shm_mq(seg, responseq);
+	for (i = 0; i < natts; ++i)
+	{
+		Oid			type_id;
 
-	/*
-	 * Initialize our user and database ID based on the strings version of the
-	 * data, and then go back and check that we actually got the database and
-	 * user ID that we intended to get.  We do this because it's not
-	 * impossible for the process that started us to die before we get here,
-	 * and the user or database could be renamed in the meantime.  We don't
-	 * want to latch on the wrong object by accident.  There should probably
-	 * be a variant of BackgroundWorkerInitializeConnection that accepts OIDs
-	 * rather than strings.
-	 */
-	BackgroundWorkerInitializeConnection(NameStr(fdata->database),
-										 NameStr(fdata->authenticated_user)
-#if PG_VERSION_NUM >= 110000
-										 ,BGWORKER_BYPASS_ALLOWCONN
-#endif
-		);
+		(void) pq_getmsgstring(msg);	/* name */
+		(void) pq_getmsgint(msg, 4);	/* table OID */
+		(void) pq_getmsgint(msg, 2);	/* table attnum */
+		type_id = pq_getmsgint(msg, 4); /* type OID */
+		(void) pq_getmsgint(msg, 2);	/* type length */
+		(void) pq_getmsgint(msg, 4);	/* typmod */
+		state->formats[i] = pq_getmsgint(msg, 2);	/* format code */
 
-	if (fdata->database_id != MyDatabaseId ||
-		fdata->authenticated_user_id != GetAuthenticatedUserId())
-		ereport(ERROR,
-				(errmsg("user or database renamed during pg_background startup")));
+		if (state->formats[i] == PG_BACKGROUND_FORMAT_TEXT)
+		{
+			/* Any type can be read back from its text form as text. */
+			if (type_id != TupleDescAttr(tupdesc, i)->atttypid &&
+				TupleDescAttr(tupdesc, i)->atttypid != TEXTOID)
+				ereport(ERROR,
+						(errcode(ERRCODE_DATATYPE_MISMATCH),
+						 errmsg("remote query result rowtype does not match "
+								"the specified FROM clause rowtype")));
+		}
+		else if (exists_binary_recv_fn(type_id))
+		{
+			if (type_id != TupleDescAttr(tupdesc, i)->atttypid)
+			{
+				ereport(ERROR,
+						(errcode(ERRCODE_DATATYPE_MISMATCH),
+						 errmsg("remote query result rowtype does not match "
+								"the specified FROM clause rowtype")));
+			}
+		}
+		else if (TupleDescAttr(tupdesc, i)->atttypid != TEXTOID)
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_DATATYPE_MISMATCH),
+					 errmsg("remote query result rowtype does not match "
+							"the specified FROM clause rowtype"),
+					 errhint("use text type instead")));
+		}
+	}
 
-	/* Restore GUC values from launching backend. */
-	StartTransactionCommand();
-	RestoreGUCState(gucstate);
-	CommitTransactionCommand();
+	pq_getmsgend(msg);
 
-	/* Restore user ID and security context. */
-	SetUserIdAndSecContext(fdata->current_user_id, fdata->sec_context);
+	setup_receive_functions(state, tupdesc);
+}
 
-	/* Prepare to execute the query. */
-	SetCurrentStatementStartTimestamp();
-	debug_query_string = sql;
-	pgstat_report_activity(STATE_RUNNING, sql);
-	StartTransactionCommand();
-	if (StatementTimeout > 0)
-		enable_timeout_after(STATEMENT_TIMEOUT, StatementTimeout);
-	else
-		disable_timeout(STATEMENT_TIMEOUT, false);
+/*
+ * Parse a DataRow message and form a result tuple.
+ */
+static HeapTuple
+form_result_tuple(pg_background_result_state * state, TupleDesc tupdesc,
+				  StringInfo msg)
+{
+	Datum	   *values = NULL;
+	bool	   *isnull = NULL;
 
-	/* Execute the query. */
-	execute_sql_string(sql);
+	if (tupdesc->natts > 0)
+	{
+		values = palloc(tupdesc->natts * sizeof(Datum));
+		isnull = palloc(tupdesc->natts * sizeof(bool));
+	}
 
-	/* Post-execution cleanup. */
-	disable_timeout(STATEMENT_TIMEOUT, false);
-	CommitTransactionCommand();
-#if PG_VERSION_NUM < 150000
-	ProcessCompletedNotifies();
-#endif
-	pgstat_report_activity(STATE_IDLE, sql);
-	pgstat_report_stat(true);
+	read_data_row(state, tupdesc, msg, values, isnull);
 
-	/* Signal that we are done. */
-	ReadyForQuery(DestRemote);
+	return heap_form_tuple(tupdesc, values, isnull);
 }
 
 /*
- * Check binary input function exists for the given type.
+ * Parse a DataRow message into caller-supplied values and isnull arrays,
+ * which must have room for tupdesc->natts entries.
  */
-static bool
-exists_binary_recv_fn(Oid type)
+static void
+read_data_row(pg_background_result_state * state, TupleDesc tupdesc,
+			  StringInfo msg, Datum *values, bool *isnull)
 {
-	HeapTuple	typeTuple;
-	Form_pg_type pt;
-	bool		exists_rev_fn;
+	/* Handle DataRow message. */
+	int16		natts = pq_getmsgint(msg, 2);
+	int16		i;
+	StringInfoData buf;
 
-	typeTuple = SearchSysCache1(TYPEOID, ObjectIdGetDatum(type));
-	if (!HeapTupleIsValid(typeTuple))
-		elog(ERROR, "cache lookup failed for type %u", type);
+	if (!state->has_row_description)
+		elog(ERROR, "DataRow not preceded by RowDescription");
+	if (natts != tupdesc->natts)
+		elog(ERROR, "malformed DataRow");
+	initStringInfo(&buf);
 
-	pt = (Form_pg_type) GETSTRUCT(typeTuple);
-	exists_rev_fn = OidIsValid(pt->typreceive);
-	ReleaseSysCache(typeTuple);
+	for (i = 0; i < natts; ++i)
+	{
+		int32		bytes = pq_getmsgint(msg, 4);
 
-	return exists_rev_fn;
-}
+		if (state->formats[i] == PG_BACKGROUND_FORMAT_TEXT)
+		{
+			char	   *str = NULL;
+
+			if (bytes >= 0)
+				str = pnstrdup(pq_getmsgbytes(msg, bytes), bytes);
+			values[i] = InputFunctionCall(&state->receive_functions[i],
+										  str,
+										  state->typioparams[i],
+										  TupleDescAttr(tupdesc, i)->atttypmod);
+			isnull[i] = (str == NULL);
+		}
+		else if (bytes < 0)
+		{
+			values[i] = ReceiveFunctionCall(&state->receive_functions[i],
+											NULL,
+											state->typioparams[i],
+											TupleDescAttr(tupdesc, i)->atttypmod);
+			isnull[i] = true;
+		}
+		else
+		{
+			resetStringInfo(&buf);
+			appendBinaryStringInfo(&buf, pq_getmsgbytes(msg, bytes), bytes);
+			values[i] = ReceiveFunctionCall(&state->receive_functions[i],
+											&buf,
+											state->typioparams[i],
+											TupleDescAttr(tupdesc, i)->atttypmod);
+			isnull[i] = false;
+		}
+	}
 
+	pq_getmsgend(msg);
+}
 
 /*
- * Execute given SQL string.
+ * Retrieve the results of a background query previously launched in this
+ * session and insert them directly into a table.
  *
- * Using SPI here would preclude backgrounding commands like VACUUM which one
- * might very well wish to launch in the background.  So we do this instead.
+ * Rather than returning every row through the set-returning function
+ * protocol only to have the executor insert it again one at a time, rows are
+ * decoded straight into slots and written in batches with
+ * table_multi_insert, much as COPY FROM does.  Returns the number of rows
+ * inserted.
  */
-static void
-execute_sql_string(const char *sql)
+Datum
+pg_background_result_into(PG_FUNCTION_ARGS)
 {
-	List	   *raw_parsetree_list;
-	ListCell   *lc1;
-	bool		isTopLevel;
-	int			commands_remaining;
-	MemoryContext parsecontext;
+#if PG_VERSION_NUM < 120000
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("pg_background_result_into requires PostgreSQL 12 or later")));
+	PG_RETURN_NULL();
+#else
+	int32		pid = PG_GETARG_INT32(0);
+	Oid			relid = PG_GETARG_OID(1);
+	pg_background_worker_info *info;
+	pg_background_result_state state;
+	Relation	rel;
+	TupleDesc	reldesc;
+	TupleDesc	tupdesc;
+	AttrNumber *attmap;
+	int			natts;
+	AclResult	aclresult;
+	EState	   *estate;
+	ResultRelInfo *resultRelInfo;
+	BulkInsertState bistate;
+	CommandId	mycid;
+	int			ti_options = 0;
+	TupleTableSlot **slots;
+	int			nbuffered = 0;
+	int64		processed = 0;
+	MemoryContext batchcontext;
 	MemoryContext oldcontext;
+	Datum	   *values;
+	bool	   *isnull;
+	StringInfoData msg;
+	int			i;
+
+	/* Claim the worker's results; they'll be cleaned up at end of query. */
+	info = claim_worker_info(pid);
+
+	/* Open the target table and make sure we can bulk-insert into it. */
+	rel = table_open(relid, RowExclusiveLock);
+
+	if (rel->rd_rel->relkind != RELKIND_RELATION)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("cannot insert background results directly into \"%s\"",
+						RelationGetRelationName(rel)),
+				 errdetail("Only plain tables are supported."),
+				 errhint("Use INSERT ... SELECT FROM pg_background_result() instead.")));
+
+	aclresult = pg_class_aclcheck(relid, GetUserId(), ACL_INSERT);
+	if (aclresult != ACLCHECK_OK)
+		aclcheck_error(aclresult, get_relkind_objtype(rel->rd_rel->relkind),
+					   RelationGetRelationName(rel));
+
+	if (!rel->rd_islocaltemp)
+		PreventCommandIfReadOnly("pg_background_result_into()");
 
 	/*
-	 * Parse the SQL string into a list of raw parse trees.
-	 *
-	 * Because we allow statements that perform internal transaction control,
-	 * we can't do this in TopTransactionContext; the parse trees might get
-	 * blown away before we're done executing them.
+	 * Row-level security policies and triggers (which includes foreign key
+	 * checks) need the full executor machinery, so leave those to the regular
+	 * INSERT path.
 	 */
-	parsecontext = AllocSetContextCreate(TopMemoryContext,
-										 "pg_background parse/plan",
+	if (check_enable_rls(relid, InvalidOid, false) == RLS_ENABLED)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("cannot insert background results directly into \"%s\"",
+						RelationGetRelationName(rel)),
+				 errdetail("The table has row-level security enabled."),
+				 errhint("Use INSERT ... SELECT FROM pg_background_result() instead.")));
+	if (rel->trigdesc != NULL &&
+		(rel->trigdesc->trig_insert_before_row ||
+		 rel->trigdesc->trig_insert_after_row ||
+		 rel->trigdesc->trig_insert_instead_row ||
+		 rel->trigdesc->trig_insert_before_statement ||
+		 rel->trigdesc->trig_insert_after_statement))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("cannot insert background results directly into \"%s\"",
+						RelationGetRelationName(rel)),
+				 errdetail("The table has INSERT triggers or foreign keys."),
+				 errhint("Use INSERT ... SELECT FROM pg_background_result() instead.")));
+
+	/*
+	 * The remote query must return one column for each column of the table,
+	 * skipping dropped and generated columns, just like COPY FROM.
+	 */
+	reldesc = RelationGetDescr(rel);
+	attmap = palloc(sizeof(AttrNumber) * reldesc->natts);
+	natts = 0;
+	for (i = 0; i < reldesc->natts; ++i)
+	{
+		Form_pg_attribute attr = TupleDescAttr(reldesc, i);
+
+		if (attr->attisdropped || attr->attgenerated)
+			continue;
+		attmap[natts++] = i;
+	}
+	tupdesc = CreateTemplateTupleDesc(natts);
+	for (i = 0; i < natts; ++i)
+		TupleDescCopyEntry(tupdesc, i + 1, reldesc, attmap[i] + 1);
+
+	/* Set up just enough executor state to check constraints and indexes. */
+	estate = CreateExecutorState();
+	resultRelInfo = init_result_relation(estate, rel);
+	ExecOpenIndices(resultRelInfo, false);
+
+	mycid = GetCurrentCommandId(true);
+	bistate = GetBulkInsertState();
+	slots = palloc0(sizeof(TupleTableSlot *) * PG_BACKGROUND_MULTI_INSERT_TUPLES);
+	values = palloc(sizeof(Datum) * Max(natts, 1));
+	isnull = palloc(sizeof(bool) * Max(natts, 1));
+
+	/* Decoded rows live here until the batch holding them is flushed. */
+	batchcontext = AllocSetContextCreate(CurrentMemoryContext,
+										 "pg_background result_into",
 										 ALLOCSET_DEFAULT_MINSIZE,
 										 ALLOCSET_DEFAULT_INITSIZE,
 										 ALLOCSET_DEFAULT_MAXSIZE);
-	oldcontext = MemoryContextSwitchTo(parsecontext);
-	raw_parsetree_list = pg_parse_query(sql);
-	commands_remaining = list_length(raw_parsetree_list);
-	isTopLevel = commands_remaining == 1;
-	MemoryContextSwitchTo(oldcontext);
 
-	/*
-	 * Do parse analysis, rule rewrite, planning, and execution for each raw
-	 * parsetree.  We must fully execute each query before beginning parse
-	 * analysis on the next one, since there may be interdependencies.
-	 */
-	foreach(lc1, raw_parsetree_list)
+	memset(&state, 0, sizeof(state));
+	state.info = info;
+
+	/* Initialize message buffer. */
+	initStringInfo(&msg);
+
+	/* Read and processes messages from the worker. */
+	while (receive_worker_message(info, &msg))
 	{
-#if PG_VERSION_NUM < 100000
-		Node	   *parsetree = (Node *) lfirst(lc1);
+		/* Dispatch on message type. */
+		switch (dispatch_worker_message(&msg, pid, &state.complete))
+		{
+			case 'T':
+				{
+					check_row_description(&state, tupdesc, &msg);
+					break;
+				}
+			case 'D':
+				{
+					TupleTableSlot *slot;
+
+					if (slots[nbuffered] == NULL)
+						slots[nbuffered] = table_slot_create(rel, NULL);
+					slot = slots[nbuffered];
+					ExecClearTuple(slot);
+					ResetPerTupleExprContext(estate);
+
+					oldcontext = MemoryContextSwitchTo(batchcontext);
+					read_data_row(&state, tupdesc, &msg, values, isnull);
+					MemoryContextSwitchTo(oldcontext);
+
+					memset(slot->tts_isnull, true, sizeof(bool) * reldesc->natts);
+					for (i = 0; i < natts; ++i)
+					{
+						slot->tts_values[attmap[i]] = values[i];
+						slot->tts_isnull[attmap[i]] = isnull[i];
+					}
+					ExecStoreVirtualTuple(slot);
+
+					if (reldesc->constr != NULL)
+					{
+						if (reldesc->constr->has_generated_stored)
+							ExecComputeStoredGenerated_compat(resultRelInfo,
+															  estate, slot);
+						ExecConstraints(resultRelInfo, slot, estate);
+					}
+
+					++processed;
+					if (++nbuffered == PG_BACKGROUND_MULTI_INSERT_TUPLES)
+					{
+						flush_result_batch(resultRelInfo, estate, slots,
+										   nbuffered, mycid, ti_options,
+										   bistate);
+						MemoryContextReset(batchcontext);
+						nbuffered = 0;
+					}
+					break;
+				}
+			case 'C':
+				{
+					/* Command tags aren't interesting here. */
+					break;
+				}
+			default:
+				break;
+		}
+	}
+
+	/* Check whether the connection was broken prematurely. */
+	if (!state.complete)
+		ereport(ERROR,
+				(errcode(ERRCODE_CONNECTION_FAILURE),
+				 errmsg("lost connection to worker process with PID %d",
+						pid)));
+
+	if (!state.has_row_description)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("remote query did not return a result set")));
+
+	/* Write out whatever is left in the last batch. */
+	if (nbuffered > 0)
+		flush_result_batch(resultRelInfo, estate, slots, nbuffered, mycid,
+						   ti_options, bistate);
+
+	/* Clean up. */
+	FreeBulkInsertState(bistate);
+	table_finish_bulk_insert(rel, ti_options);
+	for (i = 0; i < PG_BACKGROUND_MULTI_INSERT_TUPLES && slots[i] != NULL; ++i)
+		ExecDropSingleTupleTableSlot(slots[i]);
+#if PG_VERSION_NUM >= 140000
+	ExecCloseResultRelations(estate);
+	ExecCloseRangeTableRelations(estate);
 #else
-		RawStmt    *parsetree = (RawStmt *) lfirst(lc1);
+	ExecCloseIndices(resultRelInfo);
 #endif
-#if PG_VERSION_NUM >= 130000
-		CommandTag	commandTag;
+	FreeExecutorState(estate);
+	MemoryContextDelete(batchcontext);
+	table_close(rel, NoLock);
+
+	/* We're done! */
+	dsm_detach(info->seg);
+
+	PG_RETURN_INT64(processed);
+#endif
+}
+
+#if PG_VERSION_NUM >= 120000
+/*
+ * Set up estate with a range table holding just rel, opened for INSERT, and
+ * return the ResultRelInfo for it.
+ */
+static ResultRelInfo *
+init_result_relation(EState *estate, Relation rel)
+{
+	return init_result_relations(estate, &rel, 1)[0];
+}
+
+/*
+ * Likewise for several relations at once, returning their ResultRelInfos in
+ * the same order.
+ */
+static ResultRelInfo **
+init_result_relations(EState *estate, Relation *rels, int nrels)
+{
+	List	   *rtable = NIL;
+	List	   *perminfos = NIL;
+	ResultRelInfo **resultRelInfos;
+	int			i;
+
+	for (i = 0; i < nrels; ++i)
+	{
+		RangeTblEntry *rte = makeNode(RangeTblEntry);
+
+		rte->rtekind = RTE_RELATION;
+		rte->relid = RelationGetRelid(rels[i]);
+		rte->relkind = rels[i]->rd_rel->relkind;
+		rte->rellockmode = RowExclusiveLock;
+#if PG_VERSION_NUM >= 160000
+		addRTEPermissionInfo(&perminfos, rte)->requiredPerms = ACL_INSERT;
 #else
-		const char *commandTag;
+		rte->requiredPerms = ACL_INSERT;
 #endif
-#if PG_VERSION_NUM < 130000
-		char		completionTag[COMPLETION_TAG_BUFSIZE];
+		rtable = lappend(rtable, rte);
+	}
+
+	ExecInitRangeTable_compat(estate, rtable, perminfos);
+	resultRelInfos = palloc(sizeof(ResultRelInfo *) * nrels);
+#if PG_VERSION_NUM >= 140000
+	for (i = 0; i < nrels; ++i)
+	{
+		resultRelInfos[i] = makeNode(ResultRelInfo);
+		ExecInitResultRelation(estate, resultRelInfos[i], i + 1);
+	}
 #else
-		QueryCompletion qc;
+	estate->es_result_relations = palloc0(sizeof(ResultRelInfo) * nrels);
+	for (i = 0; i < nrels; ++i)
+	{
+		resultRelInfos[i] = &estate->es_result_relations[i];
+		InitResultRelInfo(resultRelInfos[i], rels[i], i + 1, NULL, 0);
+	}
+	estate->es_num_result_relations = nrels;
+	estate->es_result_relation_info = resultRelInfos[0];
 #endif
-		List	   *querytree_list,
-				   *plantree_list;
-		bool		snapshot_set = false;
-		Portal		portal;
-		DestReceiver *receiver;
-		int16		format = 1;
 
-		/*
-		 * We don't allow transaction-control commands like COMMIT and ABORT
-		 * here.  The entire SQL statement is executed as a single transaction
-		 * which commits if no errors are encountered.
-		 */
-		if (IsA(parsetree, TransactionStmt))
-			ereport(ERROR,
-					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-					 errmsg("transaction control statements are not allowed in pg_background")));
+	return resultRelInfos;
+}
 
-		/*
-		 * Get the command name for use in status display (it also becomes the
-		 * default completion tag, down inside PortalRun).  Set ps_status and
-		 * do any special start-of-SQL-command processing needed by the
-		 * destination.
-		 */
-		commandTag = CreateCommandTag_compat(parsetree);
-		set_ps_display_compat(GetCommandTagName(commandTag));
+/*
+ * Write a batch of rows collected by pg_background_result_into or
+ * pg_background_insert_inbound, make index entries for them and queue their
+ * AFTER ROW triggers, if any.
+ */
+static void
+flush_result_batch(ResultRelInfo *resultRelInfo, EState *estate,
+				   TupleTableSlot **slots, int nslots, CommandId mycid,
+				   int ti_options, BulkInsertState bistate)
+{
+	TriggerDesc *trigdesc = resultRelInfo->ri_TrigDesc;
+	int			i;
 
-		BeginCommand(commandTag, DestNone);
+	table_multi_insert(resultRelInfo->ri_RelationDesc, slots, nslots, mycid,
+					   ti_options, bistate);
 
-		/* Set up a snapshot if parse analysis/planning will need one. */
-		if (analyze_requires_snapshot(parsetree))
+	for (i = 0; i < nslots; ++i)
+	{
+		List	   *recheckIndexes = NIL;
+
+		if (resultRelInfo->ri_NumIndices > 0)
 		{
-			PushActiveSnapshot(GetTransactionSnapshot());
-			snapshot_set = true;
+			ResetPerTupleExprContext(estate);
+			recheckIndexes = ExecInsertIndexTuples_compat(resultRelInfo,
+														  slots[i], estate);
 		}
+		if (trigdesc != NULL && trigdesc->trig_insert_after_row)
+			ExecARInsertTriggers(estate, resultRelInfo, slots[i],
+								 recheckIndexes, NULL);
+		list_free(recheckIndexes);
+		ExecClearTuple(slots[i]);
+	}
+}
+#endif
 
-		/*
-		 * OK to analyze, rewrite, and plan this query.
-		 *
-		 * As with parsing, we need to make sure this data outlives the
-		 * transaction, because of the possibility that the statement might
-		 * perform internal transaction control.
-		 */
-		oldcontext = MemoryContextSwitchTo(parsecontext);
-		querytree_list = pg_analyze_and_rewrite_compat(parsetree, sql, NULL, 0,
-													   NULL);
+/*
+ * Relay the results of a background query straight to our own client.
+ *
+ * RowDescription, DataRow and CommandComplete messages are forwarded exactly
+ * as the worker produced them, just like NotifyResponse messages always are,
+ * so the client sees the worker's result set without it ever being decoded
+ * and re-encoded here.  This is a procedure, so that CALL doesn't send a
+ * result set of its own around the relayed one; it is only useful as the
+ * sole statement of a simple Query message sent by the client.
+ */
+Datum
+pg_background_stream(PG_FUNCTION_ARGS)
+{
+	int32		pid;
+	pg_background_worker_info *info;
+	bool		complete = false;
+	StringInfoData msg;
 
-		plantree_list = pg_plan_queries(querytree_list,
-#if PG_VERSION_NUM >= 130000
-										sql,
+	/* Procedures can't be declared STRICT. */
+	if (PG_ARGISNULL(0))
+		ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("PID must not be null")));
+	pid = PG_GETARG_INT32(0);
+
+#if PG_VERSION_NUM >= 110000
+	if (fcinfo->context == NULL || !IsA(fcinfo->context, CallContext))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("pg_background_stream must be invoked with CALL")));
 #endif
-										0, NULL);
+	if (whereToSendOutput != DestRemote)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("pg_background_stream can only relay results to a client connection")));
 
-		/* Done with the snapshot used for parsing/planning */
-		if (snapshot_set)
-			PopActiveSnapshot();
+	/*
+	 * Under the extended query protocol, the client learns the shape of the
+	 * result from Describe, which has already answered NoData for the CALL,
+	 * and Execute may only be answered by DataRows and a single
+	 * CommandComplete.  A relayed RowDescription has no place in that flow,
+	 * so we only work for simple Query messages, whose portals (unlike those
+	 * made by Bind) have no cached plan behind them.
+	 */
+	if (ActivePortal != NULL && ActivePortal->cplan != NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("pg_background_stream cannot be used with the extended query protocol"),
+				 errhint("Send the CALL as a simple query, or use pg_background_result instead.")));
 
-		/* If we got a cancel signal in analysis or planning, quit */
-		CHECK_FOR_INTERRUPTS();
+	/* Claim the worker's results; they'll be cleaned up at end of query. */
+	info = claim_worker_info(pid);
 
-		/*
-		 * Execute the query using the unnamed portal.
-		 */
-		portal = CreatePortal("", true, true);
-		/* Don't display the portal in pg_cursors */
-		portal->visible = false;
-		PortalDefineQuery(portal, NULL, sql, commandTag, plantree_list, NULL);
-		PortalStart(portal, NULL, 0, InvalidSnapshot);
-		PortalSetResultFormat(portal, 1, &format);	/* binary format */
+	/* Initialize message buffer. */
+	initStringInfo(&msg);
 
-		/*
-		 * Tuples returned by any command other than the last are simply
-		 * discarded; but those returned by the last (or only) command are
-		 * redirected to the shared memory queue we're using for communication
-		 * with the launching backend. If the launching backend is gone or has
-		 * detached us, these messages will just get dropped on the floor.
-		 */
-		--commands_remaining;
-		if (commands_remaining > 0)
-			receiver = CreateDestReceiver(DestNone);
-		else
+	/* Read and processes messages from the worker. */
+	while (receive_worker_message(info, &msg))
+	{
+		/* Dispatch on message type. */
+		switch (dispatch_worker_message(&msg, pid, &complete))
 		{
-			receiver = CreateDestReceiver(DestRemote);
-			SetRemoteDestReceiverParams(receiver, portal);
+			case 'T':
+			case 'D':
+			case 'C':
+				{
+					/* Pass the message through untouched. */
+					pq_putmessage(msg.data[0], &msg.data[1], msg.len - 1);
+					break;
+				}
+			default:
+				break;
 		}
+	}
 
-		/*
-		 * Only once the portal and destreceiver have been established can we
-		 * return to the transaction context.  All that stuff needs to survive
-		 * an internal commit inside PortalRun!
-		 */
-		MemoryContextSwitchTo(oldcontext);
+	/* Check whether the connection was broken prematurely. */
+	if (!complete)
+		ereport(ERROR,
+				(errcode(ERRCODE_CONNECTION_FAILURE),
+				 errmsg("lost connection to worker process with PID %d",
+						pid)));
 
-		/* Here's where we actually execute the command. */
-#if PG_VERSION_NUM < 100000
-		(void) PortalRun(portal, FETCH_ALL, isTopLevel, receiver, receiver,
-						 completionTag);
-#elif PG_VERSION_NUM < 130000
-		(void) PortalRun(portal, FETCH_ALL, isTopLevel, true, receiver,
-						 receiver, completionTag);
-#else
-		(void) PortalRun(portal, FETCH_ALL, isTopLevel, true, receiver,
-						 receiver, &qc);
-#endif
+	/* We're done! */
+	dsm_detach(info->seg);
 
-		/* Clean up the receiver. */
-		(*receiver->rDestroy) (receiver);
+	PG_RETURN_VOID();
+}
 
-		/*
-		 * Send a CommandComplete message even if we suppressed the query
-		 * results.  The user backend will report these in the absence of any
-		 * true query results.
-		 */
-#if PG_VERSION_NUM < 130000
-		EndCommand(completionTag, DestRemote);
-#else
-		EndCommand(&qc, DestRemote, false);
-#endif
+/*
+ * Detach from the dynamic shared memory segment used for communication with
+ * a background worker.  This prevents the worker from stalling waiting for
+ * us to read its results.
+ */
+Datum
+pg_background_detach(PG_FUNCTION_ARGS)
+{
+	int32		pid = PG_GETARG_INT32(0);
 
-		/* Clean up the portal. */
-		PortalDrop(portal, false);
-	}
+	detach_worker(pid);
 
-	/* Be sure to advance the command counter after the last script command */
-	CommandCounterIncrement();
+	PG_RETURN_VOID();
 }
 
 /*
- * When we receive a SIGTERM, we set InterruptPending and ProcDiePending just
- * like a normal backend.  The next CHECK_FOR_INTERRUPTS() will do the right
- * thing.
+ * Common code for pg_background_detach and the C API.
  */
 static void
-handle_sigterm(SIGNAL_ARGS)
+detach_worker(int32 pid)
 {
-	int			save_errno = errno;
-
-	if (MyProc)
-		SetLatch(&MyProc->procLatch);
+	pg_background_worker_info *info;
 
-	if (!proc_exit_inprogress)
-	{
-		InterruptPending = true;
+	info = find_worker_info(pid);
+	if (info == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("PID %d is not attached to this session", pid)));
+
+	/* Let the worker know it hasn't been orphaned. */
+	info->fdata->detached = true;
+	pg_write_barrier();
+	dsm_detach(info->seg);
+}
+
+/*
+ * Ask a worker to cancel what it's doing.
+ *
+ * The request is left in the worker's fixed data, and the worker is sent
+ * SIGINT, so it acts on the request at its next CHECK_FOR_INTERRUPTS, whether
+ * it is busy computing or blocked on a result queue nobody is reading.  Its
+ * cancellation error then reaches us through the control queue.  A request
+ * that arrives once the command has committed is ignored.  Returns false if
+ * the worker has already exited.
+ */
+Datum
+pg_background_cancel(PG_FUNCTION_ARGS)
+{
+	int32		pid = PG_GETARG_INT32(0);
+
+	PG_RETURN_BOOL(cancel_worker(pid));
+}
+
+/*
+ * Common code for pg_background_cancel and the C API.
+ */
+static bool
+cancel_worker(int32 pid)
+{
+	pg_background_worker_info *info;
+	pid_t		running_pid;
+
+	info = find_worker_info(pid);
+	if (info == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("PID %d is not attached to this session", pid)));
+	check_rights(info);
+
+	if (info->handle == NULL ||
+		GetBackgroundWorkerPid(info->handle, &running_pid) != BGWH_STARTED)
+		return false;
+
+	/*
+	 * A flag can't be lost the way a message in a full queue could, and
+	 * asking more than once does no harm.  The worker checks the flag when
+	 * it starts its command, in case the signal arrives before that.
+	 */
+	info->fdata->cancel_requested = true;
+	pg_memory_barrier();
+	if (kill(running_pid, SIGINT) != 0)
+	{
+		if (errno == ESRCH)
+			return false;
+		ereport(WARNING,
+				(errmsg("could not send signal to process %d: %m",
+						(int) running_pid)));
+	}
+
+	return true;
+}
+
+/*
+ * Wait until one of the given workers, all attached to this session, has
+ * a result that can be read without waiting for the others: it has exited,
+ * failed, or filled its response queue.  Returns its PID.
+ *
+ * Callers keeping several workers busy collect whichever is ready first,
+ * rather than wait for the oldest while the rest sit idle.
+ */
+Datum
+pg_background_wait_any(PG_FUNCTION_ARGS)
+{
+	ArrayType  *pids = PG_GETARG_ARRAYTYPE_P(0);
+	Datum	   *elems;
+	bool	   *nulls;
+	int			npids;
+	int			i;
+
+	deconstruct_array(pids, INT4OID, sizeof(int32), true, 'i',
+					  &elems, &nulls, &npids);
+	if (npids == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("no background workers to wait for")));
+
+	for (;;)
+	{
+		int			rc;
+
+		for (i = 0; i < npids; ++i)
+		{
+			int32		pid;
+			pg_background_worker_info *info;
+
+			if (nulls[i])
+				ereport(ERROR,
+						(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+						 errmsg("PID must not be null")));
+			pid = DatumGetInt32(elems[i]);
+			info = find_worker_info(pid);
+			if (info == NULL)
+				ereport(ERROR,
+						(errcode(ERRCODE_UNDEFINED_OBJECT),
+						 errmsg("PID %d is not attached to this session", pid)));
+			check_rights(info);
+
+			if (worker_ready(info))
+				PG_RETURN_INT32(pid);
+		}
+
+		/*
+		 * Workers set our latch when they exit, report an error or statistics,
+		 * or start waiting for room.
+		 */
+		rc = WaitLatch_compat(MyLatch, WL_LATCH_SET | PG_BACKGROUND_WL_POSTMASTER,
+							  0, PG_WAIT_IPC);
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+	}
+}
+
+/*
+ * Can we read this worker's result without waiting for it to finish?  We
+ * take in its control messages along the way, so that it doesn't get stuck
+ * on a full control queue while we wait.
+ */
+static bool
+worker_ready(pg_background_worker_info * info)
+{
+	pid_t		running_pid;
+	BgwHandleStatus status;
+
+	if (info->consumed || info->handle == NULL)
+		return true;
+	if (info->control_in != NULL)
+		process_control_messages(info);
+	if (info->pending_error != NULL)
+		return true;
+
+	status = GetBackgroundWorkerPid(info->handle, &running_pid);
+	if (status != BGWH_STARTED && status != BGWH_NOT_YET_STARTED)
+		return true;
+
+	pg_read_barrier();
+	return info->fdata->waiting_for_room;
+}
+
+/*
+ * Time pg_background's hot paths on this particular server: launching an
+ * empty worker, serializing GUC state for it, pushing rows of the given width
+ * through each transport, and decoding DataRow messages into tuples.
+ */
+Datum
+pg_background_selfbench(PG_FUNCTION_ARGS)
+{
+	int32		iterations = PG_GETARG_INT32(0);
+	int32		row_width = PG_GETARG_INT32(1);
+	int32		rows = PG_GETARG_INT32(2);
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext oldcontext;
+	MemoryContext bench_context;
+	instr_time	start;
+	instr_time	duration;
+	text	   *sql;
+	Size		guc_len = 0;
+	int			transport;
+	int32		i;
+
+	if (iterations <= 0 || row_width < 0 || rows < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("iterations must be positive, and row_width and rows must not be negative")));
+
+	tupstore = begin_materialized_result(fcinfo, &tupdesc);
+
+	bench_context = AllocSetContextCreate(CurrentMemoryContext,
+										  "pg_background selfbench",
+										  ALLOCSET_DEFAULT_MINSIZE,
+										  ALLOCSET_DEFAULT_INITSIZE,
+										  ALLOCSET_DEFAULT_MAXSIZE);
+
+	/* Launch a worker with nothing to do and wait for it to finish. */
+	sql = cstring_to_text("");
+	INSTR_TIME_SET_CURRENT(start);
+	for (i = 0; i < iterations; ++i)
+		(void) drain_worker(launch_worker(sql, 65536, pg_background_transport,
+										  NULL, NULL, 0), NULL);
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+	add_selfbench_metric(tupstore, tupdesc, "launch_latency",
+						 INSTR_TIME_GET_MILLISEC(duration) / iterations, "ms");
+
+	/* Serialize our GUC state, as every launch does. */
+	INSTR_TIME_SET_CURRENT(start);
+	for (i = 0; i < iterations; ++i)
+	{
+		char	   *gucstate;
+
+		oldcontext = MemoryContextSwitchTo(bench_context);
+		guc_len = EstimateGUCStateSpace();
+		gucstate = palloc(guc_len);
+		SerializeGUCState(guc_len, gucstate);
+		MemoryContextSwitchTo(oldcontext);
+		MemoryContextReset(bench_context);
+	}
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+	add_selfbench_metric(tupstore, tupdesc, "guc_state_size", guc_len, "bytes");
+	add_selfbench_metric(tupstore, tupdesc, "guc_serialize",
+						 INSTR_TIME_GET_MICROSEC(duration) / iterations, "us");
+
+	/* Stream rows of the requested width through each transport. */
+	sql = cstring_to_text(psprintf("SELECT repeat('x', %d) FROM generate_series(1, %d)",
+								   row_width, rows));
+	for (transport = PG_BACKGROUND_TRANSPORT_SHM_MQ;
+		 transport <= PG_BACKGROUND_TRANSPORT_RING; ++transport)
+	{
+		const char *name = transport_options[transport].name;
+		int64		nrows = 0;
+		int64		nbytes = 0;
+		double		secs;
+
+		INSTR_TIME_SET_CURRENT(start);
+		for (i = 0; i < iterations; ++i)
+			nrows += drain_worker(launch_worker(sql, 65536, transport,
+												NULL, NULL, 0), &nbytes);
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, start);
+		secs = INSTR_TIME_GET_DOUBLE(duration);
+
+		add_selfbench_metric(tupstore, tupdesc,
+							 psprintf("queue_rows_%s", name),
+							 secs > 0 ? nrows / secs : 0, "rows/s");
+		add_selfbench_metric(tupstore, tupdesc,
+							 psprintf("queue_bandwidth_%s", name),
+							 secs > 0 ? nbytes / secs / (1024.0 * 1024.0) : 0,
+							 "MB/s");
+	}
+
+	/* Decode DataRow messages like the rows above into tuples. */
+	{
+		pg_background_result_state state;
+		TupleDesc	rowdesc;
+		StringInfoData msg;
+		char	   *payload;
+		int16		format = pg_background_result_format;
+		int64		ndecoded = (int64) iterations * rows;
+		int64		n;
+
+		rowdesc = CreateTemplateTupleDesc_compat(1);
+		TupleDescInitEntry(rowdesc, 1, "repeat", TEXTOID, -1, 0);
+
+		memset(&state, 0, sizeof(state));
+		state.formats = &format;
+		state.has_row_description = true;
+		setup_receive_functions(&state, rowdesc);
+
+		/* Text and binary formats of text look the same on the wire. */
+		payload = palloc(row_width);
+		memset(payload, 'x', row_width);
+		initStringInfo(&msg);
+		pq_sendint(&msg, 1, 2);
+		pq_sendint(&msg, row_width, 4);
+		pq_sendbytes(&msg, payload, row_width);
+
+		INSTR_TIME_SET_CURRENT(start);
+		oldcontext = MemoryContextSwitchTo(bench_context);
+		for (n = 0; n < ndecoded; ++n)
+		{
+			msg.cursor = 0;
+			(void) form_result_tuple(&state, rowdesc, &msg);
+			if (n % 1024 == 1023)
+				MemoryContextReset(bench_context);
+		}
+		MemoryContextSwitchTo(oldcontext);
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, start);
+
+		add_selfbench_metric(tupstore, tupdesc, "decode_rows",
+							 INSTR_TIME_GET_DOUBLE(duration) > 0 ?
+							 ndecoded / INSTR_TIME_GET_DOUBLE(duration) : 0,
+							 "rows/s");
+	}
+
+	MemoryContextDelete(bench_context);
+
+	return (Datum) 0;
+}
+
+/*
+ * Read a worker's whole result, throwing the rows away, and wait for it to
+ * finish.  Returns the number of rows, and adds the number of bytes they took
+ * up to *nbytes if that's given.
+ */
+static int64
+drain_worker(int32 pid, int64 *nbytes)
+{
+	pg_background_worker_info *info = claim_worker_info(pid);
+	StringInfoData msg;
+	int64		nrows = 0;
+	bool		complete = false;
+
+	initStringInfo(&msg);
+	while (receive_worker_message(info, &msg))
+	{
+		if (dispatch_worker_message(&msg, pid, &complete) == 'D')
+		{
+			nrows++;
+			if (nbytes != NULL)
+				*nbytes += msg.len;
+		}
+	}
+	pfree(msg.data);
+
+	if (!complete)
+		ereport(ERROR,
+				(errcode(ERRCODE_CONNECTION_FAILURE),
+				 errmsg("lost connection to worker process with PID %d",
+						pid)));
+
+	dsm_detach(info->seg);
+
+	return nrows;
+}
+
+/*
+ * Send a message to a worker's inbound queue, waiting for room if need be.
+ * If the worker has gone away, report the error that made it do so.
+ *
+ * While we wait, the worker may itself be waiting for us to read its control
+ * or response queue, for instance because a trigger raised lots of notices,
+ * so we never block in shm_mq_send but keep reading both.
+ */
+static void
+send_inbound_message(int32 pid, StringInfo msg)
+{
+	pg_background_worker_info *info = find_worker_info(pid);
+
+	Assert(info != NULL && info->inbound != NULL);
+
+	for (;;)
+	{
+		shm_mq_result res;
+		int			rc;
+
+		res = shm_mq_send_compat(info->inbound, msg->len, msg->data, true);
+		if (res == SHM_MQ_SUCCESS)
+			return;
+		if (res != SHM_MQ_WOULD_BLOCK)
+			break;
+
+		rc = WaitLatch_compat(MyLatch, WL_LATCH_SET | PG_BACKGROUND_WL_POSTMASTER,
+							  0, PG_WAIT_IPC);
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+		process_control_messages(info);
+		relay_available_output(info);
+	}
+
+	(void) drain_worker(pid, NULL);
+	ereport(ERROR,
+			(errcode(ERRCODE_CONNECTION_FAILURE),
+			 errmsg("lost connection to worker process with PID %d",
+					pid)));
+}
+
+/*
+ * Read whatever a worker we're feeding rows has sent us so far, without
+ * waiting for more, passing on its notices.  Its command is an INSERT that
+ * can't finish before we've sent all its rows, so it has nothing else to say
+ * that we need to keep; an error comes through the control queue.
+ */
+static void
+relay_available_output(pg_background_worker_info * info)
+{
+	StringInfoData msg;
+
+	initStringInfo(&msg);
+	for (;;)
+	{
+		if (info->ring != NULL)
+		{
+			/* A message that has begun to arrive is sure to be completed. */
+			if (pg_atomic_read_u64(&info->ring->sender.end.pos) ==
+				pg_atomic_read_u64(&info->ring->receiver.end.pos) ||
+				!ring_receive_message(info, &msg))
+				break;
+		}
+		else
+		{
+			shm_mq_result res;
+			Size		nbytes;
+			void	   *data;
+
+			res = shm_mq_receive(info->responseq, &nbytes, &data, true);
+			if (res != SHM_MQ_SUCCESS)
+				break;
+			pg_atomic_write_u64(&info->fdata->queue_read,
+								pg_atomic_read_u64(&info->fdata->queue_read) +
+								PG_BACKGROUND_MQ_FOOTPRINT(nbytes));
+			copy_worker_message(&msg, data, nbytes);
+		}
+
+		if (pq_getmsgbyte(&msg) == 'N')
+			rethrow_worker_message(&msg, info->pid);
+	}
+	pfree(msg.data);
+}
+
+/*
+ * C API: start a worker, just like pg_background_launch.
+ */
+static PgBackgroundTask *
+api_launch(const char *sql, int32 queue_size)
+{
+	PgBackgroundTask *task = palloc(sizeof(PgBackgroundTask));
+
+	task->pid = launch_worker(cstring_to_text(sql), queue_size,
+							  pg_background_transport, NULL, NULL, 0);
+
+	return task;
+}
+
+/*
+ * C API: return a task's worker PID.
+ */
+static int32
+api_pid(PgBackgroundTask *task)
+{
+	return task->pid;
+}
+
+/*
+ * C API: read a task's result, decoding each row into Datums as tupdesc
+ * describes and handing it to the caller's callback.  Returns the number
+ * of rows.
+ */
+static int64
+api_fetch(PgBackgroundTask *task, TupleDesc tupdesc,
+		  const PgBackgroundCallbacks *callbacks, void *arg)
+{
+	pg_background_worker_info *info = claim_worker_info(task->pid);
+	pg_background_result_state state;
+	MemoryContext rowcontext;
+	MemoryContext oldcontext;
+	Datum	   *values = NULL;
+	bool	   *isnull = NULL;
+	StringInfoData msg;
+	int64		nrows = 0;
+
+	if (tupdesc != NULL)
+	{
+		values = palloc(sizeof(Datum) * Max(tupdesc->natts, 1));
+		isnull = palloc(sizeof(bool) * Max(tupdesc->natts, 1));
+	}
+
+	/* Each row is decoded here, and gone once the callback is done with it. */
+	rowcontext = AllocSetContextCreate(CurrentMemoryContext,
+									   "pg_background fetch",
+									   ALLOCSET_DEFAULT_MINSIZE,
+									   ALLOCSET_DEFAULT_INITSIZE,
+									   ALLOCSET_DEFAULT_MAXSIZE);
+
+	memset(&state, 0, sizeof(state));
+	state.info = info;
+
+	initStringInfo(&msg);
+	while (receive_worker_message(info, &msg))
+	{
+		switch (dispatch_worker_message(&msg, task->pid, &state.complete))
+		{
+			case 'T':
+				if (tupdesc != NULL)
+					check_row_description(&state, tupdesc, &msg);
+				break;
+			case 'D':
+				nrows++;
+				if (tupdesc == NULL)
+					break;
+				MemoryContextReset(rowcontext);
+				oldcontext = MemoryContextSwitchTo(rowcontext);
+				read_data_row(&state, tupdesc, &msg, values, isnull);
+				MemoryContextSwitchTo(oldcontext);
+				if (callbacks != NULL && callbacks->row != NULL)
+					callbacks->row(arg, values, isnull);
+				break;
+			case 'C':
+				if (callbacks != NULL && callbacks->command_complete != NULL)
+					callbacks->command_complete(arg, pq_getmsgstring(&msg));
+				break;
+			default:
+				break;
+		}
+	}
+	pfree(msg.data);
+	MemoryContextDelete(rowcontext);
+
+	if (!state.complete)
+		ereport(ERROR,
+				(errcode(ERRCODE_CONNECTION_FAILURE),
+				 errmsg("lost connection to worker process with PID %d",
+						task->pid)));
+
+	dsm_detach(info->seg);
+
+	return nrows;
+}
+
+/*
+ * C API: wait for a task to finish, throwing away its result.
+ */
+static int64
+api_wait(PgBackgroundTask *task)
+{
+	return drain_worker(task->pid, NULL);
+}
+
+/*
+ * C API: ask a task to cancel its command.
+ */
+static bool
+api_cancel(PgBackgroundTask *task)
+{
+	return cancel_worker(task->pid);
+}
+
+/*
+ * C API: let a task run on without us.
+ */
+static void
+api_detach(PgBackgroundTask *task)
+{
+	detach_worker(task->pid);
+}
+
+/*
+ * Set up a set-returning function to return its whole result at once in a
+ * tuplestore, which is returned along with the result's tuple descriptor.
+ */
+static Tuplestorestate *
+begin_materialized_result(FunctionCallInfo fcinfo, TupleDesc *tupdesc)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Tuplestorestate *tupstore;
+	MemoryContext oldcontext;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		(rsinfo->allowedModes & SFRM_Materialize) == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (get_call_result_type(fcinfo, NULL, tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = *tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	return tupstore;
+}
+
+/*
+ * Add a row to pg_background_selfbench's result.
+ */
+static void
+add_selfbench_metric(Tuplestorestate *tupstore, TupleDesc tupdesc,
+					 const char *metric, double value, const char *unit)
+{
+	Datum		values[3];
+	bool		nulls[3] = {false, false, false};
+
+	values[0] = CStringGetTextDatum(metric);
+	values[1] = Float8GetDatum(value);
+	values[2] = CStringGetTextDatum(unit);
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+}
+
+/*
+ * Report how long statements run by this session's workers spent in each
+ * phase of execution, summed by statement, in milliseconds, how much
+ * they wrote to temporary files, the most memory any of them needed, and how
+ * full their response queues were.
+ */
+Datum
+pg_background_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	HASH_SEQ_STATUS status;
+	pg_background_stats_entry *entry;
+
+	tupstore = begin_materialized_result(fcinfo, &tupdesc);
+
+	if (pg_background_stats_hash == NULL)
+		return (Datum) 0;
+
+	hash_seq_init(&status, pg_background_stats_hash);
+	while ((entry = hash_seq_search(&status)) != NULL)
+	{
+		Datum		values[8 + PG_BACKGROUND_NPHASES];
+		bool		nulls[8 + PG_BACKGROUND_NPHASES];
+		Datum		fill[PG_BACKGROUND_QUEUE_BUCKETS];
+		int			i;
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = Int64GetDatum((int64) entry->queryid);
+		values[1] = CStringGetTextDatum(entry->command);
+		values[2] = CStringGetTextDatum(entry->query);
+		values[3] = Int64GetDatum(entry->calls);
+		for (i = 0; i < PG_BACKGROUND_NPHASES; ++i)
+			values[4 + i] = Float8GetDatum(entry->usecs[i] / 1000.0);
+		values[4 + PG_BACKGROUND_NPHASES] = Int64GetDatum(entry->temp_bytes);
+		values[5 + PG_BACKGROUND_NPHASES] = Int64GetDatum(entry->peak_memory);
+		for (i = 0; i < PG_BACKGROUND_QUEUE_BUCKETS; ++i)
+			fill[i] = Int64GetDatum(entry->queue_samples[i]);
+		values[6 + PG_BACKGROUND_NPHASES] =
+			PointerGetDatum(construct_array(fill, PG_BACKGROUND_QUEUE_BUCKETS,
+											INT8OID, sizeof(int64),
+											FLOAT8PASSBYVAL, 'd'));
+		values[7 + PG_BACKGROUND_NPHASES] =
+			Int64GetDatum(entry->queue_samples[PG_BACKGROUND_QUEUE_BLOCKED]);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * Forget the statistics collected so far in this session.
+ */
+Datum
+pg_background_stats_reset(PG_FUNCTION_ARGS)
+{
+	if (pg_background_stats_hash != NULL)
+	{
+		hash_destroy(pg_background_stats_hash);
+		pg_background_stats_hash = NULL;
+	}
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * List the live workers of this backend's launch tree: every worker launched
+ * by the session at its root, directly or from inside another worker, along
+ * with the PID of the backend that launched it and its depth in the tree.
+ */
+Datum
+pg_background_tree(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	pg_background_tree_member *members;
+	int			nmembers = 0;
+	int			i;
+
+	tupstore = begin_materialized_result(fcinfo, &tupdesc);
+
+	if (task_tree == NULL)
+		return (Datum) 0;
+
+	/* Copy the entries out, so as not to hold the spinlock for long. */
+	members = palloc(task_tree->nmembers * sizeof(pg_background_tree_member));
+	SpinLockAcquire(&task_tree->mutex);
+	for (i = 0; i < task_tree->nmembers; ++i)
+	{
+		if (task_tree->members[i].in_use && task_tree->members[i].pid != 0)
+			members[nmembers++] = task_tree->members[i];
+	}
+	SpinLockRelease(&task_tree->mutex);
+
+	for (i = 0; i < nmembers; ++i)
+	{
+		Datum		values[3];
+		bool		nulls[3];
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = Int32GetDatum(members[i].pid);
+		values[1] = Int32GetDatum(members[i].parent_pid);
+		values[2] = Int32GetDatum(members[i].depth);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * Return the flight recorder of a worker: live, if the worker is still
+ * attached to this session, or as it was when the worker went away, if it
+ * failed or took longer than pg_background.trace_min_duration.
+ */
+Datum
+pg_background_trace(PG_FUNCTION_ARGS)
+{
+	int32		pid = PG_GETARG_INT32(0);
+	pg_background_worker_info *info;
+	pg_background_trace_event events[PG_BACKGROUND_TRACE_EVENTS];
+	pg_background_trace_event *source = NULL;
+	int			nevents = 0;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	ListCell   *lc;
+	int			i;
+
+	info = find_worker_info(pid);
+	if (info != NULL)
+	{
+		check_rights(info);
+		nevents = copy_trace(info->fdata, events);
+		source = events;
+	}
+	else
+	{
+		foreach(lc, kept_traces)
+		{
+			pg_background_kept_trace *kept = lfirst(lc);
+
+			if (kept->pid == pid)
+			{
+				check_user_rights(kept->user_id, pid);
+				nevents = kept->nevents;
+				source = kept->events;
+			}
+		}
+	}
+
+	if (source == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("PID %d is not attached to this session", pid),
+				 errdetail("Traces are only kept for workers that failed or took longer than pg_background.trace_min_duration.")));
+
+	tupstore = begin_materialized_result(fcinfo, &tupdesc);
+
+	for (i = 0; i < nevents; ++i)
+	{
+		Datum		values[3];
+		bool		nulls[3];
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = TimestampTzGetDatum(source[i].time);
+		values[1] = CStringGetTextDatum(source[i].event);
+		values[2] = CStringGetTextDatum(source[i].detail);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * Save the flight recorder of a worker we're letting go of, replacing any
+ * older trace for the same PID and forgetting the oldest trace if we have
+ * too many.
+ */
+static void
+keep_trace(pid_t pid, pg_background_fixed_data * fdata)
+{
+	pg_background_kept_trace *kept = NULL;
+	MemoryContext oldcontext;
+	ListCell   *lc;
+
+	foreach(lc, kept_traces)
+	{
+		if (((pg_background_kept_trace *) lfirst(lc))->pid == pid)
+		{
+			kept = lfirst(lc);
+			break;
+		}
+	}
+	if (kept != NULL)
+	{
+		kept_traces = list_delete_ptr(kept_traces, kept);
+		pfree(kept);
+	}
+	if (list_length(kept_traces) >= PG_BACKGROUND_KEPT_TRACES)
+	{
+		pfree(linitial(kept_traces));
+		kept_traces = list_delete_first(kept_traces);
+	}
+
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	kept = palloc(sizeof(pg_background_kept_trace));
+	kept->pid = pid;
+	kept->user_id = fdata->current_user_id;
+	kept->nevents = copy_trace(fdata, kept->events);
+	kept_traces = lappend(kept_traces, kept);
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Load blocks of a relation's main fork into shared buffers: within a range
+ * of blocks, either those listed in the hot blocks table, or all the others.
+ * Like autoprewarm, stop once there are no free buffers left, rather than
+ * evict what is already there.  Returns the number of blocks loaded.
+ * pg_background_prewarm runs this in several workers at once, each on its
+ * own share of every relation, first for the hot blocks, then for the rest.
+ */
+Datum
+pg_background_prewarm_blocks(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	int64		first_block = PG_GETARG_INT64(1);
+	int64		last_block = PG_GETARG_INT64(2);
+	bool		hot = PG_GETARG_BOOL(3);
+	Relation	rel;
+	AclResult	aclresult;
+	int64		nblocks;
+	int64		block;
+	int64		loaded = 0;
+	char	   *hot_blocks;
+	char	   *sql;
+	Oid			argtypes[3] = {REGCLASSOID, INT8OID, INT8OID};
+	Datum		values[3];
+	int64	   *listed;
+	uint64		nlisted;
+	uint64		i;
+
+	rel = relation_open(relid, AccessShareLock);
+
+	if (rel->rd_rel->relkind != RELKIND_RELATION &&
+		rel->rd_rel->relkind != RELKIND_MATVIEW &&
+		rel->rd_rel->relkind != RELKIND_INDEX &&
+		rel->rd_rel->relkind != RELKIND_TOASTVALUE)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("cannot prewarm \"%s\"", RelationGetRelationName(rel)),
+				 errdetail("Only tables, materialized views and indexes can be prewarmed.")));
+
+	aclresult = pg_class_aclcheck(relid, GetUserId(), ACL_SELECT);
+	if (aclresult != ACLCHECK_OK)
+		aclcheck_error_relation_compat(aclresult, rel);
+
+	nblocks = RelationGetNumberOfBlocks(rel);
+	if (first_block < 0)
+		first_block = 0;
+	if (last_block >= nblocks)
+		last_block = nblocks - 1;
+	if (last_block < first_block)
+	{
+		relation_close(rel, AccessShareLock);
+		PG_RETURN_INT64(0);
+	}
+
+	/* The hot blocks table lives in the same schema as this function. */
+	hot_blocks =
+		quote_qualified_identifier(get_namespace_name(get_func_namespace(fcinfo->flinfo->fn_oid)),
+								   "pg_background_hot_blocks");
+	sql = psprintf("SELECT block FROM %s"
+				   " WHERE relation = $1 AND block BETWEEN $2 AND $3"
+				   " ORDER BY block",
+				   hot_blocks);
+	values[0] = ObjectIdGetDatum(relid);
+	values[1] = Int64GetDatum(first_block);
+	values[2] = Int64GetDatum(last_block);
+
+	SPI_connect();
+	if (SPI_execute_with_args(sql, 3, argtypes, values, NULL, true, 0)
+		!= SPI_OK_SELECT)
+		elog(ERROR, "could not read hot blocks of \"%s\"",
+			 RelationGetRelationName(rel));
+	nlisted = SPI_processed;
+	listed = SPI_palloc(Max(nlisted, 1) * sizeof(int64));
+	for (i = 0; i < nlisted; ++i)
+	{
+		bool		isnull;
+
+		listed[i] = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],
+												SPI_tuptable->tupdesc, 1,
+												&isnull));
+	}
+	SPI_finish();
+
+	if (hot)
+	{
+		for (i = 0; i < nlisted; ++i)
+		{
+			CHECK_FOR_INTERRUPTS();
+			if (!have_free_buffer_compat())
+				break;
+			ReleaseBuffer(ReadBufferExtended(rel, MAIN_FORKNUM,
+											 (BlockNumber) listed[i],
+											 RBM_NORMAL, NULL));
+			loaded++;
+		}
+	}
+	else
+	{
+		/* The hot blocks are in order, so skip them as we go. */
+		i = 0;
+		for (block = first_block; block <= last_block; ++block)
+		{
+			if (i < nlisted && listed[i] == block)
+			{
+				i++;
+				continue;
+			}
+			CHECK_FOR_INTERRUPTS();
+			if (!have_free_buffer_compat())
+				break;
+			ReleaseBuffer(ReadBufferExtended(rel, MAIN_FORKNUM, (BlockNumber) block,
+											 RBM_NORMAL, NULL));
+			loaded++;
+		}
+	}
+
+	relation_close(rel, AccessShareLock);
+
+	PG_RETURN_INT64(loaded);
+}
+
+/*
+ * Insert the rows the launching backend sends this worker into the
+ * partitions of target they are tagged with, an index into leaves, and
+ * return the number of rows inserted.  Only useful in the SQL that
+ * pg_background_insert_partitioned runs in its workers.
+ *
+ * Rows are written as they arrive, a batch per partition at a time, with
+ * table_multi_insert as in pg_background_result_into.  Row triggers fire as
+ * they would for COPY FROM: a partition with BEFORE ROW triggers gets its
+ * rows one at a time, so that the triggers see the rows before theirs.
+ */
+Datum
+pg_background_insert_inbound(PG_FUNCTION_ARGS)
+{
+#if PG_VERSION_NUM < 120000
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("pg_background_insert_inbound requires PostgreSQL 12 or later")));
+	PG_RETURN_NULL();
+#else
+	Oid			target = PG_GETARG_OID(0);
+	ArrayType  *leaf_array = PG_GETARG_ARRAYTYPE_P(1);
+	Datum	   *leaf_datums;
+	int			nleaves;
+	Relation	rel;
+	Relation   *leaves;
+	TupleDesc	reldesc;
+	TupleDesc	tupdesc;
+	int			natts;
+	pg_background_result_state state;
+	pg_background_partition_batch *batches;
+	ResultRelInfo **resultRelInfos;
+	EState	   *estate;
+	CommandId	mycid;
+	int			ti_options = 0;
+	MemoryContext rowcontext;
+	MemoryContext oldcontext;
+	Datum	   *values;
+	bool	   *isnull;
+	int64		processed = 0;
+	StringInfoData msg;
+	int			i;
+	int			k;
+
+	if (worker_inbound == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("no rows were sent to this process"),
+				 errdetail("pg_background_insert_inbound can only be used in background workers started by pg_background_insert_partitioned, and only once.")));
+
+	/*
+	 * The rows come tagged with the partition, followed by the columns of
+	 * target other than dropped and generated ones, in order.
+	 */
+	rel = table_open(target, AccessShareLock);
+	reldesc = RelationGetDescr(rel);
+	natts = 0;
+	for (i = 0; i < reldesc->natts; ++i)
+	{
+		Form_pg_attribute attr = TupleDescAttr(reldesc, i);
+
+		if (!attr->attisdropped && !attr->attgenerated)
+			natts++;
+	}
+	tupdesc = CreateTemplateTupleDesc(natts + 1);
+	TupleDescInitEntry(tupdesc, 1, "pg_background_leaf", INT4OID, -1, 0);
+	k = 1;
+	for (i = 0; i < reldesc->natts; ++i)
+	{
+		Form_pg_attribute attr = TupleDescAttr(reldesc, i);
+
+		if (!attr->attisdropped && !attr->attgenerated)
+			TupleDescCopyEntry(tupdesc, ++k, reldesc, i + 1);
+	}
+
+	/*
+	 * Open the partitions, and find where each column goes in each, since
+	 * a partition's columns needn't be in the same order as its parent's.
+	 */
+	deconstruct_array(leaf_array, REGCLASSOID, sizeof(Oid), true,
+					  TYPALIGN_INT, &leaf_datums, NULL, &nleaves);
+	leaves = palloc(sizeof(Relation) * Max(nleaves, 1));
+	batches = palloc0(sizeof(pg_background_partition_batch) * Max(nleaves, 1));
+	for (k = 0; k < nleaves; ++k)
+	{
+		Relation	leaf;
+		TupleDesc	leafdesc;
+		AclResult	aclresult;
+
+		leaf = table_open(DatumGetObjectId(leaf_datums[k]), RowExclusiveLock);
+		leaves[k] = leaf;
+		aclresult = pg_class_aclcheck(RelationGetRelid(leaf), GetUserId(),
+									  ACL_INSERT);
+		if (aclresult != ACLCHECK_OK)
+			aclcheck_error_relation_compat(aclresult, leaf);
+		if (check_enable_rls(RelationGetRelid(leaf), InvalidOid, false) == RLS_ENABLED)
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("cannot insert background rows directly into \"%s\"",
+							RelationGetRelationName(leaf)),
+					 errdetail("The table has row-level security enabled.")));
+
+		leafdesc = RelationGetDescr(leaf);
+		batches[k].attmap = palloc(sizeof(AttrNumber) * Max(natts, 1));
+		for (i = 0; i < natts; ++i)
+		{
+			const char *attname = NameStr(TupleDescAttr(tupdesc, i + 1)->attname);
+			int			attnum = -1;
+			int			j;
+
+			for (j = 0; j < leafdesc->natts; ++j)
+			{
+				Form_pg_attribute attr = TupleDescAttr(leafdesc, j);
+
+				if (!attr->attisdropped &&
+					strcmp(NameStr(attr->attname), attname) == 0)
+				{
+					attnum = j;
+					break;
+				}
+			}
+			if (attnum < 0)
+				elog(ERROR, "column \"%s\" of \"%s\" was not found",
+					 attname, RelationGetRelationName(leaf));
+			batches[k].attmap[i] = attnum;
+		}
+	}
+	table_close(rel, AccessShareLock);
+
+	/* Set up executor state for all the partitions, as COPY FROM does. */
+	estate = CreateExecutorState();
+	resultRelInfos = init_result_relations(estate, leaves, nleaves);
+	for (k = 0; k < nleaves; ++k)
+	{
+		TriggerDesc *trigdesc;
+
+		batches[k].resultRelInfo = resultRelInfos[k];
+		ExecOpenIndices(resultRelInfos[k], false);
+		trigdesc = resultRelInfos[k]->ri_TrigDesc;
+		if (trigdesc != NULL && trigdesc->trig_insert_new_table)
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("cannot insert background rows directly into \"%s\"",
+							RelationGetRelationName(leaves[k])),
+					 errdetail("The table has triggers with transition tables.")));
+		batches[k].one_at_a_time = trigdesc != NULL &&
+			trigdesc->trig_insert_before_row;
+		batches[k].bistate = GetBulkInsertState();
+	}
+	mycid = GetCurrentCommandId(true);
+	AfterTriggerBeginQuery();
+
+	values = palloc(sizeof(Datum) * (natts + 1));
+	isnull = palloc(sizeof(bool) * (natts + 1));
+
+	/* Decoded rows live here only until they've been copied into slots. */
+	rowcontext = AllocSetContextCreate(CurrentMemoryContext,
+									   "pg_background insert_inbound",
+									   ALLOCSET_DEFAULT_MINSIZE,
+									   ALLOCSET_DEFAULT_INITSIZE,
+									   ALLOCSET_DEFAULT_MAXSIZE);
+
+	memset(&state, 0, sizeof(state));
+	initStringInfo(&msg);
+
+	/* Read messages until the launcher says there are no more rows. */
+	while (!state.complete)
+	{
+		shm_mq_result res;
+		Size		nbytes;
+		void	   *data;
+
+		res = shm_mq_receive(worker_inbound, &nbytes, &data, false);
+		if (res != SHM_MQ_SUCCESS)
+			ereport(ERROR,
+					(errcode(ERRCODE_CONNECTION_FAILURE),
+					 errmsg("lost connection to the launching process")));
+		copy_worker_message(&msg, data, nbytes);
+
+		switch (pq_getmsgbyte(&msg))
+		{
+			case 'T':
+				{
+					check_row_description(&state, tupdesc, &msg);
+					break;
+				}
+			case 'D':
+				{
+					pg_background_partition_batch *batch;
+					ResultRelInfo *resultRelInfo;
+					TupleDesc	leafdesc;
+					TupleTableSlot *slot;
+					int32		leaf;
+
+					CHECK_FOR_INTERRUPTS();
+					MemoryContextReset(rowcontext);
+					ResetPerTupleExprContext(estate);
+
+					oldcontext = MemoryContextSwitchTo(rowcontext);
+					read_data_row(&state, tupdesc, &msg, values, isnull);
+					MemoryContextSwitchTo(oldcontext);
+
+					leaf = isnull[0] ? -1 : DatumGetInt32(values[0]);
+					if (leaf < 0 || leaf >= nleaves)
+						elog(ERROR, "row for unknown partition %d", leaf);
+					batch = &batches[leaf];
+					resultRelInfo = batch->resultRelInfo;
+					leafdesc = RelationGetDescr(resultRelInfo->ri_RelationDesc);
+
+					if (batch->slots[batch->nbuffered] == NULL)
+						batch->slots[batch->nbuffered] =
+							table_slot_create(resultRelInfo->ri_RelationDesc, NULL);
+					slot = batch->slots[batch->nbuffered];
+					ExecClearTuple(slot);
+					memset(slot->tts_isnull, true, sizeof(bool) * leafdesc->natts);
+					for (i = 0; i < natts; ++i)
+					{
+						slot->tts_values[batch->attmap[i]] = values[i + 1];
+						slot->tts_isnull[batch->attmap[i]] = isnull[i + 1];
+					}
+					ExecStoreVirtualTuple(slot);
+
+					if (batch->one_at_a_time &&
+						!ExecBRInsertTriggers(estate, resultRelInfo, slot))
+						break;	/* "do nothing" */
+					if (leafdesc->constr != NULL)
+					{
+						if (leafdesc->constr->has_generated_stored)
+							ExecComputeStoredGenerated_compat(resultRelInfo,
+															  estate, slot);
+						ExecConstraints(resultRelInfo, slot, estate);
+					}
+
+					/* Keep the row once its decoded values are gone. */
+					ExecMaterializeSlot(slot);
+
+					++processed;
+					if (++batch->nbuffered == PG_BACKGROUND_MULTI_INSERT_TUPLES ||
+						batch->one_at_a_time)
+					{
+						flush_result_batch(resultRelInfo, estate, batch->slots,
+										   batch->nbuffered, mycid, ti_options,
+										   batch->bistate);
+						batch->nbuffered = 0;
+					}
+					break;
+				}
+			case 'c':
+				{
+					/* The rows can't be read twice; stop listening. */
+					shm_mq_detach_compat(worker_inbound);
+					worker_inbound = NULL;
+					state.complete = true;
+					break;
+				}
+			default:
+				elog(ERROR, "unknown inbound message type: %c (%d bytes)",
+					 msg.data[0], msg.len);
+				break;
+		}
+	}
+
+	/* Write out whatever is left, and fire the AFTER ROW triggers. */
+	for (k = 0; k < nleaves; ++k)
+	{
+		pg_background_partition_batch *batch = &batches[k];
+
+		if (batch->nbuffered > 0)
+			flush_result_batch(batch->resultRelInfo, estate, batch->slots,
+							   batch->nbuffered, mycid, ti_options,
+							   batch->bistate);
+	}
+	AfterTriggerEndQuery(estate);
+
+	/* Clean up. */
+	for (k = 0; k < nleaves; ++k)
+	{
+		pg_background_partition_batch *batch = &batches[k];
+
+		FreeBulkInsertState(batch->bistate);
+		table_finish_bulk_insert(leaves[k], ti_options);
+		for (i = 0; i < PG_BACKGROUND_MULTI_INSERT_TUPLES && batch->slots[i] != NULL; ++i)
+			ExecDropSingleTupleTableSlot(batch->slots[i]);
+#if PG_VERSION_NUM < 140000
+		ExecCloseIndices(batch->resultRelInfo);
+#endif
+	}
+	ExecResetTupleTable(estate->es_tupleTable, false);
+#if PG_VERSION_NUM >= 140000
+	ExecCloseResultRelations(estate);
+	ExecCloseRangeTableRelations(estate);
+#else
+	ExecCleanUpTriggerState(estate);
+#endif
+	FreeExecutorState(estate);
+	MemoryContextDelete(rowcontext);
+	for (k = 0; k < nleaves; ++k)
+		table_close(leaves[k], NoLock);
+
+	PG_RETURN_INT64(processed);
+#endif
+}
+
+/*
+ * Insert the result of a query into a partitioned table using several
+ * background workers, and return the number of rows inserted.
+ *
+ * The leaf partitions are shared out among up to degree workers.  We run the
+ * query, route each row to its partition ourselves and pass it, tagged with
+ * the partition, to the worker that owns that partition, which writes it
+ * straight into the partition, in batches, so the row isn't routed a second
+ * time.
+ * Since no two workers ever write to the same partition, they don't contend
+ * for relation extension locks.
+ */
+Datum
+pg_background_insert_partitioned(PG_FUNCTION_ARGS)
+{
+#if PG_VERSION_NUM < 120000
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("pg_background_insert_partitioned requires PostgreSQL 12 or later")));
+	PG_RETURN_NULL();
+#else
+	Oid			relid = PG_GETARG_OID(0);
+	char	   *source_sql = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	int32		degree = PG_GETARG_INT32(2);
+	Relation	rel;
+	TupleDesc	reldesc;
+	AttrNumber *attmap;
+	int			natts;
+	AclResult	aclresult;
+	List	   *leaves = NIL;
+	ListCell   *lc;
+	HASHCTL		ctl;
+	HTAB	   *partition_hash;
+	int			nworkers;
+	List	  **owned;
+	int32	   *pids;
+	volatile int nlaunched = 0;
+	volatile int64 processed = 0;
+	bool	   *binary;
+	FmgrInfo   *out_functions;
+	StringInfoData sql;
+	StringInfoData buf;
+	text	  **worker_sql;
+	int			i;
+
+	if (degree < 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("degree must be at least 1")));
+
+	rel = table_open(relid, RowExclusiveLock);
+
+	if (rel->rd_rel->relkind != RELKIND_PARTITIONED_TABLE)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not a partitioned table",
+						RelationGetRelationName(rel))));
+	if (rel->rd_rel->relpersistence == RELPERSISTENCE_TEMP)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("cannot insert into temporary table \"%s\" in background workers",
+						RelationGetRelationName(rel))));
+
+	aclresult = pg_class_aclcheck(relid, GetUserId(), ACL_INSERT);
+	if (aclresult != ACLCHECK_OK)
+		aclcheck_error_relation_compat(aclresult, rel);
+
+	PreventCommandIfReadOnly("pg_background_insert_partitioned()");
+
+	/*
+	 * The workers write rows straight into the partitions, as
+	 * pg_background_result_into does, so row-level security policies
+	 * wouldn't be applied.
+	 */
+	if (check_enable_rls(relid, InvalidOid, false) == RLS_ENABLED)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("cannot insert background rows directly into \"%s\"",
+						RelationGetRelationName(rel)),
+				 errdetail("The table has row-level security enabled."),
+				 errhint("Use INSERT ... SELECT instead.")));
+
+	/*
+	 * Share the leaf partitions out among the workers.  Those insert into
+	 * the partitions directly, so we had better be allowed to as well.
+	 */
+	foreach(lc, find_all_inheritors(relid, AccessShareLock, NULL))
+	{
+		Oid			partid = lfirst_oid(lc);
+
+		if (get_rel_relkind(partid) == RELKIND_PARTITIONED_TABLE)
+			continue;
+		aclresult = pg_class_aclcheck(partid, GetUserId(), ACL_INSERT);
+		if (aclresult != ACLCHECK_OK)
+			aclcheck_error(aclresult, get_relkind_objtype(get_rel_relkind(partid)),
+						   get_rel_name(partid));
+		if (check_enable_rls(partid, InvalidOid, false) == RLS_ENABLED)
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("cannot insert background rows directly into \"%s\"",
+							get_rel_name(partid)),
+					 errdetail("The table has row-level security enabled."),
+					 errhint("Use INSERT ... SELECT instead.")));
+		leaves = lappend_oid(leaves, partid);
+	}
+	if (leaves == NIL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("partitioned table \"%s\" has no partitions",
+						RelationGetRelationName(rel))));
+	nworkers = Min(degree, list_length(leaves));
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(Oid);
+	ctl.entrysize = sizeof(pg_background_partition_entry);
+	ctl.hcxt = CurrentMemoryContext;
+	partition_hash = hash_create("pg_background partition_hash",
+								 list_length(leaves), &ctl,
+								 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	owned = palloc0(sizeof(List *) * nworkers);
+	i = 0;
+	foreach(lc, leaves)
+	{
+		Oid			partid = lfirst_oid(lc);
+		pg_background_partition_entry *entry;
+
+		entry = hash_search(partition_hash, &partid, HASH_ENTER, NULL);
+		entry->worker = i++ % nworkers;
+		entry->index = list_length(owned[entry->worker]);
+		owned[entry->worker] = lappend_oid(owned[entry->worker], partid);
+	}
+
+	/*
+	 * The query must return one column for each column of the table,
+	 * skipping dropped and generated columns, just like COPY FROM.  Rows go
+	 * to the workers in binary wherever the type allows.
+	 */
+	reldesc = RelationGetDescr(rel);
+	attmap = palloc(sizeof(AttrNumber) * reldesc->natts);
+	natts = 0;
+	for (i = 0; i < reldesc->natts; ++i)
+	{
+		Form_pg_attribute attr = TupleDescAttr(reldesc, i);
+
+		if (attr->attisdropped || attr->attgenerated)
+			continue;
+		attmap[natts++] = i;
+	}
+	binary = palloc(sizeof(bool) * natts);
+	out_functions = palloc(sizeof(FmgrInfo) * natts);
+	for (i = 0; i < natts; ++i)
+	{
+		Form_pg_attribute attr = TupleDescAttr(reldesc, attmap[i]);
+		Oid			typfunc;
+		bool		isvarlena;
+
+		binary[i] = exists_binary_recv_fn(attr->atttypid);
+		if (binary[i])
+			getTypeBinaryOutputInfo(attr->atttypid, &typfunc, &isvarlena);
+		else
+			getTypeOutputInfo(attr->atttypid, &typfunc, &isvarlena);
+		fmgr_info(typfunc, &out_functions[i]);
+	}
+
+	/*
+	 * Each worker reads the rows we send it once, and inserts each into the
+	 * partition it is tagged with, an index into the list of those it owns:
+	 *
+	 * SELECT pg_background_insert_inbound('target'::regclass,
+	 * '{leaf0,leaf1}'::regclass[])
+	 */
+	initStringInfo(&sql);
+	worker_sql = palloc(sizeof(text *) * nworkers);
+	for (i = 0; i < nworkers; ++i)
+	{
+		const char *sep = "";
+
+		resetStringInfo(&sql);
+		appendStringInfo(&sql, "SELECT %s.pg_background_insert_inbound('%u'::pg_catalog.regclass, '{",
+						 quote_identifier(get_namespace_name(get_func_namespace(fcinfo->flinfo->fn_oid))),
+						 relid);
+		foreach(lc, owned[i])
+		{
+			appendStringInfo(&sql, "%s%u", sep, lfirst_oid(lc));
+			sep = ",";
+		}
+		appendStringInfoString(&sql, "}'::pg_catalog.regclass[])");
+		worker_sql[i] = cstring_to_text(sql.data);
+	}
+
+	/*
+	 * Describe the rows to the workers the way a worker describes its own,
+	 * with the partition tag in front.
+	 */
+	initStringInfo(&buf);
+	pq_sendbyte(&buf, 'T');
+	pq_sendint16(&buf, natts + 1);
+	pq_sendstring(&buf, "pg_background_leaf");
+	pq_sendint32(&buf, 0);		/* table OID */
+	pq_sendint16(&buf, 0);		/* table attnum */
+	pq_sendint32(&buf, INT4OID);
+	pq_sendint16(&buf, sizeof(int32));
+	pq_sendint32(&buf, -1);
+	pq_sendint16(&buf, PG_BACKGROUND_FORMAT_BINARY);
+	for (i = 0; i < natts; ++i)
+	{
+		Form_pg_attribute attr = TupleDescAttr(reldesc, attmap[i]);
+
+		pq_sendstring(&buf, NameStr(attr->attname));
+		pq_sendint32(&buf, 0);	/* table OID */
+		pq_sendint16(&buf, 0);	/* table attnum */
+		pq_sendint32(&buf, attr->atttypid);
+		pq_sendint16(&buf, attr->attlen);
+		pq_sendint32(&buf, attr->atttypmod);
+		pq_sendint16(&buf, binary[i] ? PG_BACKGROUND_FORMAT_BINARY :
+					 PG_BACKGROUND_FORMAT_TEXT);
+	}
+
+	pids = palloc(sizeof(int32) * nworkers);
+
+	/*
+	 * A worker whose rows we never finish sending would wait for more
+	 * forever, so if anything goes wrong, detach from all of them.
+	 */
+	PG_TRY();
+	{
+		EState	   *estate;
+		ResultRelInfo *resultRelInfo;
+		ModifyTableState *mtstate;
+		PartitionTupleRouting *proute;
+		TupleTableSlot *slot;
+		MemoryContext rowcontext;
+		MemoryContext oldcontext;
+		SPIPlanPtr	plan;
+		Portal		portal;
+		Datum	   *values;
+		bool	   *isnull;
+		bool		checked = false;
+		uint64		j;
+
+		for (i = 0; i < nworkers; ++i)
+		{
+			pids[i] = launch_worker(worker_sql[i], 65536, pg_background_transport,
+									NULL, NULL,
+									PG_BACKGROUND_INBOUND_QUEUE_SIZE);
+			nlaunched++;
+			send_inbound_message(pids[i], &buf);
+		}
+
+		/* Set up tuple routing the same way COPY FROM does. */
+		estate = CreateExecutorState();
+		resultRelInfo = init_result_relation(estate, rel);
+		mtstate = makeNode(ModifyTableState);
+		mtstate->ps.plan = NULL;
+		mtstate->ps.state = estate;
+		mtstate->operation = CMD_INSERT;
+		mtstate->resultRelInfo = resultRelInfo;
+#if PG_VERSION_NUM >= 140000
+		mtstate->mt_nrels = 1;
+		mtstate->rootResultRelInfo = resultRelInfo;
+		proute = ExecSetupPartitionTupleRouting(estate, rel);
+#else
+		proute = ExecSetupPartitionTupleRouting(estate, mtstate, rel);
+#endif
+		slot = table_slot_create(rel, NULL);
+		values = palloc(sizeof(Datum) * natts);
+		isnull = palloc(sizeof(bool) * natts);
+
+		/* Encoded rows live here only until they've been sent. */
+		rowcontext = AllocSetContextCreate(CurrentMemoryContext,
+										   "pg_background insert_partitioned",
+										   ALLOCSET_DEFAULT_MINSIZE,
+										   ALLOCSET_DEFAULT_INITSIZE,
+										   ALLOCSET_DEFAULT_MAXSIZE);
+
+		/* Run the query through a cursor, so its result needn't fit memory. */
+		SPI_connect();
+		plan = SPI_prepare(source_sql, 0, NULL);
+		if (plan == NULL)
+			elog(ERROR, "could not prepare query: %s",
+				 SPI_result_code_string(SPI_result));
+		portal = SPI_cursor_open(NULL, plan, NULL, NULL, true);
+
+		for (;;)
+		{
+			SPI_cursor_fetch(portal, true, PG_BACKGROUND_MULTI_INSERT_TUPLES);
+			if (SPI_processed == 0)
+				break;
+
+			if (!checked)
+			{
+				TupleDesc	srcdesc = SPI_tuptable->tupdesc;
+
+				if (srcdesc->natts != natts)
+					ereport(ERROR,
+							(errcode(ERRCODE_DATATYPE_MISMATCH),
+							 errmsg("query returns %d columns, but table \"%s\" has %d",
+									srcdesc->natts,
+									RelationGetRelationName(rel), natts)));
+				for (i = 0; i < natts; ++i)
+				{
+					Form_pg_attribute attr = TupleDescAttr(reldesc, attmap[i]);
+
+					if (TupleDescAttr(srcdesc, i)->atttypid != attr->atttypid)
+						ereport(ERROR,
+								(errcode(ERRCODE_DATATYPE_MISMATCH),
+								 errmsg("query column %d has type %s, but column \"%s\" has type %s",
+										i + 1,
+										format_type_be(TupleDescAttr(srcdesc, i)->atttypid),
+										NameStr(attr->attname),
+										format_type_be(attr->atttypid)),
+								 errhint("Cast the query's columns to the table's column types.")));
+				}
+				checked = true;
+			}
+
+			for (j = 0; j < SPI_processed; ++j)
+			{
+				ResultRelInfo *partRelInfo;
+				Oid			partid;
+				pg_background_partition_entry *entry;
+
+				CHECK_FOR_INTERRUPTS();
+				MemoryContextReset(rowcontext);
+				ResetPerTupleExprContext(estate);
+
+				/* Find the partition the row belongs in. */
+				heap_deform_tuple(SPI_tuptable->vals[j], SPI_tuptable->tupdesc,
+								  values, isnull);
+				ExecClearTuple(slot);
+				memset(slot->tts_isnull, true, sizeof(bool) * reldesc->natts);
+				for (i = 0; i < natts; ++i)
+				{
+					slot->tts_values[attmap[i]] = values[i];
+					slot->tts_isnull[attmap[i]] = isnull[i];
+				}
+				ExecStoreVirtualTuple(slot);
+				partRelInfo = ExecFindPartition(mtstate, resultRelInfo, proute,
+												slot, estate);
+				partid = RelationGetRelid(partRelInfo->ri_RelationDesc);
+				entry = hash_search(partition_hash, &partid, HASH_FIND, NULL);
+				if (entry == NULL)
+					elog(ERROR, "partition %u of \"%s\" was not found",
+						 partid, RelationGetRelationName(rel));
+
+				/* Send it to the worker that owns that partition. */
+				oldcontext = MemoryContextSwitchTo(rowcontext);
+				resetStringInfo(&buf);
+				pq_sendbyte(&buf, 'D');
+				pq_sendint16(&buf, natts + 1);
+				pq_sendint32(&buf, sizeof(int32));
+				pq_sendint32(&buf, entry->index);
+				for (i = 0; i < natts; ++i)
+				{
+					if (isnull[i])
+						pq_sendint32(&buf, -1);
+					else if (binary[i])
+					{
+						bytea	   *outputbytes;
+
+						outputbytes = SendFunctionCall(&out_functions[i],
+													   values[i]);
+						pq_sendint32(&buf, VARSIZE(outputbytes) - VARHDRSZ);
+						pq_sendbytes(&buf, VARDATA(outputbytes),
+									 VARSIZE(outputbytes) - VARHDRSZ);
+					}
+					else
+					{
+						char	   *outputstr;
+
+						outputstr = OutputFunctionCall(&out_functions[i],
+													   values[i]);
+						pq_sendint32(&buf, strlen(outputstr));
+						pq_sendbytes(&buf, outputstr, strlen(outputstr));
+					}
+				}
+				MemoryContextSwitchTo(oldcontext);
+
+				send_inbound_message(pids[entry->worker], &buf);
+				processed++;
+			}
+
+			SPI_freetuptable(SPI_tuptable);
+		}
+
+		SPI_cursor_close(portal);
+		SPI_finish();
+
+		/* Clean up. */
+		ExecDropSingleTupleTableSlot(slot);
+		ExecCleanupTupleRouting(mtstate, proute);
+		ExecResetTupleTable(estate->es_tupleTable, false);
+#if PG_VERSION_NUM >= 140000
+		ExecCloseResultRelations(estate);
+		ExecCloseRangeTableRelations(estate);
+#endif
+		FreeExecutorState(estate);
+		MemoryContextDelete(rowcontext);
+
+		/* Tell the workers that's all, and wait for them to finish. */
+		resetStringInfo(&buf);
+		pq_sendbyte(&buf, 'c');
+		for (i = 0; i < nworkers; ++i)
+			send_inbound_message(pids[i], &buf);
+		for (i = 0; i < nworkers; ++i)
+			(void) drain_worker(pids[i], NULL);
+	}
+	PG_CATCH();
+	{
+		for (i = 0; i < nlaunched; ++i)
+		{
+			pg_background_worker_info *info = find_worker_info(pids[i]);
+
+			if (info != NULL)
+				dsm_detach(info->seg);
+		}
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	table_close(rel, NoLock);
+
+	PG_RETURN_INT64(processed);
+#endif
+}
+
+/*
+ * When the dynamic shared memory segment associated with a worker is
+ * cleaned up, we need to clean up our associated private data structures.
+ */
+static void
+cleanup_worker_info(dsm_segment *seg, Datum pid_datum)
+{
+	pid_t		pid = DatumGetInt32(pid_datum);
+	pid_t		running_pid;
+	bool		found;
+	pg_background_worker_info *info;
+
+	/* Find any worker info entry for this PID.  If none, we're done. */
+	if ((info = find_worker_info(pid)) == NULL)
+		return;
+
+	/*
+	 * If we are a worker going away because of an error, stop the workers we
+	 * launched, unless they were detached and so meant to outlive us.  They
+	 * might be busy for a long while before they next look at their control
+	 * queue, so don't just ask nicely.
+	 */
+	if (worker_failing && !info->fdata->detached && info->handle != NULL)
+		TerminateBackgroundWorker(info->handle);
+
+	/*
+	 * If we're letting go of a worker that is to be canceled once orphaned,
+	 * tell it now, rather than leave it to find out when it next sends us
+	 * something.  It ignores this once its command has committed, as it does
+	 * after we've read its whole result.
+	 */
+	else if (!info->fdata->detached &&
+			 info->fdata->orphan_policy == PG_BACKGROUND_ORPHAN_CANCEL &&
+			 info->handle != NULL &&
+			 GetBackgroundWorkerPid(info->handle, &running_pid) == BGWH_STARTED)
+	{
+		info->fdata->orphaned = true;
+		pg_memory_barrier();
+		(void) kill(running_pid, SIGINT);
+	}
+
+	/*
+	 * A worker that failed before it could join our launch tree can't give
+	 * back its entry itself, so do that for it once it is gone.
+	 */
+	if (info->handle != NULL &&
+		GetBackgroundWorkerPid(info->handle, &running_pid) == BGWH_STOPPED)
+		release_tree_slot(info->fdata->tree_slot,
+						  info->fdata->tree_generation);
+
+	/* Hold on to the flight recorder of a worker that failed or was slow. */
+	if (info->fdata->trace_kept)
+		keep_trace(pid, info->fdata);
+
+	/* Free memory used by the BackgroundWorkerHandle. */
+	if (info->handle != NULL)
+	{
+		pfree(info->handle);
+		info->handle = NULL;
+	}
+
+	/* Likewise for an error we never got round to reporting. */
+	if (info->pending_error != NULL)
+	{
+		pfree(info->pending_error->data);
+		pfree(info->pending_error);
+		info->pending_error = NULL;
+	}
+
+	/* Remove the hashtable entry. */
+	hash_search(worker_hash, (void *) &pid, HASH_REMOVE, &found);
+	if (!found)
+		elog(ERROR, "pg_background worker_hash table corrupted");
+}
+
+/*
+ * Find the background worker information for the worker with a given PID.
+ */
+static pg_background_worker_info *
+find_worker_info(pid_t pid)
+{
+	pg_background_worker_info *info = NULL;
+
+	if (worker_hash != NULL)
+		info = hash_search(worker_hash, (void *) &pid, HASH_FIND, NULL);
+
+	return info;
+}
+
+/*
+ * Check whether the current user has rights to manipulate the background
+ * worker with the given PID.
+ */
+static void
+check_rights(pg_background_worker_info * info)
+{
+	check_user_rights(info->current_user_id, info->pid);
+}
+
+/*
+ * Likewise, for a worker launched by the given user that we may no longer
+ * have any other information about.
+ */
+static void
+check_user_rights(Oid user_id, int32 pid)
+{
+	Oid			current_user_id;
+	int			sec_context;
+
+	GetUserIdAndSecContext(&current_user_id, &sec_context);
+	if (!has_privs_of_role(current_user_id, user_id))
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("permission denied for background worker with PID \"%d\"",
+						pid)));
+}
+
+/*
+ * Save worker information for future IPC.
+ */
+static void
+save_worker_info(pid_t pid, dsm_segment *seg, BackgroundWorkerHandle *handle,
+				 shm_mq_handle *responseq, pg_background_ring *ring,
+				 shm_mq_handle *control_in, shm_mq_handle *control_out,
+				 shm_mq_handle *inbound, pg_background_fixed_data *fdata)
+{
+	pg_background_worker_info *info;
+	Oid			current_user_id;
+	int			sec_context;
+
+	/* If the hash table hasn't been set up yet, do that now. */
+	if (worker_hash == NULL)
+	{
+		HASHCTL		ctl;
+
+		ctl.keysize = sizeof(pid_t);
+		ctl.entrysize = sizeof(pg_background_worker_info);
+		worker_hash = hash_create("pg_background worker_hash", 8, &ctl,
+								  HASH_BLOBS | HASH_ELEM);
+	}
+
+	/* Get current authentication information. */
+	GetUserIdAndSecContext(&current_user_id, &sec_context);
+
+	/*
+	 * In the unlikely event that there's an older worker with this PID, just
+	 * detach it - unless it has a different user ID than the currently-active
+	 * one, in which case someone might be trying to pull a fast one.  Let's
+	 * kill the backend to make sure we don't break anyone's expectations.
+	 */
+	if ((info = find_worker_info(pid)) != NULL)
+	{
+		if (current_user_id != info->current_user_id)
+			ereport(FATAL,
+					(errcode(ERRCODE_DUPLICATE_OBJECT),
+					 errmsg("background worker with PID \"%d\" already exists",
+							pid)));
+		dsm_detach(info->seg);
+	}
+
+	/* When the DSM is unmapped, clean everything up. */
+	on_dsm_detach(seg, cleanup_worker_info, Int32GetDatum(pid));
+
+	/* Create a new entry for this worker. */
+	info = hash_search(worker_hash, (void *) &pid, HASH_ENTER, NULL);
+	info->seg = seg;
+	info->handle = handle;
+	info->current_user_id = current_user_id;
+	info->responseq = responseq;
+	info->ring = ring;
+	info->control_in = control_in;
+	info->control_out = control_out;
+	info->inbound = inbound;
+	info->pending_error = NULL;
+	info->fdata = fdata;
+	info->consumed = false;
+	info->reading_inline = false;
+	info->inline_offset = 0;
+}
+
+/*
+ * Indicate that an error came from a particular background worker.
+ */
+static void
+pg_background_error_callback(void *arg)
+{
+	pid_t		pid = *(pid_t *) arg;
+
+	errcontext("background worker, pid %d", pid);
+}
+
+/*
+ * Background worker entrypoint.
+ */
+void
+pg_background_worker_main(Datum main_arg)
+{
+	dsm_segment *seg;
+	shm_toc    *toc;
+	pg_background_fixed_data *fdata;
+	char	   *sql;
+	char	   *gucstate;
+	shm_mq	   *mq;
+	MemoryContext session_context;
+	char	   *on_success = NULL;
+	char	   *on_failure = NULL;
+	ErrorData  *edata = NULL;
+
+	/* Establish signal handlers. */
+	pqsignal(SIGTERM, handle_sigterm);
+	pqsignal(SIGINT, handle_sigint);
+	BackgroundWorkerUnblockSignals();
+	worker_start_time = GetCurrentTimestamp();
+
+	/* Set up a memory context and resource owner. */
+	Assert(CurrentResourceOwner == NULL);
+	CurrentResourceOwner = ResourceOwnerCreate(NULL, "pg_background");
+	session_context = AllocSetContextCreate(TopMemoryContext,
+											"pg_background session",
+											ALLOCSET_DEFAULT_MINSIZE,
+											ALLOCSET_DEFAULT_INITSIZE,
+											ALLOCSET_DEFAULT_MAXSIZE);
+	CurrentMemoryContext = session_context;
+
+
+	/* Connect to the dynamic shared memory segment. */
+	seg = dsm_attach(DatumGetInt32(main_arg));
+	if (seg == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("unable to map dynamic shared memory segment")));
+	toc = shm_toc_attach(PG_BACKGROUND_MAGIC, dsm_segment_address(seg));
+	if (toc == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("bad magic number in dynamic shared memory segment")));
+
+	/* Find data structures in dynamic shared memory. */
+	fdata = shm_toc_lookup_compat(toc, PG_BACKGROUND_KEY_FIXED_DATA, false);
+	if (fdata == NULL)
+//Line 159:Added error handling
+			ereport(ERROR, (errmsg("Failed to allocate memory for fixed data")));
+	sql = shm_toc_lookup_compat(toc, PG_BACKGROUND_KEY_SQL, false);
+	gucstate = shm_toc_lookup_compat(toc, PG_BACKGROUND_KEY_GUC, false);
+
+	/* Attach to the control queues. */
+	mq = shm_toc_lookup_compat(toc, PG_BACKGROUND_KEY_CONTROL_TO_LAUNCHER, false);
+	shm_mq_set_sender(mq, MyProc);
+	worker_control_out = shm_mq_attach(mq, seg, NULL);
+	mq = shm_toc_lookup_compat(toc, PG_BACKGROUND_KEY_CONTROL_TO_WORKER, false);
+	shm_mq_set_receiver(mq, MyProc);
+	worker_control_in = shm_mq_attach(mq, seg, NULL);
+
+	/* Attach to the inbound queue, if the launcher means to send us rows. */
+	mq = shm_toc_lookup_compat(toc, PG_BACKGROUND_KEY_INBOUND, true);
+	if (mq != NULL)
+	{
+		shm_mq_set_receiver(mq, MyProc);
+		worker_inbound = shm_mq_attach(mq, seg, NULL);
+	}
+
+	if (fdata->transport == PG_BACKGROUND_TRANSPORT_RING)
+	{
+		pg_background_ring *ring;
+
+		ring = shm_toc_lookup_compat(toc, PG_BACKGROUND_KEY_QUEUE, false);
+		ring->sender.end.proc = MyProc;
+		pg_write_barrier();
+		sender_ring = ring;
+		on_dsm_detach(seg, ring_cleanup_sender, PointerGetDatum(ring));
+	}
+	else
+	{
+		mq = shm_toc_lookup_compat(toc, PG_BACKGROUND_KEY_QUEUE, false);
+
+		shm_mq_set_sender(mq, MyProc);
+		worker_responseq = shm_mq_attach(mq, seg, NULL);
+	}
+
+	/* Forget the queues before the segment goes away under them. */
+	on_dsm_detach(seg, cleanup_worker_queues, (Datum) 0);
+
+	/* Start watching how full the response queue gets. */
+	queue_sample_timeout = RegisterTimeout(USER_TIMEOUT,
+										   handle_queue_sample_timeout);
+#ifdef PG_BACKGROUND_SAMPLE_IN_HANDLER
+	enable_timeout_every(queue_sample_timeout,
+						 TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+													 PG_BACKGROUND_QUEUE_SAMPLE_MS),
+						 PG_BACKGROUND_QUEUE_SAMPLE_MS);
+#else
+	enable_timeout_after(queue_sample_timeout, PG_BACKGROUND_QUEUE_SAMPLE_MS);
+#endif
+
+	/* Count any workers we launch ourselves against our launcher's tree. */
+	attach_task_tree(fdata);
+
+	/* Our PID now means us; forget the output of anyone who had it before. */
+	forget_spool();
+
+	/*
+	 * Redirect protocol messages to the launcher, the way pqmq would, but
+	 * try to hand back a small result inline first.
+	 */
+	worker_fdata = fdata;
+	inline_fdata = fdata;
+	inline_used = 0;
+	prev_emit_log_hook = emit_log_hook;
+	emit_log_hook = trace_emit_log;
+	prev_comm_methods = PqCommMethods;
+	PqCommMethods = &pg_background_comm_methods;
+	whereToSendOutput = DestRemote;
+	FrontendProtocol = PG_PROTOCOL_LATEST;
+
+	/*
+	 * Initialize our user and database ID based on the strings version of the
+	 * data, and then go back and check that we actually got the database and
+	 * user ID that we intended to get.  We do this because it's not
+	 * impossible for the process that started us to die before we get here,
+	 * and the user or database could be renamed in the meantime.  We don't
+	 * want to latch on the wrong object by accident.  There should probably
+	 * be a variant of BackgroundWorkerInitializeConnection that accepts OIDs
+	 * rather than strings.
+	 */
+	BackgroundWorkerInitializeConnection(NameStr(fdata->database),
+										 NameStr(fdata->authenticated_user)
+#if PG_VERSION_NUM >= 110000
+										 ,BGWORKER_BYPASS_ALLOWCONN
+#endif
+		);
+
+	if (fdata->database_id != MyDatabaseId ||
+		fdata->authenticated_user_id != GetAuthenticatedUserId())
+		ereport(ERROR,
+				(errmsg("user or database renamed during pg_background startup")));
+
+	/*
+	 * Restore GUC values from launching backend.  The follow-up SQL is ours
+	 * alone to run, not that of any workers our command launches in turn.
+	 */
+	StartTransactionCommand();
+	RestoreGUCState(gucstate);
+	if (pg_background_on_success[0] != '\0')
+	{
+		on_success = MemoryContextStrdup(session_context,
+										pg_background_on_success);
+		SetConfigOption("pg_background.on_success", "", PGC_USERSET,
+						PGC_S_SESSION);
+	}
+	if (pg_background_on_failure[0] != '\0')
+	{
+		on_failure = MemoryContextStrdup(session_context,
+										pg_background_on_failure);
+		SetConfigOption("pg_background.on_failure", "", PGC_USERSET,
+						PGC_S_SESSION);
+	}
+	apply_temp_limit();
+	CommitTransactionCommand();
+
+	/*
+	 * Our statistics go by query ID, so have one computed unless
+	 * compute_query_id is off, as pg_stat_statements does.
+	 */
+	EnableQueryId_compat();
+
+	/* Restore user ID and security context. */
+	SetUserIdAndSecContext(fdata->current_user_id, fdata->sec_context);
+	trace_event("connected", "to database \"%s\" as \"%s\"",
+				NameStr(fdata->database), NameStr(fdata->authenticated_user));
+
+	/* Prepare to execute the query. */
+	SetCurrentStatementStartTimestamp();
+	debug_query_string = sql;
+	pgstat_report_activity(STATE_RUNNING, sql);
+
+	start_cpu_limit();
+	if (on_failure == NULL)
+		execute_script(fdata, sql);
+	else
+	{
+		/*
+		 * Report an error just as we would if there were nothing more to do,
+		 * but then clean up so that we can go on to run the follow-up SQL.
+		 */
+		PG_TRY();
+		{
+			execute_script(fdata, sql);
+		}
+		PG_CATCH();
+		{
+			MemoryContextSwitchTo(session_context);
+			edata = CopyErrorData();
+			EmitErrorReport();
+			FlushErrorState();
+			disable_timeout(STATEMENT_TIMEOUT, false);
+			AbortCurrentTransaction();
+			trace_event("transaction", "rolled back");
+		}
+		PG_END_TRY();
+	}
+	stop_cpu_limit();
+
+#if PG_VERSION_NUM < 150000
+	ProcessCompletedNotifies();
+#endif
+	pgstat_report_activity(STATE_IDLE, sql);
+	report_worker_stats(true);
+
+	/*
+	 * If we were slow, say what took the time.  A failed worker's trace is
+	 * kept along with its error instead.
+	 */
+	if (edata == NULL && pg_background_trace_min_duration >= 0)
+	{
+		long		secs;
+		int			usecs;
+		double		msecs;
+
+		TimestampDifference(worker_start_time, GetCurrentTimestamp(),
+							&secs, &usecs);
+		msecs = secs * 1000.0 + usecs / 1000.0;
+		if (msecs >= pg_background_trace_min_duration)
+		{
+			pg_background_trace_event events[PG_BACKGROUND_TRACE_EVENTS];
+			int			nevents;
+
+			if (trace_blocked_waits > 0)
+				record_send_blocked();
+			nevents = copy_trace(fdata, events);
+			fdata->trace_kept = true;
+			ereport(LOG,
+					(errmsg("background worker finished after %.3f ms", msecs),
+					 errdetail_internal("%s", format_trace(events, nevents))));
+		}
+	}
+
+	/* Signal that we are done, unless we already reported an error. */
+	if (edata == NULL)
+		ReadyForQuery(DestRemote);
+
+	/* The launcher has its result; now run the follow-up SQL, if any. */
+	if (edata != NULL)
+		execute_follow_up("pg_background.on_failure", on_failure,
+						  unpack_sql_state(edata->sqlerrcode),
+						  edata->message, "");
+	else if (on_success != NULL)
+		execute_follow_up("pg_background.on_success", on_success,
+						  unpack_sql_state(ERRCODE_SUCCESSFUL_COMPLETION),
+						  "", last_command_tag);
+}
+
+/*
+ * Run the worker's command, as a chunked job or in a single transaction.
+ */
+static void
+execute_script(pg_background_fixed_data * fdata, const char *sql)
+{
+	PG_TRY();
+	{
+		if (fdata->chunked)
+			execute_chunked_job(fdata, sql);
+		else
+		{
+			allow_cancel(true);
+			if (pg_background_script_workers > 0)
+				sql = run_script_in_parallel(sql);
+
+			StartTransactionCommand();
+			if (StatementTimeout > 0)
+				enable_timeout_after(STATEMENT_TIMEOUT, StatementTimeout);
+			else
+				disable_timeout(STATEMENT_TIMEOUT, false);
+
+			/* Execute the query. */
+			execute_sql_string(sql);
+
+			/* Post-execution cleanup. */
+			disable_timeout(STATEMENT_TIMEOUT, false);
+			CommitTransactionCommand();
+			allow_cancel(false);
+			trace_event("transaction", "committed");
+		}
+	}
+	PG_CATCH();
+	{
+		allow_cancel(false);
+		rethrow_cancel_error();
+		rethrow_temp_limit_error();
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+}
+
+/*
+ * Run the start of a script, farming maintenance statements out to child
+ * workers, up to pg_background.script_workers at a time, and return the rest
+ * for us to run as usual once they are done, so that the last statement's
+ * result reaches the launcher.  A script with no such statement before its
+ * last is returned whole, to run in a single transaction as usual.
+ *
+ * Statements that VACUUM, ANALYZE, CLUSTER, REINDEX or CREATE INDEX on a
+ * single existing table can run alongside each other in child workers, but
+ * not alongside another one on the same table, which has to wait for them to
+ * finish first.  Other statements wait for everything before them and then
+ * run here, each run of them in a single transaction, so that anything they
+ * change about the session, such as a setting or a temporary table, holds
+ * for the rest of the script; everything after them waits for them, so the
+ * script runs as though in order.  The maintenance statements and the runs
+ * of other statements commit on their own, though, and an error stops the
+ * script without undoing those that have already finished.
+ */
+static const char *
+run_script_in_parallel(const char *sql)
+{
+#if PG_VERSION_NUM >= 100000
+	MemoryContext context;
+	MemoryContext oldcontext = CurrentMemoryContext;
+	List	   *raw_parsetree_list;
+	int32	   *pids;
+	Oid		   *relids;
+	int			nstatements;
+	volatile int nrunning = 0;
+	int			run_start = -1; /* of the statements waiting to run here */
+	int			i;
+	const char *last;
+
+	context = AllocSetContextCreate(CurrentMemoryContext,
+									"pg_background parallel script",
+									ALLOCSET_DEFAULT_MINSIZE,
+									ALLOCSET_DEFAULT_INITSIZE,
+									ALLOCSET_DEFAULT_MAXSIZE);
+	MemoryContextSwitchTo(context);
+	raw_parsetree_list = pg_parse_query(sql);
+	nstatements = list_length(raw_parsetree_list);
+	if (nstatements < 2)
+	{
+		MemoryContextSwitchTo(oldcontext);
+		MemoryContextDelete(context);
+		return sql;
+	}
+
+	/* Scripts with nothing to farm out run as usual. */
+	StartTransactionCommand();
+	for (i = 0; i < nstatements - 1; ++i)
+	{
+		RawStmt    *stmt = list_nth(raw_parsetree_list, i);
+
+		if (OidIsValid(statement_relation(stmt->stmt)))
+			break;
+	}
+	CommitTransactionCommand();
+	MemoryContextSwitchTo(context);
+	if (i == nstatements - 1)
+	{
+		MemoryContextSwitchTo(oldcontext);
+		MemoryContextDelete(context);
+		return sql;
+	}
+
+	pids = palloc(sizeof(int32) * nstatements);
+	relids = palloc(sizeof(Oid) * nstatements);
+
+	/* Don't leave statements running behind us if one of them fails. */
+	PG_TRY();
+	{
+		for (i = 0; i < nstatements - 1; ++i)
+		{
+			RawStmt    *stmt = list_nth(raw_parsetree_list, i);
+			char	   *stmt_sql;
+			Oid			relid;
+			int			j;
+
+			StartTransactionCommand();
+			relid = statement_relation(stmt->stmt);
+			CommitTransactionCommand();
+			MemoryContextSwitchTo(context);
+
+			/* Other statements wait to run here with those next to them. */
+			if (!OidIsValid(relid))
+			{
+				if (run_start < 0)
+					run_start = i;
+				continue;
+			}
+
+			/* Run those before this one, once everything before them is done. */
+			if (run_start >= 0)
+			{
+				RawStmt    *first = list_nth(raw_parsetree_list, run_start);
+
+				while (nrunning > 0)
+				{
+					drain_script_worker(pids[0]);
+					--nrunning;
+					memmove(&pids[0], &pids[1], sizeof(int32) * nrunning);
+					memmove(&relids[0], &relids[1], sizeof(Oid) * nrunning);
+				}
+				run_script_statements(pnstrdup(sql + first->stmt_location,
+											   stmt->stmt_location -
+											   first->stmt_location));
+				MemoryContextSwitchTo(context);
+				run_start = -1;
+
+				/* They may have changed which table this one works on. */
+				StartTransactionCommand();
+				relid = statement_relation(stmt->stmt);
+				CommitTransactionCommand();
+				MemoryContextSwitchTo(context);
+				if (!OidIsValid(relid))
+				{
+					run_start = i;
+					continue;
+				}
+			}
+
+			/* Wait for the statements on the same table. */
+			j = 0;
+			while (j < nrunning)
+			{
+				if (relids[j] != relid)
+				{
+					++j;
+					continue;
+				}
+				drain_script_worker(pids[j]);
+				--nrunning;
+				memmove(&pids[j], &pids[j + 1], sizeof(int32) * (nrunning - j));
+				memmove(&relids[j], &relids[j + 1], sizeof(Oid) * (nrunning - j));
+			}
+
+			/* Wait for a worker to finish if we have as many as we may. */
+			if (nrunning >= pg_background_script_workers)
+			{
+				drain_script_worker(pids[0]);
+				--nrunning;
+				memmove(&pids[0], &pids[1], sizeof(int32) * nrunning);
+				memmove(&relids[0], &relids[1], sizeof(Oid) * nrunning);
+			}
+
+			stmt_sql = pnstrdup(sql + stmt->stmt_location, stmt->stmt_len);
+			pids[nrunning] = launch_script_worker(stmt_sql);
+			MemoryContextSwitchTo(context);
+			relids[nrunning] = relid;
+			trace_event("parallel", "%s in PID %d",
+						GetCommandTagName(CreateCommandTag_compat(stmt)),
+						pids[nrunning]);
+			nrunning++;
+		}
+
+		while (nrunning > 0)
+		{
+			drain_script_worker(pids[0]);
+			--nrunning;
+			memmove(&pids[0], &pids[1], sizeof(int32) * nrunning);
+		}
+	}
+	PG_CATCH();
+	{
+		discard_output = false;
+		for (i = 0; i < nrunning; ++i)
+		{
+			pg_background_worker_info *info = find_worker_info(pids[i]);
+
+			if (info != NULL)
+			{
+				(void) cancel_worker(pids[i]);
+				dsm_detach(info->seg);
+			}
+		}
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	/* Any statements left waiting run with the last one. */
+	if (run_start < 0)
+		run_start = nstatements - 1;
+	last = MemoryContextStrdup(oldcontext,
+							   sql + ((RawStmt *) list_nth(raw_parsetree_list,
+														   run_start))->stmt_location);
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextDelete(context);
+
+	return last;
+#else
+	/* Without statement locations, we can't split up the script. */
+	return sql;
+#endif
+}
+
+/*
+ * Run some statements of a parallel script here, in a transaction of their
+ * own.  Their result isn't the script's, so only their notices reach the
+ * launcher.
+ */
+static void
+run_script_statements(const char *sql)
+{
+	discard_output = true;
+
+	StartTransactionCommand();
+	if (StatementTimeout > 0)
+		enable_timeout_after(STATEMENT_TIMEOUT, StatementTimeout);
+	else
+		disable_timeout(STATEMENT_TIMEOUT, false);
+	execute_sql_string(sql);
+	disable_timeout(STATEMENT_TIMEOUT, false);
+	CommitTransactionCommand();
+
+	discard_output = false;
+}
+
+/*
+ * Launch a child worker for one statement of a parallel script.  It gets
+ * whatever is left of our pg_background.cpu_limit, not all of it afresh;
+ * pg_background.temp_limit, though, caps each child's own use.
+ */
+static int32
+launch_script_worker(const char *sql)
+{
+	int			save_nestlevel;
+	int32		pid;
+
+	StartTransactionCommand();
+	save_nestlevel = NewGUCNestLevel();
+#ifndef WIN32
+	if (pg_background_cpu_limit > 0)
+	{
+		char		buf[32];
+		double		remaining;
+
+		remaining = pg_background_cpu_limit - cpu_limit_used(NULL, NULL);
+		snprintf(buf, sizeof(buf), "%d", (int) Max(remaining, 1.0));
+		(void) set_config_option("pg_background.cpu_limit", buf,
+								 PGC_USERSET, PGC_S_SESSION,
+								 GUC_ACTION_SAVE, true, 0, false);
+	}
+#endif
+	pid = launch_worker(cstring_to_text(sql), 65536, pg_background_transport,
+						NULL, NULL, 0);
+	AtEOXact_GUC(true, save_nestlevel);
+	CommitTransactionCommand();
+
+	return pid;
+}
+
+/*
+ * Wait for a child worker of a parallel script to finish.  Between
+ * statements we have no resource owner, which letting go of the child's
+ * segment needs, so this happens in a transaction of its own.
+ */
+static void
+drain_script_worker(int32 pid)
+{
+	MemoryContext oldcontext = CurrentMemoryContext;
+
+	StartTransactionCommand();
+	(void) drain_worker(pid, NULL);
+	CommitTransactionCommand();
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Return the OID of the one relation a maintenance statement works on, or
+ * InvalidOid if it isn't such a statement, the relation doesn't exist yet,
+ * or it is one of our temporary tables, which a child worker can't see.
+ */
+static Oid
+statement_relation(Node *stmt)
+{
+	RangeVar   *relation = NULL;
+	Oid			relid;
+
+	switch (nodeTag(stmt))
+	{
+		case T_VacuumStmt:
+			{
+				VacuumStmt *vacstmt = (VacuumStmt *) stmt;
+
+#if PG_VERSION_NUM >= 110000
+				if (list_length(vacstmt->rels) == 1)
+					relation = ((VacuumRelation *) linitial(vacstmt->rels))->relation;
+#else
+				relation = vacstmt->relation;
+#endif
+				break;
+			}
+		case T_IndexStmt:
+			relation = ((IndexStmt *) stmt)->relation;
+			break;
+		case T_ReindexStmt:
+			if (((ReindexStmt *) stmt)->kind == REINDEX_OBJECT_TABLE)
+				relation = ((ReindexStmt *) stmt)->relation;
+			break;
+		case T_ClusterStmt:
+			relation = ((ClusterStmt *) stmt)->relation;
+			break;
+		default:
+			break;
+	}
+
+	if (relation == NULL)
+		return InvalidOid;
+
+	relid = RangeVarGetRelid(relation, NoLock, true);
+	if (OidIsValid(relid) && get_rel_persistence(relid) == RELPERSISTENCE_TEMP)
+		return InvalidOid;
+
+	return relid;
+}
+
+/*
+ * Stop talking to the launcher once it has our whole result, so that it
+ * needn't wait for anything we do afterwards.  From here on, our messages
+ * only go to the server log, and the launcher going away doesn't concern us.
+ */
+static void
+detach_from_launcher(void)
+{
+	whereToSendOutput = DestNone;
+	disable_timeout(queue_sample_timeout, false);
+	queue_sample_pending = false;
+
+	if (sender_ring != NULL)
+	{
+		ring_detach_end(&sender_ring->sender.end, &sender_ring->receiver.end);
+		sender_ring = NULL;
+	}
+	if (worker_responseq != NULL)
+	{
+		shm_mq_detach_compat(worker_responseq);
+		worker_responseq = NULL;
+	}
+	if (worker_control_out != NULL)
+	{
+		shm_mq_detach_compat(worker_control_out);
+		worker_control_out = NULL;
+	}
+	if (worker_control_in != NULL)
+	{
+		shm_mq_detach_compat(worker_control_in);
+		worker_control_in = NULL;
+	}
+}
+
+/*
+ * Run pg_background.on_success or pg_background.on_failure, named by name,
+ * in a transaction of its own, with the outcome of the worker's command
+ * available to it in the pg_background.outcome_* settings.  The launcher has
+ * already been sent the command's result, so it is detached from first; if
+ * the follow-up SQL fails, that is logged as a warning and changes nothing
+ * about the result.
+ */
+static void
+execute_follow_up(const char *name, const char *sql, const char *sqlstate,
+				  const char *message, const char *command)
+{
+	MemoryContext oldcontext = CurrentMemoryContext;
+
+	detach_from_launcher();
+
+	SetConfigOption("pg_background.outcome_sqlstate", sqlstate,
+					PGC_INTERNAL, PGC_S_OVERRIDE);
+	SetConfigOption("pg_background.outcome_message", message,
+					PGC_INTERNAL, PGC_S_OVERRIDE);
+	SetConfigOption("pg_background.outcome_command", command,
+					PGC_INTERNAL, PGC_S_OVERRIDE);
+
+	discard_output = true;
+	trace_event("follow-up", "after SQLSTATE %s", sqlstate);
+	SetCurrentStatementStartTimestamp();
+	debug_query_string = sql;
+	pgstat_report_activity(STATE_RUNNING, sql);
+
+	PG_TRY();
+	{
+		StartTransactionCommand();
+		if (StatementTimeout > 0)
+			enable_timeout_after(STATEMENT_TIMEOUT, StatementTimeout);
+		else
+			disable_timeout(STATEMENT_TIMEOUT, false);
+		execute_sql_string(sql);
+		disable_timeout(STATEMENT_TIMEOUT, false);
+		CommitTransactionCommand();
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		MemoryContextSwitchTo(oldcontext);
+		edata = CopyErrorData();
+		FlushErrorState();
+		disable_timeout(STATEMENT_TIMEOUT, false);
+		AbortCurrentTransaction();
+		trace_event("transaction", "rolled back");
+
+		ereport(WARNING,
+				(errcode(edata->sqlerrcode),
+				 errmsg("%s failed: %s", name, edata->message)));
+	}
+	PG_END_TRY();
+
+#if PG_VERSION_NUM < 150000
+	ProcessCompletedNotifies();
+#endif
+	pgstat_report_activity(STATE_IDLE, sql);
+	report_worker_stats(true);
+
+	discard_output = false;
+}
+
+/*
+ * Record an event in our flight recorder, overwriting the oldest one once
+ * the ring is full.  This is cheap enough to do on every statement.
+ */
+static void
+trace_event(const char *event, const char *fmt,...)
+{
+	pg_background_trace_event *e;
+	va_list		args;
+
+	if (worker_fdata == NULL)
+		return;
+
+	/* A run of waits for the launcher is over once anything else happens. */
+	if (trace_blocked_waits > 0)
+		record_send_blocked();
+
+	e = &worker_fdata->trace[worker_fdata->trace_count % PG_BACKGROUND_TRACE_EVENTS];
+	e->time = GetCurrentTimestamp();
+	strlcpy(e->event, event, sizeof(e->event));
+	va_start(args, fmt);
+	vsnprintf(e->detail, sizeof(e->detail), fmt, args);
+	va_end(args);
+
+	/* Make the event visible before counting it. */
+	pg_write_barrier();
+	worker_fdata->trace_count++;
+}
+
+/*
+ * Account for time spent waiting for the launcher to make room for output.
+ * Consecutive waits are recorded as a single event, so that a launcher
+ * that reads slowly doesn't push everything else out of the recorder.  The
+ * event is only added once the run of waits is over, since a reader may be
+ * copying any event already counted.
+ */
+static void
+trace_send_blocked(int64 usec)
+{
+	send_blocked_usec += usec;
+
+	if (trace_blocked_waits == 0)
+		trace_blocked_start = GetCurrentTimestamp() - usec;
+	trace_blocked_waits++;
+	trace_blocked_usec += usec;
+}
+
+/*
+ * Add the event for the current run of waits for the launcher.
+ */
+static void
+record_send_blocked(void)
+{
+	pg_background_trace_event *e;
+
+	e = &worker_fdata->trace[worker_fdata->trace_count % PG_BACKGROUND_TRACE_EVENTS];
+	e->time = trace_blocked_start;
+	strlcpy(e->event, "queue full", sizeof(e->event));
+	snprintf(e->detail, sizeof(e->detail),
+			 INT64_FORMAT " waits for launcher, %.3f ms in all",
+			 trace_blocked_waits, trace_blocked_usec / 1000.0);
+	trace_blocked_waits = 0;
+	trace_blocked_usec = 0;
+
+	/* Make the event visible before counting it. */
+	pg_write_barrier();
+	worker_fdata->trace_count++;
+}
+
+/*
+ * Copy a worker's flight recorder into events, oldest first, and return the
+ * number of events.  The worker may be adding events as we read, so leave
+ * out any it might have overwritten meanwhile.
+ */
+static int
+copy_trace(pg_background_fixed_data * fdata, pg_background_trace_event * events)
+{
+	uint32		count;
+	uint32		first;
+	uint32		last_safe;
+	uint32		i;
+	int			nevents = 0;
+
+	count = fdata->trace_count;
+	pg_read_barrier();
+	first = count > PG_BACKGROUND_TRACE_EVENTS ?
+		count - PG_BACKGROUND_TRACE_EVENTS : 0;
+	for (i = first; i < count; ++i)
+		events[nevents++] = fdata->trace[i % PG_BACKGROUND_TRACE_EVENTS];
+
+	pg_read_barrier();
+	last_safe = fdata->trace_count;
+	if (last_safe > first + PG_BACKGROUND_TRACE_EVENTS)
+	{
+		uint32		lost = Min(last_safe - first - PG_BACKGROUND_TRACE_EVENTS,
+							   (uint32) nevents);
+
+		nevents -= lost;
+		memmove(events, events + lost, nevents * sizeof(*events));
+	}
+
+	return nevents;
+}
+
+/*
+ * Format events as an error detail or log message, one per line, with times
+ * relative to the first.
+ */
+static char *
+format_trace(pg_background_trace_event * events, int nevents)
+{
+	StringInfoData buf;
+	int			i;
+
+	initStringInfo(&buf);
+	appendStringInfoString(&buf, "Recent events of the background worker:");
+	for (i = 0; i < nevents; ++i)
+	{
+		long		secs;
+		int			usecs;
+
+		TimestampDifference(events[0].time, events[i].time, &secs, &usecs);
+		appendStringInfo(&buf, "\n%10.3f ms  %s: %s",
+						 secs * 1000.0 + usecs / 1000.0,
+						 events[i].event, events[i].detail);
+	}
+
+	return buf.data;
+}
+
+/*
+ * emit_log_hook for workers.  Messages going to the server log, such as
+ * reports of lock waits, are worth recording.  Errors are recorded on their
+ * way to the launcher instead, since they may not be logged at all.
+ */
+static void
+trace_emit_log(ErrorData *edata)
+{
+	if (edata->elevel == LOG)
+		trace_event("log", "%s", edata->message ? edata->message : "");
+
+	if (prev_emit_log_hook)
+		prev_emit_log_hook(edata);
+}
+
+/*
+ * Record an ErrorResponse we're about to send the launcher, and ask it to
+ * keep our trace.  If pg_background.trace_errors is on, return the message
+ * with the whole flight recorder added to its detail field, and its new
+ * length in *len; otherwise return it unchanged.
+ */
+static const char *
+trace_error(const char *s, size_t *len)
+{
+	const char *end = s + *len;
+	const char *p = s;
+	pg_background_trace_event events[PG_BACKGROUND_TRACE_EVENTS];
+	int			nevents;
+	char	   *trace;
+	bool		have_detail = false;
+	StringInfoData buf;
+
+	trace_event("error", "%s", notice_message(s, *len));
+	worker_fdata->trace_kept = true;
+	if (!pg_background_trace_errors)
+		return s;
+
+	nevents = copy_trace(worker_fdata, events);
+	trace = format_trace(events, nevents);
+
+	initStringInfo(&buf);
+	while (p < end && *p != '\0')
+	{
+		char		code = *p++;
+		size_t		flen = strnlen(p, end - p);
+
+		appendStringInfoChar(&buf, code);
+		appendBinaryStringInfo(&buf, p, flen);
+		if (code == PG_DIAG_MESSAGE_DETAIL)
+		{
+			appendStringInfo(&buf, "\n%s", trace);
+			have_detail = true;
+		}
+		appendStringInfoChar(&buf, '\0');
+		p += flen + 1;
+	}
+	if (!have_detail)
+	{
+		appendStringInfoChar(&buf, PG_DIAG_MESSAGE_DETAIL);
+		appendStringInfoString(&buf, trace);
+		appendStringInfoChar(&buf, '\0');
+	}
+	appendStringInfoChar(&buf, '\0');
+
+	*len = buf.len;
+	return buf.data;
+}
+
+/*
+ * Find the message text in the fields of a NoticeResponse.
+ */
+static const char *
+notice_message(const char *s, size_t len)
+{
+	const char *end = s + len;
+
+	while (s < end && *s != '\0')
+	{
+		char		code = *s++;
+		size_t		flen = strnlen(s, end - s);
+
+		if (code == PG_DIAG_MESSAGE_PRIMARY)
+			return s;
+		s += flen + 1;
+	}
+
+	return "";
+}
+
+/*
+ * Check binary input function exists for the given type.
+ */
+static bool
+exists_binary_recv_fn(Oid type)
+{
+	HeapTuple	typeTuple;
+	Form_pg_type pt;
+	bool		exists_rev_fn;
+
+	typeTuple = SearchSysCache1(TYPEOID, ObjectIdGetDatum(type));
+	if (!HeapTupleIsValid(typeTuple))
+		elog(ERROR, "cache lookup failed for type %u", type);
+
+	pt = (Form_pg_type) GETSTRUCT(typeTuple);
+	exists_rev_fn = OidIsValid(pt->typreceive);
+	ReleaseSysCache(typeTuple);
+
+	return exists_rev_fn;
+}
+
+
+/*
+ * Execute given SQL string.
+ *
+ * Using SPI here would preclude backgrounding commands like VACUUM which one
+ * might very well wish to launch in the background.  So we do this instead.
+ */
+static void
+execute_sql_string(const char *sql)
+{
+	List	   *raw_parsetree_list;
+	ListCell   *lc1;
+	bool		isTopLevel;
+	int			commands_remaining;
+	MemoryContext parsecontext;
+	MemoryContext oldcontext;
+	instr_time	phase_start;
+	int64		parse_usec;
+
+	/*
+	 * Parse the SQL string into a list of raw parse trees.
+	 *
+	 * Because we allow statements that perform internal transaction control,
+	 * we can't do this in TopTransactionContext; the parse trees might get
+	 * blown away before we're done executing them.
+	 */
+	parsecontext = AllocSetContextCreate(TopMemoryContext,
+										 "pg_background parse/plan",
+										 ALLOCSET_DEFAULT_MINSIZE,
+										 ALLOCSET_DEFAULT_INITSIZE,
+										 ALLOCSET_DEFAULT_MAXSIZE);
+	oldcontext = MemoryContextSwitchTo(parsecontext);
+	INSTR_TIME_SET_CURRENT(phase_start);
+	raw_parsetree_list = pg_parse_query(sql);
+	parse_usec = lap_usec(&phase_start);
+	commands_remaining = list_length(raw_parsetree_list);
+	isTopLevel = commands_remaining == 1;
+	MemoryContextSwitchTo(oldcontext);
+
+	/*
+	 * Do parse analysis, rule rewrite, planning, and execution for each raw
+	 * parsetree.  We must fully execute each query before beginning parse
+	 * analysis on the next one, since there may be interdependencies.
+	 */
+	foreach(lc1, raw_parsetree_list)
+	{
+#if PG_VERSION_NUM < 100000
+		Node	   *parsetree = (Node *) lfirst(lc1);
+#else
+		RawStmt    *parsetree = (RawStmt *) lfirst(lc1);
+#endif
+#if PG_VERSION_NUM >= 130000
+		CommandTag	commandTag;
+#else
+		const char *commandTag;
+#endif
+#if PG_VERSION_NUM < 130000
+		char		completionTag[COMPLETION_TAG_BUFSIZE];
+#else
+		QueryCompletion qc;
+#endif
+		List	   *querytree_list,
+				   *plantree_list;
+		bool		snapshot_set = false;
+		Portal		portal;
+		DestReceiver *receiver;
+		int16		format = pg_background_result_format;
+		int64		usecs[PG_BACKGROUND_NPHASES];
+		int64		blocked_before = send_blocked_usec;
+		int64		temp_before = temp_bytes_written;
+		char	   *stmt_sql;
+		uint64		stmt_queryid;
+		int			i;
+
+		/*
+		 * The whole script is parsed in one go, so share out the time that
+		 * took evenly among its statements.
+		 */
+		usecs[PG_BACKGROUND_PHASE_PARSE] =
+			parse_usec / list_length(raw_parsetree_list);
+		start_memory_sampling();
+		reset_queue_samples();
+
+		/*
+		 * We don't allow transaction-control commands like COMMIT and ABORT
+		 * here.  The entire SQL statement is executed as a single transaction
+		 * which commits if no errors are encountered.
+		 */
+		if (IsA(parsetree, TransactionStmt))
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("transaction control statements are not allowed in pg_background")));
+
+		/*
+		 * Get the command name for use in status display (it also becomes the
+		 * default completion tag, down inside PortalRun).  Set ps_status and
+		 * do any special start-of-SQL-command processing needed by the
+		 * destination.
+		 */
+		commandTag = CreateCommandTag_compat(parsetree);
+		set_ps_display_compat(GetCommandTagName(commandTag));
+		trace_event("statement", "%s", GetCommandTagName(commandTag));
+
+		BeginCommand(commandTag, DestNone);
+
+		/* Set up a snapshot if parse analysis/planning will need one. */
+		if (analyze_requires_snapshot(parsetree))
+		{
+			PushActiveSnapshot(GetTransactionSnapshot());
+			snapshot_set = true;
+		}
+
+		/*
+		 * OK to analyze, rewrite, and plan this query.
+		 *
+		 * As with parsing, we need to make sure this data outlives the
+		 * transaction, because of the possibility that the statement might
+		 * perform internal transaction control.
+		 */
+		oldcontext = MemoryContextSwitchTo(parsecontext);
+		INSTR_TIME_SET_CURRENT(phase_start);
+		querytree_list = pg_analyze_and_rewrite_compat(parsetree, sql, NULL, 0,
+													   NULL);
+		usecs[PG_BACKGROUND_PHASE_ANALYZE] = lap_usec(&phase_start);
+
+		plantree_list = pg_plan_queries(querytree_list,
+#if PG_VERSION_NUM >= 130000
+										sql,
+#endif
+										0, NULL);
+		usecs[PG_BACKGROUND_PHASE_PLAN] = lap_usec(&phase_start);
+		sample_memory();
+
+#if PG_VERSION_NUM >= 100000
+		stmt_sql = pnstrdup(sql + parsetree->stmt_location,
+							parsetree->stmt_len > 0 ? parsetree->stmt_len :
+							strlen(sql));
+#else
+		stmt_sql = pstrdup(sql);
+#endif
+		while (isspace((unsigned char) *stmt_sql))
+			stmt_sql++;
+		i = strlen(stmt_sql);
+		while (i > 0 && isspace((unsigned char) stmt_sql[i - 1]))
+			stmt_sql[--i] = '\0';
+		stmt_queryid = statement_id(querytree_list, stmt_sql);
+		trace_event("planned", "in %.3f ms",
+					(usecs[PG_BACKGROUND_PHASE_ANALYZE] +
+					 usecs[PG_BACKGROUND_PHASE_PLAN]) / 1000.0);
+
+		/* Done with the snapshot used for parsing/planning */
+		if (snapshot_set)
+			PopActiveSnapshot();
+
+		/* If we got a cancel signal in analysis or planning, quit */
+		CHECK_FOR_INTERRUPTS();
+
+		/*
+		 * Execute the query using the unnamed portal.
+		 */
+		INSTR_TIME_SET_CURRENT(phase_start);
+		portal = CreatePortal("", true, true);
+		/* Don't display the portal in pg_cursors */
+		portal->visible = false;
+		PortalDefineQuery(portal, NULL, sql, commandTag, plantree_list, NULL);
+		PortalStart(portal, NULL, 0, InvalidSnapshot);
+		PortalSetResultFormat(portal, 1, &format);
+		usecs[PG_BACKGROUND_PHASE_PORTAL_START] = lap_usec(&phase_start);
+
+		/*
+		 * Tuples returned by any command other than the last are simply
+		 * discarded; but those returned by the last (or only) command are
+		 * redirected to the shared memory queue we're using for communication
+		 * with the launching backend. If the launching backend is gone or has
+		 * detached us, these messages will just get dropped on the floor.
+		 */
+		--commands_remaining;
+		if (commands_remaining > 0)
+			receiver = CreateDestReceiver(DestNone);
+		else
+		{
+			receiver = CreateDestReceiver(DestRemote);
+			SetRemoteDestReceiverParams(receiver, portal);
+		}
+
+		/*
+		 * Only once the portal and destreceiver have been established can we
+		 * return to the transaction context.  All that stuff needs to survive
+		 * an internal commit inside PortalRun!
+		 */
+		MemoryContextSwitchTo(oldcontext);
+
+		/* Here's where we actually execute the command. */
+		INSTR_TIME_SET_CURRENT(phase_start);
+#if PG_VERSION_NUM < 100000
+		(void) PortalRun(portal, FETCH_ALL, isTopLevel, receiver, receiver,
+						 completionTag);
+#elif PG_VERSION_NUM < 130000
+		(void) PortalRun(portal, FETCH_ALL, isTopLevel, true, receiver,
+						 receiver, completionTag);
+#else
+		(void) PortalRun(portal, FETCH_ALL, isTopLevel, true, receiver,
+						 receiver, &qc);
+#endif
+		usecs[PG_BACKGROUND_PHASE_PORTAL_RUN] = lap_usec(&phase_start);
+		usecs[PG_BACKGROUND_PHASE_SEND_BLOCKED] =
+			send_blocked_usec - blocked_before;
+		trace_event("executed", "in %.3f ms",
+					usecs[PG_BACKGROUND_PHASE_PORTAL_RUN] / 1000.0);
+
+		/* The executor hasn't let go of its memory yet. */
+		sample_memory();
+
+		/* Clean up the receiver. */
+		(*receiver->rDestroy) (receiver);
+
+		/*
+		 * Send a CommandComplete message even if we suppressed the query
+		 * results.  The user backend will report these in the absence of any
+		 * true query results.
+		 */
+#if PG_VERSION_NUM < 130000
+		EndCommand(completionTag, DestRemote);
+#else
+		EndCommand(&qc, DestRemote, false);
+#endif
+
+		/* Clean up the portal. */
+		PortalDrop(portal, false);
+
+		account_temp_bytes();
+		send_statement_stats(GetCommandTagName(commandTag), stmt_queryid,
+							 stmt_sql, usecs, temp_bytes_written - temp_before,
+							 statement_peak_memory);
+
+		/* Let the next statement see what this one did. */
+		if (commands_remaining > 0)
+			CommandCounterIncrement();
+	}
+
+	/* Be sure to advance the command counter after the last script command */
+	CommandCounterIncrement();
+}
+
+/*
+ * Return the number of microseconds since *since, and reset it to now, so
+ * that consecutive phases can be timed with a single clock.
+ */
+static int64
+lap_usec(instr_time *since)
+{
+	instr_time	now;
+	instr_time	elapsed;
+
+	INSTR_TIME_SET_CURRENT(now);
+	elapsed = now;
+	INSTR_TIME_SUBTRACT(elapsed, *since);
+	*since = now;
+
+	return INSTR_TIME_GET_MICROSEC(elapsed);
+}
+
+/*
+ * Start measuring the memory the next statement needs, over and above what
+ * the worker had allocated before it: caches, the parsed script and so on.
+ */
+static void
+start_memory_sampling(void)
+{
+	rows_since_memory_sample = 0;
+	statement_base_memory =
+		(int64) MemoryContextMemAllocated_compat(TopMemoryContext);
+	statement_peak_memory = 0;
+}
+
+/*
+ * Note how much more memory we have allocated than when the current
+ * statement started, if that's the most it has needed so far.  PostgreSQL
+ * has no hook for memory context growth, so we look at statement boundaries
+ * and every so many result rows; adding up the blocks of all our memory
+ * contexts is cheap at that rate.
+ */
+static void
+sample_memory(void)
+{
+	int64		allocated;
+
+	rows_since_memory_sample = 0;
+	allocated = (int64) MemoryContextMemAllocated_compat(TopMemoryContext);
+	statement_peak_memory = Max(statement_peak_memory,
+								allocated - statement_base_memory);
+}
+
+/*
+ * Timeout handler for samples of the response queue.  Where it can, it takes
+ * the sample right away, whether or not we are sending anything, so that a
+ * statement that runs a long time before producing output is sampled too.
+ */
+static void
+handle_queue_sample_timeout(void)
+{
+	queue_sample_pending = true;
+#ifdef PG_BACKGROUND_SAMPLE_IN_HANDLER
+	sample_queue();
+#endif
+}
+
+/*
+ * Count a sample of the response queue, if one is due: how full it is, or
+ * that we are blocked waiting for room in it.  This may run in the timeout
+ * handler, so it only reads the queue's positions, never waiting.
+ */
+static void
+sample_queue(void)
+{
+	pg_background_ring *ring = sender_ring;
+	int			bucket = PG_BACKGROUND_QUEUE_BLOCKED;
+
+	if (!queue_sample_pending || worker_fdata == NULL)
+		return;
+	queue_sample_pending = false;
+
+	if (!worker_fdata->waiting_for_room)
+	{
+		int64		used;
+		int64		size;
+
+		if (ring != NULL)
+		{
+			used = (int64) (pg_atomic_read_u64(&ring->sender.end.pos) -
+							pg_atomic_read_u64(&ring->receiver.end.pos));
+			size = (int64) ring->size;
+		}
+		else
+		{
+			/* The launcher may have read a message we've yet to count. */
+			used = (int64) (queue_written -
+							pg_atomic_read_u64(&worker_fdata->queue_read));
+			size = (int64) worker_fdata->queue_size;
+		}
+		used = Max(used, 0);
+		used = Min(used, size - 1);
+		bucket = (int) (used * PG_BACKGROUND_QUEUE_BUCKETS / size);
+	}
+	queue_samples[bucket]++;
+
+#ifndef PG_BACKGROUND_SAMPLE_IN_HANDLER
+	enable_timeout_after(queue_sample_timeout, PG_BACKGROUND_QUEUE_SAMPLE_MS);
+#endif
+}
+
+/*
+ * Start counting queue samples afresh for the next statement.
+ */
+static void
+reset_queue_samples(void)
+{
+	int			i;
+
+	for (i = 0; i <= PG_BACKGROUND_QUEUE_BUCKETS; ++i)
+		queue_samples[i] = 0;
+}
+
+/*
+ * Identify a statement for the statistics: by its query ID if the server
+ * computed one, and otherwise by a hash of its text with the constants left
+ * out.  Either way, statements that differ only in their constants are
+ * counted together.
+ */
+static uint64
+statement_id(List *querytree_list, const char *stmt_sql)
+{
+#if PG_VERSION_NUM >= 140000
+	if (querytree_list != NIL &&
+		linitial_node(Query, querytree_list)->queryId != UINT64CONST(0))
+		return linitial_node(Query, querytree_list)->queryId;
+#endif
+
+	return hash_normalized_statement(stmt_sql);
+}
+
+/*
+ * Hash the text of a statement that has been parsed successfully, token by
+ * token as the core scanner finds them, so that neither whitespace, comments
+ * nor the case of keywords and unquoted names make a difference.  Tokens that
+ * start the way a literal does are hashed as a placeholder instead: this
+ * needs no grammar tables, which extensions can't get at, and a parameter
+ * such as $1 doesn't look like a literal.
+ */
+static uint64
+hash_normalized_statement(const char *stmt_sql)
+{
+	core_yyscan_t yyscanner;
+	core_yy_extra_type yyextra;
+	core_YYSTYPE yylval;
+	YYLTYPE		yylloc;
+	StringInfoData norm;
+	int			start = -1;
+	uint64		hash;
+
+	initStringInfo(&norm);
+	yyscanner = scanner_init_compat(stmt_sql, &yyextra);
+	for (;;)
+	{
+		int			tok = core_yylex(&yylval, &yylloc, yyscanner);
+		const char *t;
+		int			end;
+		bool		quoted = false;
+		int			i;
+
+		/*
+		 * The scanner tells us only where each token starts, so a token's
+		 * text runs to the first blank or comment before the next one.
+		 */
+		if (start >= 0)
+		{
+			t = stmt_sql + start;
+			end = (tok == 0 ? strlen(stmt_sql) : yylloc) - start;
+			if (t[0] == '\'' || isdigit((unsigned char) t[0]) ||
+				(t[0] == '.' && isdigit((unsigned char) t[1])) ||
+				(t[0] == '$' && !isdigit((unsigned char) t[1])) ||
+				(strchr("bBeEnNxX", t[0]) != NULL && t[1] == '\'') ||
+				((t[0] == 'u' || t[0] == 'U') && t[1] == '&' && t[2] == '\''))
+				appendStringInfoChar(&norm, '?');
+			else
+			{
+				for (i = 0; i < end; i++)
+				{
+					if (t[i] == '"')
+						quoted = !quoted;
+					else if (!quoted &&
+							 (isspace((unsigned char) t[i]) ||
+							  (i > 0 && t[i] == '-' && t[i + 1] == '-') ||
+							  (i > 0 && t[i] == '/' && t[i + 1] == '*')))
+						break;
+					appendStringInfoChar(&norm, quoted ? t[i] :
+										 pg_ascii_tolower((unsigned char) t[i]));
+				}
+			}
+			appendStringInfoChar(&norm, ' ');
+		}
+		if (tok == 0)
+			break;
+		start = yylloc;
+	}
+	scanner_finish(yyscanner);
+
+	hash = hash_bytes_extended_compat((const unsigned char *) norm.data,
+									  norm.len);
+	pfree(norm.data);
+	return hash;
+}
+
+/*
+ * Tell the launcher how long each phase of a statement took, how many bytes
+ * of temporary files it wrote, the most memory it needed and how full the
+ * response queue was while it ran, along with the statement's ID and text.
+ * This goes through the control queue, which the launcher keeps reading while it waits
+ * for results, so it can't get stuck behind rows.
+ *
+ * A launcher that isn't reading results at all doesn't read statistics
+ * either, and they mustn't hold up the work they measure: once the control
+ * queue is full, further statistics are dropped until it has room again.
+ * A message that only partly fitted has to be finished before anything else
+ * can be sent, so we keep it until then.
+ */
+static void
+send_statement_stats(const char *command, uint64 queryid, const char *query,
+					 int64 *usecs, int64 temp_bytes, int64 peak_memory)
+{
+	StringInfo	pending = pending_stats;
+	char	   *clipped;
+	shm_mq_result res;
+	int			i;
+
+	if (worker_control_out == NULL || spool_fd >= 0)
+		return;
+
+	if (pending == NULL)
+	{
+		pending = MemoryContextAlloc(TopMemoryContext, sizeof(StringInfoData));
+		pending->data = MemoryContextAlloc(TopMemoryContext, 128);
+		pending->maxlen = 128;
+		pending->len = 0;
+		pending_stats = pending;
+	}
+
+	if (pending->len > 0)
+	{
+		res = shm_mq_send_compat(worker_control_out, pending->len,
+								 pending->data, true);
+		if (res == SHM_MQ_WOULD_BLOCK)
+			return;
+		pending->len = 0;
+		if (res == SHM_MQ_DETACHED)
+		{
+			worker_control_out = NULL;
+			return;
+		}
+	}
+
+	pending->cursor = 0;
+	appendStringInfoChar(pending, PG_BACKGROUND_CONTROL_STATS);
+	pq_sendstring(pending, command);
+	pq_sendint64(pending, (int64) queryid);
+	clipped = pnstrdup(query, pg_mbcliplen(query, strlen(query),
+										   PG_BACKGROUND_STATS_QUERY_LEN - 1));
+	pq_sendstring(pending, clipped);
+	pfree(clipped);
+	for (i = 0; i < PG_BACKGROUND_NPHASES; ++i)
+		pq_sendint64(pending, usecs[i]);
+	pq_sendint64(pending, temp_bytes);
+	pq_sendint64(pending, peak_memory);
+	for (i = 0; i <= PG_BACKGROUND_QUEUE_BUCKETS; ++i)
+		pq_sendint64(pending, queue_samples[i]);
+
+	res = shm_mq_send_compat(worker_control_out, pending->len, pending->data,
+							 true);
+	if (res == SHM_MQ_WOULD_BLOCK)
+		return;
+	pending->len = 0;
+	if (res == SHM_MQ_DETACHED)
+		worker_control_out = NULL;
+}
+
+/*
+ * Run a chunked job: execute the chunk statement over and over, each time in
+ * a transaction of its own, passing it the key at which the previous chunk
+ * stopped, until it reports that there's nothing left to do.  The key is
+ * saved in the checkpoints table in the same transaction as the chunk it
+ * belongs to, so a relaunched job picks up exactly where its last committed
+ * chunk left off.
+ *
+ * Chunk statements are plain DML, so unlike execute_sql_string we can use
+ * SPI here, which gives us parameters for free.
+ */
+static void
+execute_chunked_job(pg_background_fixed_data * fdata, const char *sql)
+{
+	MemoryContext session_context = CurrentMemoryContext;
+	char	   *checkpoints;
+	char	   *start_sql;
+	char	   *save_sql;
+	Oid			argtypes[2] = {TEXTOID, TEXTOID};
+	Datum		values[2];
+	char		nulls[2] = {' ', ' '};
+	Oid			lock_argtypes[2] = {INT4OID, INT4OID};
+	Datum		lock_values[2];
+	char	   *last_key = NULL;
+	bool		done;
+	bool		isnull;
+	int64		nchunks = 0;
+	uint64		queryid = 0;
+	StringInfoData buf;
+
+	checkpoints = quote_qualified_identifier(NameStr(fdata->checkpoint_schema),
+											 "pg_background_checkpoints");
+	start_sql = psprintf("INSERT INTO %s AS c (job_id) VALUES ($1) "
+						 "ON CONFLICT (job_id) DO UPDATE SET updated_at = c.updated_at "
+						 "RETURNING last_key, completed, lock_key",
+						 checkpoints);
+	save_sql = psprintf("UPDATE %s SET last_key = coalesce($2, last_key), "
+						"chunks = chunks + CASE WHEN $2 IS NULL THEN 0 ELSE 1 END, "
+						"completed = $2 IS NULL, updated_at = now() "
+						"WHERE job_id = $1",
+						checkpoints);
+	values[0] = CStringGetTextDatum(NameStr(fdata->job_id));
+
+	/*
+	 * Fetch the job's checkpoint, creating it if the job is new, and make
+	 * sure nobody else is running it.  Row-level security keeps us away from
+	 * other roles' jobs.  The lock is keyed on the number the checkpoints
+	 * table gave the job, which unlike a hash of its name can't be shared
+	 * with another job, and is a session lock, so we keep it across the
+	 * chunks' commits until we exit.
+	 */
+	StartTransactionCommand();
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+
+	if (SPI_execute_with_args(start_sql, 1, argtypes, values, nulls, false, 1)
+		!= SPI_OK_INSERT_RETURNING)
+		elog(ERROR, "could not read checkpoint of chunked job");
+	last_key = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1);
+	if (last_key != NULL)
+		last_key = MemoryContextStrdup(session_context, last_key);
+	done = DatumGetBool(SPI_getbinval(SPI_tuptable->vals[0],
+									  SPI_tuptable->tupdesc, 2, &isnull));
+	lock_values[0] = Int32GetDatum(PG_BACKGROUND_MAGIC);
+	lock_values[1] = SPI_getbinval(SPI_tuptable->vals[0],
+								   SPI_tuptable->tupdesc, 3, &isnull);
+
+	if (SPI_execute_with_args("SELECT pg_catalog.pg_try_advisory_lock($1, $2)",
+							  2, lock_argtypes, lock_values, NULL,
+							  true, 1) != SPI_OK_SELECT)
+		elog(ERROR, "could not lock chunked job");
+	if (!DatumGetBool(SPI_getbinval(SPI_tuptable->vals[0],
+									SPI_tuptable->tupdesc, 1, &isnull)))
+		ereport(ERROR,
+				(errcode(ERRCODE_LOCK_NOT_AVAILABLE),
+				 errmsg("chunked job \"%s\" is already running",
+						NameStr(fdata->job_id))));
+
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+
+	while (!done)
+	{
+		char	   *new_key = NULL;
+		int64		usecs[PG_BACKGROUND_NPHASES];
+		int64		temp_before = temp_bytes_written;
+		instr_time	phase_start;
+
+		CHECK_FOR_INTERRUPTS();
+		check_for_control_messages();
+
+		memset(usecs, 0, sizeof(usecs));
+		start_memory_sampling();
+		reset_queue_samples();
+
+		SetCurrentStatementStartTimestamp();
+		StartTransactionCommand();
+		allow_cancel(true);
+		SPI_connect();
+		PushActiveSnapshot(GetTransactionSnapshot());
+		if (StatementTimeout > 0)
+			enable_timeout_after(STATEMENT_TIMEOUT, StatementTimeout);
+		else
+			disable_timeout(STATEMENT_TIMEOUT, false);
+
+		/*
+		 * Process the next chunk.  SPI parses, plans and runs it in one go,
+		 * so all of its time counts as running it.
+		 */
+		values[1] = last_key ? CStringGetTextDatum(last_key) : (Datum) 0;
+		nulls[1] = last_key ? ' ' : 'n';
+		INSTR_TIME_SET_CURRENT(phase_start);
+		if (SPI_execute_with_args(sql, 1, argtypes, &values[1], &nulls[1],
+								  false, 1) < 0)
+			elog(ERROR, "could not execute chunk of job \"%s\"",
+				 NameStr(fdata->job_id));
+		usecs[PG_BACKGROUND_PHASE_PORTAL_RUN] = lap_usec(&phase_start);
+		sample_memory();
+		if (SPI_tuptable == NULL)
+			ereport(ERROR,
+					(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+					 errmsg("chunk statement must return the key to resume from")));
+		if (SPI_processed > 0)
+			new_key = SPI_getvalue(SPI_tuptable->vals[0],
+								   SPI_tuptable->tupdesc, 1);
+
+		/* Record how far we got, as part of the same transaction. */
+		values[1] = new_key ? CStringGetTextDatum(new_key) : (Datum) 0;
+		nulls[1] = new_key ? ' ' : 'n';
+		if (SPI_execute_with_args(save_sql, 2, argtypes, values, nulls,
+								  false, 0) != SPI_OK_UPDATE)
+			elog(ERROR, "could not save checkpoint of chunked job");
+
+		if (new_key != NULL)
+		{
+			last_key = MemoryContextStrdup(session_context, new_key);
+			nchunks++;
+		}
+		else
+			done = true;
+
+		disable_timeout(STATEMENT_TIMEOUT, false);
+		SPI_finish();
+		PopActiveSnapshot();
+		CommitTransactionCommand();
+		allow_cancel(false);
+		report_worker_stats(false);
+		if (!done)
+			trace_event("chunk", "committed up to key %s", last_key);
+
+		/*
+		 * Report each chunk as a statement of its own.  The first chunk has
+		 * shown the command to be valid SQL by now, so the scanner won't
+		 * trip over it.
+		 */
+		if (queryid == 0)
+			queryid = hash_normalized_statement(sql);
+		send_statement_stats("CHUNK", queryid, sql, usecs,
+							 temp_bytes_written - temp_before,
+							 statement_peak_memory);
+	}
+
+	/* Tell the launcher how many chunks this run processed. */
+	pq_beginmessage(&buf, 'C');
+	pq_sendstring(&buf, psprintf("CHUNKS " INT64_FORMAT, nchunks));
+	pq_endmessage(&buf);
+}
+
+/*
+ * Protocol output routines for the worker.  Like pqmq, we never buffer output
+ * outside shared memory, so only putmessage has any work to do.
+ */
+static void
+pg_background_comm_reset(void)
+{
+}
+
+static int
+pg_background_flush(void)
+{
+	return 0;
+}
+
+static int
+pg_background_flush_if_writable(void)
+{
+	return 0;
+}
+
+static bool
+pg_background_is_send_pending(void)
+{
+	return false;
+}
+
+/*
+ * Send a protocol message to the launching backend.
+ *
+ * Until the first message that doesn't fit, messages are collected in the
+ * inline slot of the fixed data area.  If the ReadyForQuery that ends our
+ * output fits too, the slot is published and the launcher reads it once we
+ * detach from the queue, sparing both sides the queue traffic and latch
+ * wakeups.  Errors are never held back.
+ *
+ * This is also where we notice requests from the launcher.
+ */
+static int
+pg_background_putmessage(char msgtype, const char *s, size_t len)
+{
+	if (msgtype != 'E')
+		check_for_control_messages();
+	if (queue_sample_pending)
+		sample_queue();
+
+	if (msgtype == 'N')
+		trace_event("notice", "%s", notice_message(s, len));
+	else if (msgtype == 'D' &&
+			 ++rows_since_memory_sample >= PG_BACKGROUND_MEMORY_SAMPLE_ROWS)
+		sample_memory();
+
+	/*
+	 * The follow-up SQL's output is nobody's business, nor is that of a
+	 * parallel script's statements other than the last, bar their notices.
+	 */
+	if (discard_output && msgtype != 'N')
+		return 0;
+	if (msgtype == 'C')
+		strlcpy(last_command_tag, s, sizeof(last_command_tag));
+
+	/* A spool file must describe the rows that follow. */
+	if (msgtype == 'T' && worker_fdata->orphan_policy == PG_BACKGROUND_ORPHAN_SPOOL)
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+		if (last_row_description == NULL)
+			last_row_description = makeStringInfo();
+		resetStringInfo(last_row_description);
+		appendBinaryStringInfo(last_row_description, s, len);
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	/*
+	 * Nobody will read the slot once the launcher is gone, so pass on what
+	 * it holds, to the spool file if we're to spool.
+	 */
+	if (inline_fdata != NULL && receiver_gone)
+	{
+		if (!orphan_handled)
+			handle_orphaned_worker();
+		flush_inline_messages();
+	}
+
+	if (inline_fdata != NULL)
+	{
+		if (msgtype == 'E')
+		{
+			/*
+			 * Rather than pushing what we held back through the queue, where
+			 * it might get stuck, publish the slot as it stands.  The
+			 * launcher still passes on any notices in it before the error.
+			 */
+			pg_write_barrier();
+			inline_fdata->inline_len = inline_used;
+			inline_fdata = NULL;
+			return send_to_launcher(msgtype, s, len);
+		}
+
+		if (inline_used + PG_BACKGROUND_MSG_HDRSZ + len <= PG_BACKGROUND_INLINE_SIZE)
+		{
+			char	   *p = &inline_fdata->inline_data[inline_used];
+			uint32		len32 = (uint32) len;
+
+			p[0] = msgtype;
+			memcpy(p + 1, &len32, sizeof(uint32));
+			memcpy(p + PG_BACKGROUND_MSG_HDRSZ, s, len);
+			inline_used += PG_BACKGROUND_MSG_HDRSZ + len;
+
+			if (msgtype == 'Z')
+			{
+				pg_write_barrier();
+				inline_fdata->inline_len = inline_used;
+				inline_fdata = NULL;
+			}
+			return 0;
+		}
+
+		flush_inline_messages();
+	}
+
+	return send_to_launcher(msgtype, s, len);
+}
+
+static void
+pg_background_putmessage_noblock(char msgtype, const char *s, size_t len)
+{
+	/* Same as pqmq: we have no need for this. */
+	elog(ERROR, "not currently supported");
+}
+
+#if PG_VERSION_NUM < 140000
+static void
+pg_background_startcopyout(void)
+{
+}
+
+static void
+pg_background_endcopyout(bool errorAbort)
+{
+}
+#endif
+
+/*
+ * The result turned out not to be small after all.  Send whatever we held
+ * back through the queue, so that it arrives ahead of the message that didn't
+ * fit, and stop inlining.
+ */
+static void
+flush_inline_messages(void)
+{
+	pg_background_fixed_data *fdata = inline_fdata;
+	uint32		offset = 0;
+
+	inline_fdata = NULL;
+	while (offset < inline_used)
+	{
+		char	   *p = &fdata->inline_data[offset];
+		uint32		len;
+
+		memcpy(&len, p + 1, sizeof(uint32));
+		(void) send_to_launcher(p[0], p + PG_BACKGROUND_MSG_HDRSZ, len);
+		offset += PG_BACKGROUND_MSG_HDRSZ + len;
+	}
+}
+
+/*
+ * Send a protocol message to the launcher through whichever channel suits
+ * it.  Errors go through the control queue, so that they don't have to wait
+ * behind result rows the launcher hasn't read yet.
+ */
+static int
+send_to_launcher(char msgtype, const char *s, size_t len)
+{
+	int			result;
+
+	if (msgtype == 'E')
+	{
+		worker_failing = true;
+		s = trace_error(s, &len);
+	}
+	if (receiver_gone && !orphan_handled)
+		handle_orphaned_worker();
+	if (spool_fd >= 0)
+		return spool_putmessage(msgtype, s, len);
+
+	if (msgtype == 'E' && worker_control_out != NULL)
+	{
+		shm_mq_iovec iov[2];
+
+		/* A partly sent statistics message has to be finished first. */
+		if (pending_stats != NULL && pending_stats->len > 0)
+		{
+			(void) shm_mq_send_compat(worker_control_out, pending_stats->len,
+									  pending_stats->data, false);
+			pending_stats->len = 0;
+		}
+
+		iov[0].data = &msgtype;
+		iov[0].len = 1;
+		iov[1].data = s;
+		iov[1].len = len;
+		if (shm_mq_sendv_compat(worker_control_out, iov, 2, false) == SHM_MQ_SUCCESS)
+			return 0;
+	}
+
+	if (sender_ring != NULL)
+		result = ring_putmessage(msgtype, s, len);
+	else
+		result = queue_putmessage(msgtype, s, len);
+
+	/* If the launcher went away just now, this message may need spooling. */
+	if (result == EOF && receiver_gone && !orphan_handled)
+	{
+		handle_orphaned_worker();
+		if (spool_fd >= 0)
+			return spool_putmessage(msgtype, s, len);
+	}
+
+	return result;
+}
+
+/*
+ * Send a protocol message through the result queue.  This works like pqmq's
+ * mq_putmessage, except that while waiting for the launcher to make room we
+ * keep an eye on the control queue.
+ */
+static int
+queue_putmessage(char msgtype, const char *s, size_t len)
+{
+	shm_mq_iovec iov[2];
+	shm_mq_result result;
+
+	if (worker_responseq == NULL)
+		return EOF;
+
+	/*
+	 * If an error interrupted us halfway through sending a message, the queue
+	 * can't be used any more; see mq_putmessage.
+	 */
+	if (worker_responseq_busy)
+	{
+		shm_mq_detach_compat(worker_responseq);
+		worker_responseq = NULL;
+		return EOF;
+	}
+
+	iov[0].data = &msgtype;
+	iov[0].len = 1;
+	iov[1].data = s;
+	iov[1].len = len;
+
+	worker_responseq_busy = true;
+	for (;;)
+	{
+		instr_time	start;
+		int			rc;
+
+		result = shm_mq_sendv_compat(worker_responseq, iov, 2, true);
+		if (result != SHM_MQ_WOULD_BLOCK)
+			break;
+
+		note_waiting_for_room(shm_mq_get_receiver(shm_mq_get_queue(worker_responseq)));
+		INSTR_TIME_SET_CURRENT(start);
+		rc = WaitLatch_compat(MyLatch, WL_LATCH_SET | PG_BACKGROUND_WL_POSTMASTER,
+							  0, PG_WAIT_IPC);
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+		ResetLatch(MyLatch);
+		trace_send_blocked(lap_usec(&start));
+		CHECK_FOR_INTERRUPTS();
+		check_for_control_messages();
+		sample_queue();
+	}
+	worker_responseq_busy = false;
+	worker_fdata->waiting_for_room = false;
+
+	if (result == SHM_MQ_SUCCESS)
+		queue_written += PG_BACKGROUND_MQ_FOOTPRINT(1 + len);
+	if (result == SHM_MQ_DETACHED)
+		receiver_gone = true;
+
+	return result == SHM_MQ_SUCCESS ? 0 : EOF;
+}
+
+/*
+ * We're about to wait for the launcher to make room for our output.  Say so,
+ * and wake the launcher in case it is waiting in pg_background_wait_any for
+ * one of its workers to have something to read.
+ */
+static void
+note_waiting_for_room(PGPROC *receiver)
+{
+	if (worker_fdata->waiting_for_room)
+		return;
+	worker_fdata->waiting_for_room = true;
+	pg_write_barrier();
+	if (receiver != NULL)
+		SetLatch(&receiver->procLatch);
+}
+
+/*
+ * Notice whether the launcher has stopped listening to us.  It sends nothing
+ * through our incoming control queue (cancel requests come as a signal), but
+ * detaches from it when it goes away or stops reading our result.
+ */
+static void
+check_for_control_messages(void)
+{
+	while (worker_control_in != NULL)
+	{
+		shm_mq_result res;
+		Size		nbytes;
+		void	   *data;
+
+		res = shm_mq_receive(worker_control_in, &nbytes, &data, true);
+		if (res == SHM_MQ_WOULD_BLOCK)
+			break;
+		if (res != SHM_MQ_SUCCESS)
+		{
+			/* The launcher has gone away; nobody left to ask us anything. */
+			worker_control_in = NULL;
+			receiver_gone = true;
+			if (!orphan_handled)
+				handle_orphaned_worker();
+			break;
+		}
+	}
+}
+
+/*
+ * The launcher has stopped listening to us.  Unless it detached from us on
+ * purpose, apply the orphan policy it chose: cancel, carry on regardless,
+ * or carry on and spool our output to a file.
+ */
+static void
+handle_orphaned_worker(void)
+{
+	orphan_handled = true;
+
+	pg_read_barrier();
+	if (worker_fdata->detached)
+		return;
+	trace_event("orphaned", "launcher stopped listening");
+
+	switch (worker_fdata->orphan_policy)
+	{
+		case PG_BACKGROUND_ORPHAN_CANCEL:
+
+			/*
+			 * Cancel our command as if we'd been sent SIGINT, so that this
+			 * happens at the next interrupt check and only while the command
+			 * can still be rolled back.  Raising an error right here would
+			 * do neither, and might replace the result of a committed command
+			 * with an error nobody sees.
+			 */
+			worker_fdata->orphaned = true;
+			pg_memory_barrier();
+			if (cancel_allowed)
+			{
+				InterruptPending = true;
+				QueryCancelPending = true;
+			}
+			break;
+		case PG_BACKGROUND_ORPHAN_CONTINUE:
+			break;
+		case PG_BACKGROUND_ORPHAN_SPOOL:
+			start_spool();
+			break;
+	}
+}
+
+/*
+ * Build the name of the spool file for the worker with the given PID, or of
+ * the file it writes to until its output is complete.
+ */
+static void
+spool_path(char *path, int pid, bool partial)
+{
+	snprintf(path, MAXPGPATH, "%s/%d-" INT64_FORMAT ".spool%s",
+			 PG_BACKGROUND_SPOOL_DIR, pid, (int64) PgStartTime,
+			 partial ? ".partial" : "");
+}
+
+/*
+ * Remove spool files nobody will ever read: those from before the last
+ * restart, those of an earlier worker with our PID, and those left half
+ * written by a worker that has since died.  Spool files are otherwise
+ * removed only once read, so each worker that starts spooling tidies up
+ * first; that is rare enough for scanning the whole directory not to matter.
+ */
+static void
+remove_stale_spools(void)
+{
+	DIR		   *dir;
+	struct dirent *de;
+	char		generation[32];
+	char		path[MAXPGPATH];
+
+	dir = AllocateDir(PG_BACKGROUND_SPOOL_DIR);
+	if (dir == NULL)
+		return;					/* no orphan has ever spooled */
+
+	snprintf(generation, sizeof(generation), INT64_FORMAT,
+			 (int64) PgStartTime);
+	while ((de = ReadDir(dir, PG_BACKGROUND_SPOOL_DIR)) != NULL)
+	{
+		int			pid;
+		char	   *rest;
+		bool		stale;
+
+		if (de->d_name[0] == '.')
+			continue;
+
+		pid = (int) strtol(de->d_name, &rest, 10);
+		if (*rest != '-' ||
+			strncmp(rest + 1, generation, strlen(generation)) != 0 ||
+			rest[1 + strlen(generation)] != '.')
+			stale = true;
+		else if (pid == MyProcPid)
+			stale = true;
+		else
+			stale = strstr(rest, ".partial") != NULL &&
+				BackendPidGetProc(pid) == NULL;
+
+		if (!stale)
+			continue;
+		snprintf(path, MAXPGPATH, "%s/%s", PG_BACKGROUND_SPOOL_DIR, de->d_name);
+		if (unlink(path) != 0 && errno != ENOENT)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not remove file \"%s\": %m", path)));
+	}
+	FreeDir(dir);
+}
+
+/*
+ * Remove the spool file of an earlier worker with our PID, if it was never
+ * read, so that nobody takes it for ours.  This runs whenever a worker
+ * starts, so it looks for that one file instead of scanning the directory.
+ */
+static void
+forget_spool(void)
+{
+	char		path[MAXPGPATH];
+
+	spool_path(path, MyProcPid, false);
+	if (unlink(path) != 0 && errno != ENOENT)
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not remove file \"%s\": %m", path)));
+}
+
+/*
+ * Start writing our output to a spool file, from which pg_background_result
+ * can read it in another session once we're done.  Anything the launcher
+ * left unread in the queue is lost, but we repeat the last RowDescription
+ * so that the rows that follow can be decoded.
+ *
+ * We write to a ".partial" file and rename it once our output is complete.
+ * Failures here are only logged: the worker carries on either way.
+ */
+static void
+start_spool(void)
+{
+	char		path[MAXPGPATH];
+	pg_background_spool_header hdr;
+
+	if (MakePGDirectory_compat(PG_BACKGROUND_SPOOL_DIR) < 0 && errno != EEXIST)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not create directory \"%s\": %m",
+						PG_BACKGROUND_SPOOL_DIR)));
+		return;
+	}
+	remove_stale_spools();
+
+	spool_path(path, MyProcPid, true);
+	spool_fd = BasicOpenFile_compat(path, O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY);
+	if (spool_fd < 0)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not create file \"%s\": %m", path)));
+		return;
+	}
+
+	if (spool_buffer == NULL)
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+		spool_buffer = makeStringInfo();
+		MemoryContextSwitchTo(oldcontext);
+	}
+	resetStringInfo(spool_buffer);
+	spool_bytes = 0;
+
+	hdr.magic = PG_BACKGROUND_MAGIC;
+	hdr.database_id = worker_fdata->database_id;
+	hdr.user_id = worker_fdata->current_user_id;
+	appendBinaryStringInfo(spool_buffer, (char *) &hdr, sizeof(hdr));
+	spool_bytes = sizeof(hdr);
+
+	/* Messages held back for the inline slot include the RowDescription. */
+	if (last_row_description != NULL &&
+		(inline_fdata == NULL || inline_used == 0))
+	{
+		(void) spool_putmessage('T', last_row_description->data,
+								last_row_description->len);
+		spool_repeated_description = true;
+	}
+}
+
+/*
+ * Stop spooling, and remove what we spooled so far.  The rest of our output
+ * is thrown away, as if we had been told to carry on regardless.
+ */
+static void
+abandon_spool(const char *why)
+{
+	char		path[MAXPGPATH];
+
+	spool_path(path, MyProcPid, true);
+	ereport(LOG,
+			(errmsg("background worker stopped spooling its results to \"%s\": %s",
+					path, why)));
+	close(spool_fd);
+	spool_fd = -1;
+	unlink(path);
+}
+
+/*
+ * Write out what we've buffered for the spool file.  Returns false, having
+ * abandoned the spool file, if we couldn't.
+ */
+static bool
+flush_spool(void)
+{
+	char	   *p = spool_buffer->data;
+	int			left = spool_buffer->len;
+
+	while (left > 0)
+	{
+		ssize_t		written = write(spool_fd, p, left);
+
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+		{
+			if (written == 0)
+				errno = ENOSPC;
+			abandon_spool(strerror(errno));
+			return false;
+		}
+		p += written;
+		left -= written;
+	}
+	resetStringInfo(spool_buffer);
+	return true;
+}
+
+/*
+ * Add a protocol message to the spool file.  Once our output is complete,
+ * close the file and make it visible under its final name.  If the file
+ * would grow past pg_background.spool_limit, give up on it instead.
+ */
+static int
+spool_putmessage(char msgtype, const char *s, size_t len)
+{
+	uint32		len32 = (uint32) len;
+	char		path[MAXPGPATH];
+	char		final_path[MAXPGPATH];
+
+	/*
+	 * If we started spooling on our way to sending a RowDescription, we've
+	 * just repeated it already.
+	 */
+	if (spool_repeated_description)
+	{
+		spool_repeated_description = false;
+		if (msgtype == 'T')
+			return 0;
+	}
+
+	spool_bytes += PG_BACKGROUND_MSG_HDRSZ + len;
+	if (pg_background_spool_limit >= 0 &&
+		spool_bytes > (int64) pg_background_spool_limit * 1024)
+	{
+		abandon_spool("pg_background.spool_limit exceeded");
+		return EOF;
+	}
+
+	appendStringInfoChar(spool_buffer, msgtype);
+	appendBinaryStringInfo(spool_buffer, (char *) &len32, sizeof(uint32));
+	appendBinaryStringInfo(spool_buffer, s, len);
+
+	/* ReadyForQuery or an error is the last thing we ever send. */
+	if (msgtype == 'Z' || msgtype == 'E')
+	{
+		if (!flush_spool())
+			return EOF;
+		close(spool_fd);
+		spool_fd = -1;
+		spool_path(path, MyProcPid, true);
+		spool_path(final_path, MyProcPid, false);
+		if (rename(path, final_path) != 0)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not rename file \"%s\" to \"%s\": %m",
+							path, final_path)));
+	}
+	else if (spool_buffer->len >= PG_BACKGROUND_SPOOL_BUFFER_SIZE &&
+			 !flush_spool())
+		return EOF;
+
+	return 0;
+}
+
+/*
+ * on_dsm_detach callback for the worker: stop using the queues, and
+ * everything else in the segment, before it is unmapped.  The timer, the log
+ * hook and the protocol output routines would otherwise still write there.
+ */
+static void
+cleanup_worker_queues(dsm_segment *seg, Datum arg)
+{
+	disable_timeout(queue_sample_timeout, false);
+	queue_sample_pending = false;
+	if (emit_log_hook == trace_emit_log)
+		emit_log_hook = prev_emit_log_hook;
+	whereToSendOutput = DestNone;
+	if (PqCommMethods == &pg_background_comm_methods)
+		PqCommMethods = prev_comm_methods;
+
+	worker_fdata = NULL;
+	inline_fdata = NULL;
+	sender_ring = NULL;
+	worker_responseq = NULL;
+	worker_control_in = NULL;
+	worker_control_out = NULL;
+	worker_inbound = NULL;
+}
+
+/*
+ * Initialize a ring with room for size bytes of messages.  The launching
+ * backend is always the receiver.
+ */
+static void
+ring_init(pg_background_ring * ring, Size size)
+{
+	pg_atomic_init_u64(&ring->sender.end.pos, 0);
+	pg_atomic_init_u32(&ring->sender.end.sleeping, 0);
+	pg_atomic_init_u32(&ring->sender.end.detached, 0);
+	ring->sender.end.proc = NULL;
+	pg_atomic_init_u64(&ring->receiver.end.pos, 0);
+	pg_atomic_init_u32(&ring->receiver.end.sleeping, 0);
+	pg_atomic_init_u32(&ring->receiver.end.detached, 0);
+	ring->receiver.end.proc = MyProc;
+	ring->size = size;
+}
+
+/*
+ * Write bytes to the ring, waiting for the receiver to make room as needed.
+ * Returns false if the receiver has gone away.
+ */
+static bool
+ring_send_bytes(pg_background_ring * ring, const char *data, Size len)
+{
+	pg_background_ring_end *me = &ring->sender.end;
+	pg_background_ring_end *peer = &ring->receiver.end;
+
+	while (len > 0)
+	{
+		uint64		wpos = pg_atomic_read_u64(&me->pos);
+		uint64		rpos = pg_atomic_read_u64(&peer->pos);
+		Size		offset;
+		Size		n;
+
+		if (wpos - rpos == ring->size)
+		{
+			/*
+			 * The ring is full.  The receiver may be asleep waiting for the
+			 * rest of a message larger than the ring, so nudge it before
+			 * waiting for it to make room.
+			 */
+			instr_time	start;
+			bool		alive;
+
+			note_waiting_for_room(peer->proc);
+			ring_wake(peer);
+			INSTR_TIME_SET_CURRENT(start);
+			alive = ring_wait(me, peer, rpos, NULL);
+			trace_send_blocked(lap_usec(&start));
+			if (!alive)
+				return false;
+			check_for_control_messages();
+			sample_queue();
+			continue;
+		}
+
+		offset = wpos % ring->size;
+		n = Min(len, ring->size - (Size) (wpos - rpos));
+		n = Min(n, ring->size - offset);
+		memcpy(&ring->data[offset], data, n);
+
+		/* Make the data visible before advertising it. */
+		pg_write_barrier();
+		pg_atomic_write_u64(&me->pos, wpos + n);
+
+		data += n;
+		len -= n;
+	}
+	worker_fdata->waiting_for_room = false;
+
+	return true;
+}
+
+/*
+ * Read exactly len bytes from the ring, waiting for the worker to write them
+ * as needed.  Returns false if the worker went away first.
+ */
+static bool
+ring_receive_bytes(pg_background_worker_info * info, char *dest, Size len)
+{
+	pg_background_ring *ring = info->ring;
+	pg_background_ring_end *me = &ring->receiver.end;
+	pg_background_ring_end *peer = &ring->sender.end;
+
+	while (len > 0)
+	{
+		uint64		rpos = pg_atomic_read_u64(&me->pos);
+		uint64		wpos = pg_atomic_read_u64(&peer->pos);
+		Size		offset;
+		Size		n;
+
+		if (wpos == rpos)
+		{
+			if (!ring_wait(me, peer, wpos, info->handle))
+				return false;
+			process_control_messages(info);
+			continue;
+		}
+
+		/* Don't read the data before we've seen it advertised. */
+		pg_read_barrier();
+		offset = rpos % ring->size;
+		n = Min(len, (Size) (wpos - rpos));
+		n = Min(n, ring->size - offset);
+		memcpy(dest, &ring->data[offset], n);
+
+		/* Finish reading before letting the sender overwrite the space. */
+		pg_memory_barrier();
+		pg_atomic_write_u64(&me->pos, rpos + n);
+
+		dest += n;
+		len -= n;
+
+		/* The worker might be waiting for room. */
+		ring_wake(peer);
+	}
+
+	return true;
+}
+
+/*
+ * Read the next message from the ring into msg.  Returns false once the
+ * worker has gone away and there is nothing more to read.
+ */
+static bool
+ring_receive_message(pg_background_worker_info * info, StringInfo msg)
+{
+	char		hdr[PG_BACKGROUND_MSG_HDRSZ];
+	uint32		len;
+
+	if (!ring_receive_bytes(info, hdr, PG_BACKGROUND_MSG_HDRSZ))
+		return false;
+	memcpy(&len, hdr + 1, sizeof(uint32));
+
+	resetStringInfo(msg);
+	enlargeStringInfo(msg, len + 1);
+	msg->data[0] = hdr[0];
+	if (!ring_receive_bytes(info, &msg->data[1], len))
+		return false;
+	msg->len = len + 1;
+	msg->data[msg->len] = '\0';
+
+	return true;
+}
+
+/*
+ * Sleep until the other end of the ring moves past peer_pos.  Returns false
+ * if the other end has gone away instead.  If handle is given, it is used to
+ * notice a worker that exited without ever attaching to the ring.
+ *
+ * We advertise that we're asleep before checking the other end's position
+ * one last time, and the other end advances its position before checking
+ * whether we're asleep, so between the two of us a wakeup can't be lost.
+ */
+static bool
+ring_wait(pg_background_ring_end * me, pg_background_ring_end * peer,
+		  uint64 peer_pos, BackgroundWorkerHandle *handle)
+{
+	bool		gone;
+
+	pg_atomic_write_u32(&me->sleeping, 1);
+	pg_memory_barrier();
+
+	gone = pg_atomic_read_u32(&peer->detached) != 0;
+	if (!gone && handle != NULL)
+	{
+		pid_t		pid;
+
+		gone = GetBackgroundWorkerPid(handle, &pid) == BGWH_STOPPED;
+	}
+
+	/* Anything written before the other end went away must still be read. */
+	pg_read_barrier();
+	if (pg_atomic_read_u64(&peer->pos) == peer_pos)
+	{
+		int			rc;
+
+		if (gone)
+		{
+			pg_atomic_write_u32(&me->sleeping, 0);
+			return false;
+		}
+
+		rc = WaitLatch_compat(MyLatch, WL_LATCH_SET | PG_BACKGROUND_WL_POSTMASTER,
+							  0, PG_WAIT_IPC);
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+		ResetLatch(MyLatch);
+	}
+
+	pg_atomic_write_u32(&me->sleeping, 0);
+	CHECK_FOR_INTERRUPTS();
+
+	return true;
+}
+
+/*
+ * Set the latch of the other end of the ring, but only if it is asleep.
+ */
+static void
+ring_wake(pg_background_ring_end * peer)
+{
+	pg_memory_barrier();
+	if (pg_atomic_read_u32(&peer->sleeping) != 0 && peer->proc != NULL)
+		SetLatch(&peer->proc->procLatch);
+}
+
+/*
+ * Mark our end of the ring as gone, and make sure the other end notices.
+ */
+static void
+ring_detach_end(pg_background_ring_end * me, pg_background_ring_end * peer)
+{
+	pg_atomic_write_u32(&me->detached, 1);
+	pg_memory_barrier();
+	if (peer->proc != NULL)
+		SetLatch(&peer->proc->procLatch);
+}
+
+/*
+ * on_dsm_detach callbacks for the two ends of the ring.
+ */
+static void
+ring_cleanup_sender(dsm_segment *seg, Datum arg)
+{
+	pg_background_ring *ring = (pg_background_ring *) DatumGetPointer(arg);
+
+	ring_detach_end(&ring->sender.end, &ring->receiver.end);
+	sender_ring = NULL;
+}
+
+static void
+ring_cleanup_receiver(dsm_segment *seg, Datum arg)
+{
+	pg_background_ring *ring = (pg_background_ring *) DatumGetPointer(arg);
+
+	ring_detach_end(&ring->receiver.end, &ring->sender.end);
+}
+
+/*
+ * Send a protocol message through the ring.
+ */
+static int
+ring_putmessage(char msgtype, const char *s, size_t len)
+{
+	pg_background_ring *ring = sender_ring;
+	char		hdr[PG_BACKGROUND_MSG_HDRSZ];
+	uint32		len32 = (uint32) len;
+	bool		ok;
+
+	if (ring == NULL)
+		return EOF;
+
+	/*
+	 * If an error interrupted us halfway through writing a message, the ring
+	 * now holds a partial message and can't be used any more.  Go away, so
+	 * that the launcher reports a lost connection rather than garbage.
+	 */
+	if (sender_ring_busy)
+	{
+		ring_detach_end(&ring->sender.end, &ring->receiver.end);
+		sender_ring = NULL;
+		return EOF;
+	}
+
+	if (pg_atomic_read_u32(&ring->receiver.end.detached) != 0)
+	{
+		receiver_gone = true;
+		return EOF;
+	}
+
+	sender_ring_busy = true;
+	hdr[0] = msgtype;
+	memcpy(hdr + 1, &len32, sizeof(uint32));
+	ok = ring_send_bytes(ring, hdr, PG_BACKGROUND_MSG_HDRSZ) &&
+		ring_send_bytes(ring, s, len);
+	sender_ring_busy = false;
+
+	if (!ok)
+	{
+		receiver_gone = true;
+		return EOF;
+	}
+
+	/* Batched wakeup: only bother the launcher if it's waiting for us. */
+	ring_wake(&ring->receiver.end);
+
+	return 0;
+}
+
+/*
+ * When we receive a SIGTERM, we set InterruptPending and ProcDiePending just
+ * like a normal backend.  The next CHECK_FOR_INTERRUPTS() will do the right
+ * thing.
+ */
+static void
+handle_sigterm(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	if (MyProc)
+		SetLatch(&MyProc->procLatch);
+
+	if (!proc_exit_inprogress)
+	{
+		InterruptPending = true;
 		ProcDiePending = true;
 	}
 
 	errno = save_errno;
 }
+
+/*
+ * SIGINT, which is how pg_background_cancel and pg_cancel_backend reach us,
+ * cancels our command just like StatementCancelHandler would, but only while
+ * the command's transaction is open.  Once it has committed, it's too late
+ * to take the work back, and an error then would only hide the result.
+ */
+static void
+handle_sigint(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	if (cancel_allowed && !proc_exit_inprogress)
+	{
+		InterruptPending = true;
+		QueryCancelPending = true;
+	}
+	if (MyProc)
+		SetLatch(&MyProc->procLatch);
+
+	errno = save_errno;
+}
+
+/*
+ * Open or close the window in which our command may be canceled.  A request
+ * the launcher made before the window opened takes effect right away; one
+ * that is still pending when it closes is dropped, as a backend drops one
+ * that arrives while it waits for its next command.
+ */
+static void
+allow_cancel(bool allow)
+{
+	cancel_allowed = allow;
+	if (allow)
+	{
+		pg_memory_barrier();
+		if (worker_fdata->cancel_requested || worker_fdata->orphaned ||
+			cpu_limit_exceeded)
+		{
+			InterruptPending = true;
+			QueryCancelPending = true;
+		}
+	}
+	else
+		QueryCancelPending = false;
+}
+
+/*
+ * If the error being thrown cancels our command because the launcher asked
+ * us to, because the command used up its CPU time, or because the launcher
+ * went away while we were to be canceled if it did, say so, rather than
+ * blaming a user request.  Otherwise just return, leaving the error to be
+ * rethrown as it is.
+ */
+static void
+rethrow_cancel_error(void)
+{
+	MemoryContext oldcontext;
+	ErrorData  *edata;
+	bool		requested;
+
+	pg_read_barrier();
+	requested = worker_fdata->cancel_requested;
+	if (!requested && !cpu_limit_exceeded && !worker_fdata->orphaned)
+		return;
+
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	edata = CopyErrorData();
+	MemoryContextSwitchTo(oldcontext);
+	if (edata->sqlerrcode != ERRCODE_QUERY_CANCELED)
+	{
+		FreeErrorData(edata);
+		return;
+	}
+
+	FlushErrorState();
+	if (requested)
+	{
+		trace_event("cancel", "requested by launcher");
+		edata->message = pstrdup("canceling background worker due to request from launching process");
+	}
+	else if (cpu_limit_exceeded)
+		report_cpu_limit(edata);
+	else
+		edata->message = pstrdup("canceling background worker because its launching process went away");
+	ReThrowError(edata);
+}
+
+/*
+ * Arm a timer that goes off once we have used up pg_background.cpu_limit of
+ * CPU time.  The kernel keeps count, so this costs nothing until then.
+ */
+static void
+start_cpu_limit(void)
+{
+#ifndef WIN32
+	struct itimerval timer;
+#endif
+
+	if (pg_background_cpu_limit <= 0)
+		return;
+
+#ifdef WIN32
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("pg_background.cpu_limit is not supported on this platform")));
+#else
+	getrusage(RUSAGE_SELF, &cpu_limit_start);
+	pqsignal(SIGPROF, handle_sigprof);
+
+	memset(&timer, 0, sizeof(timer));
+	timer.it_value.tv_sec = pg_background_cpu_limit / 1000;
+	timer.it_value.tv_usec = (pg_background_cpu_limit % 1000) * 1000;
+	if (setitimer(ITIMER_PROF, &timer, NULL) != 0)
+		elog(ERROR, "could not set CPU time limit: %m");
+#endif
+}
+
+/*
+ * Disarm the CPU time limit timer, if we set it, and forget that it went
+ * off: once the command is over, there's nothing left to cancel.
+ */
+static void
+stop_cpu_limit(void)
+{
+#ifndef WIN32
+	struct itimerval timer;
+
+	if (pg_background_cpu_limit <= 0)
+		return;
+
+	memset(&timer, 0, sizeof(timer));
+	(void) setitimer(ITIMER_PROF, &timer, NULL);
+	if (cpu_limit_exceeded)
+	{
+		cpu_limit_exceeded = false;
+		QueryCancelPending = false;
+	}
+#endif
+}
+
+#ifndef WIN32
+/*
+ * Signal handler for SIGPROF, which we get once our command has used up its
+ * CPU time.  Cancel it just as statement_timeout would, as soon as it may be
+ * canceled; rethrow_cancel_error turns the error into a more helpful one.
+ */
+static void
+handle_sigprof(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	cpu_limit_exceeded = true;
+	if (cancel_allowed)
+	{
+		QueryCancelPending = true;
+		InterruptPending = true;
+	}
+	if (MyProc)
+		SetLatch(&MyProc->procLatch);
+
+	errno = save_errno;
+}
+#endif
+
+/*
+ * Explain that the query was canceled because it used too much CPU time,
+ * and how much it used.
+ */
+static void
+report_cpu_limit(ErrorData *edata)
+{
+#ifndef WIN32
+	double		user_ms;
+	double		system_ms;
+
+	(void) cpu_limit_used(&user_ms, &system_ms);
+	edata->message = pstrdup("canceling background worker due to CPU time limit");
+	edata->detail = psprintf("The command used %.3f ms of CPU time "
+							 "(%.3f ms user, %.3f ms system), "
+							 "and pg_background.cpu_limit is %d ms.",
+							 user_ms + system_ms, user_ms, system_ms,
+							 pg_background_cpu_limit);
+	edata->hint = pstrdup("You may need to increase pg_background.cpu_limit.");
+	trace_event("cpu limit", "%.3f ms used", user_ms + system_ms);
+#endif
+}
+
+#ifndef WIN32
+/*
+ * Return the CPU time we have used since pg_background.cpu_limit was armed,
+ * in milliseconds, also splitting it into user and system time if asked.
+ */
+static double
+cpu_limit_used(double *user_ms, double *system_ms)
+{
+	struct rusage usage;
+	double		user;
+	double		system;
+
+	getrusage(RUSAGE_SELF, &usage);
+	user = (usage.ru_utime.tv_sec - cpu_limit_start.ru_utime.tv_sec) * 1000.0 +
+		(usage.ru_utime.tv_usec - cpu_limit_start.ru_utime.tv_usec) / 1000.0;
+	system = (usage.ru_stime.tv_sec - cpu_limit_start.ru_stime.tv_sec) * 1000.0 +
+		(usage.ru_stime.tv_usec - cpu_limit_start.ru_stime.tv_usec) / 1000.0;
+
+	if (user_ms != NULL)
+		*user_ms = user;
+	if (system_ms != NULL)
+		*system_ms = system;
+	return user + system;
+}
+#endif
+
+/*
+ * pg_background.temp_limit is enforced by lowering temp_file_limit, which
+ * caps the temporary file space a backend has in use at any one time, not
+ * the total it writes.
+ */
+static void
+apply_temp_limit(void)
+{
+	if (pg_background_temp_limit >= 0 &&
+		(temp_file_limit < 0 || pg_background_temp_limit <= temp_file_limit))
+	{
+		char		buf[32];
+
+		snprintf(buf, sizeof(buf), "%d", pg_background_temp_limit);
+		SetConfigOption("temp_file_limit", buf, PGC_SUSET, PGC_S_OVERRIDE);
+		temp_limit_applies = true;
+	}
+}
+
+/*
+ * The size of the temporary files we have deleted since our database
+ * statistics were last flushed, as they will be added to
+ * pg_stat_database.temp_bytes.  The server counts every file as it deletes
+ * it, whatever log_temp_files says, as long as track_counts is on.  Before
+ * PostgreSQL 15, it told the statistics collector about each file straight
+ * away, keeping no count of its own, so this is always 0.
+ */
+static int64
+pending_temp_bytes(void)
+{
+#if PG_VERSION_NUM >= 150000
+	PgStat_EntryRef *entry_ref;
+
+	entry_ref = pgstat_fetch_pending_entry(PGSTAT_KIND_DATABASE,
+										   MyDatabaseId, InvalidOid);
+	if (entry_ref != NULL)
+		return ((PgStat_StatDBEntry *) entry_ref->pending)->temp_bytes;
+#endif
+	return 0;
+}
+
+/*
+ * Add the temporary file bytes counted since we last looked to
+ * temp_bytes_written.
+ */
+static void
+account_temp_bytes(void)
+{
+	int64		pending = pending_temp_bytes();
+
+	/* Statistics flushed behind our back start over from zero. */
+	if (pending < temp_bytes_seen)
+		temp_bytes_seen = 0;
+	if (pending > temp_bytes_seen)
+	{
+		trace_event("temp files", INT64_FORMAT " bytes",
+					pending - temp_bytes_seen);
+		temp_bytes_written += pending - temp_bytes_seen;
+		temp_bytes_seen = pending;
+	}
+}
+
+/*
+ * Flush our statistics, counting the temporary file bytes about to go out
+ * with them first.
+ */
+static void
+report_worker_stats(bool force)
+{
+	account_temp_bytes();
+	pgstat_report_stat(force);
+	temp_bytes_seen = pending_temp_bytes();
+}
+
+/*
+ * If the error being thrown is temp_file_limit running out while it is set
+ * to our pg_background.temp_limit, say so.  Otherwise just return, leaving
+ * the error to be rethrown as it is.
+ */
+static void
+rethrow_temp_limit_error(void)
+{
+	MemoryContext oldcontext;
+	ErrorData  *edata;
+
+	if (!temp_limit_applies)
+		return;
+
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	edata = CopyErrorData();
+	MemoryContextSwitchTo(oldcontext);
+	if (edata->message_id == NULL ||
+		strcmp(edata->message_id, TEMP_FILE_LIMIT_MESSAGE) != 0)
+	{
+		FreeErrorData(edata);
+		return;
+	}
+
+	FlushErrorState();
+	report_temp_limit(edata);
+	ReThrowError(edata);
+}
+
+/*
+ * Explain that the temporary file space that ran out was ours to set.
+ */
+static void
+report_temp_limit(ErrorData *edata)
+{
+	edata->message = psprintf("temporary file size exceeds pg_background.temp_limit (%dkB)",
+							  pg_background_temp_limit);
+	edata->hint = pstrdup("You may need to increase pg_background.temp_limit.");
+	trace_event("temp limit", "%dkB", pg_background_temp_limit);
+}
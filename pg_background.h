@@ -41,4 +41,149 @@
 	pg_analyze_and_rewrite((parse), (string), (types), (num))
 #endif
 
+#if PG_VERSION_NUM >= 150000
+#define MarkGUCPrefixReserved_compat(prefix) MarkGUCPrefixReserved(prefix)
+#else
+#define MarkGUCPrefixReserved_compat(prefix) EmitWarningsOnPlaceholders(prefix)
+#endif
+
+#if PG_VERSION_NUM >= 120000
+#define PG_BACKGROUND_WL_POSTMASTER	WL_EXIT_ON_PM_DEATH
+#else
+#define PG_BACKGROUND_WL_POSTMASTER	WL_POSTMASTER_DEATH
+#endif
+
+#if PG_VERSION_NUM >= 100000
+#define WaitLatch_compat(latch, events, timeout, info) \
+	WaitLatch((latch), (events), (timeout), (info))
+#else
+#define WaitLatch_compat(latch, events, timeout, info) \
+	WaitLatch((latch), (events), (timeout))
+#endif
+
+#if PG_VERSION_NUM >= 150000
+#define shm_mq_send_compat(mqh, nbytes, data, nowait) \
+	shm_mq_send((mqh), (nbytes), (data), (nowait), true)
+#define shm_mq_sendv_compat(mqh, iov, iovcnt, nowait) \
+	shm_mq_sendv((mqh), (iov), (iovcnt), (nowait), true)
+#else
+#define shm_mq_send_compat(mqh, nbytes, data, nowait) \
+	shm_mq_send((mqh), (nbytes), (data), (nowait))
+#define shm_mq_sendv_compat(mqh, iov, iovcnt, nowait) \
+	shm_mq_sendv((mqh), (iov), (iovcnt), (nowait))
+#endif
+
+#if PG_VERSION_NUM >= 100000
+#define shm_mq_detach_compat(mqh) shm_mq_detach(mqh)
+#else
+#define shm_mq_detach_compat(mqh) shm_mq_detach(shm_mq_get_queue(mqh))
+#endif
+
+#if PG_VERSION_NUM >= 110000
+#define MakePGDirectory_compat(path) MakePGDirectory(path)
+#define BasicOpenFile_compat(path, flags) BasicOpenFile((path), (flags))
+#else
+#define MakePGDirectory_compat(path) mkdir((path), S_IRWXU)
+#define BasicOpenFile_compat(path, flags) \
+	BasicOpenFile((char *) (path), (flags), S_IRUSR | S_IWUSR)
+#endif
+
+/* Before autoprewarm came along, there was no telling. */
+#if PG_VERSION_NUM >= 110000
+#define have_free_buffer_compat() have_free_buffer()
+#else
+#define have_free_buffer_compat() true
+#endif
+
+/* Roles that can write files on the server, such as spool files. */
+#if PG_VERSION_NUM >= 110000
+#define may_write_server_files_compat() \
+	has_privs_of_role(GetUserId(), ROLE_PG_WRITE_SERVER_FILES)
+#else
+#define may_write_server_files_compat() superuser()
+#endif
+
+/* Query IDs are computed on request from PostgreSQL 14 on. */
+#if PG_VERSION_NUM >= 140000
+#define EnableQueryId_compat() EnableQueryId()
+#else
+#define EnableQueryId_compat() ((void) 0)
+#endif
+
+#if PG_VERSION_NUM >= 120000
+#define scanner_init_compat(str, yyext) \
+	scanner_init((str), (yyext), &ScanKeywords, ScanKeywordTokens)
+#else
+#define scanner_init_compat(str, yyext) \
+	scanner_init((str), (yyext), ScanKeywords, NumScanKeywords)
+#endif
+
+#if PG_VERSION_NUM >= 120000
+#define hash_bytes_extended_compat(k, keylen) \
+	hash_bytes_extended((k), (keylen), 0)
+#elif PG_VERSION_NUM >= 110000
+#define hash_bytes_extended_compat(k, keylen) \
+	DatumGetUInt64(hash_any_extended((k), (keylen), 0))
+#else
+#define hash_bytes_extended_compat(k, keylen) \
+	((uint64) DatumGetUInt32(hash_any((k), (keylen))))
+#endif
+
+#if PG_VERSION_NUM >= 120000
+#define CreateTemplateTupleDesc_compat(natts) CreateTemplateTupleDesc(natts)
+#else
+#define CreateTemplateTupleDesc_compat(natts) CreateTemplateTupleDesc((natts), false)
+#endif
+
+#if PG_VERSION_NUM >= 110000
+#define aclcheck_error_relation_compat(result, rel) \
+	aclcheck_error((result), get_relkind_objtype((rel)->rd_rel->relkind), \
+				   RelationGetRelationName(rel))
+#else
+#define aclcheck_error_relation_compat(result, rel) \
+	aclcheck_error((result), ACL_KIND_CLASS, RelationGetRelationName(rel))
+#endif
+
+#if PG_VERSION_NUM >= 180000
+#define ExecInitRangeTable_compat(estate, rtable, perminfos) \
+	ExecInitRangeTable((estate), (rtable), (perminfos), \
+					   bms_add_range(NULL, 1, list_length(rtable)))
+#elif PG_VERSION_NUM >= 160000
+#define ExecInitRangeTable_compat(estate, rtable, perminfos) \
+	ExecInitRangeTable((estate), (rtable), (perminfos))
+#else
+#define ExecInitRangeTable_compat(estate, rtable, perminfos) \
+	ExecInitRangeTable((estate), (rtable))
+#endif
+
+#if PG_VERSION_NUM >= 160000
+#define ExecInsertIndexTuples_compat(rri, slot, estate) \
+	ExecInsertIndexTuples((rri), (slot), (estate), false, false, NULL, NIL, false)
+#elif PG_VERSION_NUM >= 140000
+#define ExecInsertIndexTuples_compat(rri, slot, estate) \
+	ExecInsertIndexTuples((rri), (slot), (estate), false, false, NULL, NIL)
+#else
+#define ExecInsertIndexTuples_compat(rri, slot, estate) \
+	ExecInsertIndexTuples((slot), (estate), false, NULL, NIL)
+#endif
+
+#if PG_VERSION_NUM >= 140000
+#define ExecComputeStoredGenerated_compat(rri, estate, slot) \
+	ExecComputeStoredGenerated((rri), (estate), (slot), CMD_INSERT)
+#elif PG_VERSION_NUM >= 130000
+#define ExecComputeStoredGenerated_compat(rri, estate, slot) \
+	ExecComputeStoredGenerated((estate), (slot), CMD_INSERT)
+#else
+#define ExecComputeStoredGenerated_compat(rri, estate, slot) \
+	ExecComputeStoredGenerated((estate), (slot))
+#endif
+
+/* Memory use isn't tracked before PostgreSQL 13. */
+#if PG_VERSION_NUM >= 130000
+#define MemoryContextMemAllocated_compat(context) \
+	MemoryContextMemAllocated((context), true)
+#else
+#define MemoryContextMemAllocated_compat(context) ((Size) 0)
+#endif
+
 #endif			/* PG_BACKGROUND_H_ */
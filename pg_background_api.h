@@ -0,0 +1,97 @@
+/*--------------------------------------------------------------------------
+ *
+ * pg_background_api.h
+ *		C interface for other extensions to run SQL in background workers.
+ *
+ * Extensions can use pg_background's workers directly, without going
+ * through pg_background_launch and pg_background_result and so without
+ * converting the result rows to and from records or text.  The functions
+ * are reached through a PgBackgroundAPI struct, found either with
+ *
+ *		PgBackgroundAPI **api = (PgBackgroundAPI **)
+ *			find_rendezvous_variable(PG_BACKGROUND_API_RENDEZVOUS);
+ *
+ * once pg_background is loaded, or with
+ *
+ *		pg_background_get_api_fn get_api = (pg_background_get_api_fn)
+ *			load_external_function("pg_background", "pg_background_get_api",
+ *								   true, NULL);
+ *
+ * which loads it if need be.  Callers should check that the version
+ * member is at least the PG_BACKGROUND_API_VERSION they were built with.
+ *
+ * Tasks work just like workers started with pg_background_launch: they run
+ * with the caller's user ID and settings, their result must be fetched (or
+ * waited for) by the backend that launched them, and errors and notices
+ * they raise are rethrown in that backend while it does so.
+ *
+ * Copyright (C) 2014, PostgreSQL Global Development Group
+ *
+ * IDENTIFICATION
+ *		contrib/pg_background/pg_background_api.h
+ *
+ * -------------------------------------------------------------------------
+ */
+#ifndef PG_BACKGROUND_API_H_
+#define PG_BACKGROUND_API_H_
+
+#include "access/tupdesc.h"
+
+#define PG_BACKGROUND_API_VERSION		1
+#define PG_BACKGROUND_API_RENDEZVOUS	"pg_background_api"
+
+/* A task running in a background worker; opaque to callers. */
+typedef struct PgBackgroundTask PgBackgroundTask;
+
+/*
+ * Callbacks invoked while fetching a task's result.  Either may be NULL.
+ * values and isnull have one entry per attribute of the tuple descriptor
+ * passed to fetch, and are only valid until the callback returns.
+ */
+typedef struct PgBackgroundCallbacks
+{
+	void		(*row) (void *arg, Datum *values, bool *isnull);
+	void		(*command_complete) (void *arg, const char *tag);
+} PgBackgroundCallbacks;
+
+typedef struct PgBackgroundAPI
+{
+	int			version;
+
+	/*
+	 * Start a worker running sql, with a result queue of queue_size bytes,
+	 * and return once it has started.  The task is allocated in the current
+	 * memory context.
+	 */
+	PgBackgroundTask *(*launch) (const char *sql, int32 queue_size);
+
+	/* The PID of the task's worker, as pg_background_launch would return. */
+	int32		(*pid) (PgBackgroundTask *task);
+
+	/*
+	 * Read the task's result, decoding the rows of its last statement as
+	 * tupdesc describes and passing them to callbacks->row, and return the
+	 * number of rows.  tupdesc may be NULL if the rows aren't wanted.  The
+	 * task can't be used again afterwards.
+	 */
+	int64		(*fetch) (PgBackgroundTask *task, TupleDesc tupdesc,
+						  const PgBackgroundCallbacks *callbacks, void *arg);
+
+	/* Wait for the task to finish, throwing away its result. */
+	int64		(*wait) (PgBackgroundTask *task);
+
+	/*
+	 * Ask the task to cancel its command, as pg_background_cancel does.
+	 * Its result must still be fetched or waited for to see the outcome.
+	 */
+	bool		(*cancel) (PgBackgroundTask *task);
+
+	/* Let the task run on without us, as pg_background_detach does. */
+	void		(*detach) (PgBackgroundTask *task);
+} PgBackgroundAPI;
+
+typedef const PgBackgroundAPI *(*pg_background_get_api_fn) (void);
+
+extern PGDLLEXPORT const PgBackgroundAPI *pg_background_get_api(void);
+
+#endif			/* PG_BACKGROUND_API_H_ */
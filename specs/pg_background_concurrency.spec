@@ -0,0 +1,64 @@
+# Races between sessions launching, reading, detaching from and cancelling
+# background workers.  Worker PIDs differ from run to run, so steps that are
+# expected to fail go through bg_try, which reports just the SQLSTATE.
+
+setup
+{
+  CREATE EXTENSION pg_background;
+  CREATE TABLE bg_pids (session text PRIMARY KEY, pid int);
+  CREATE FUNCTION bg_try(sql text) RETURNS text LANGUAGE plpgsql AS $$
+  BEGIN
+    EXECUTE sql;
+    RETURN 'ok';
+  EXCEPTION WHEN OTHERS OR query_canceled THEN
+    RETURN SQLSTATE;
+  END $$;
+}
+
+teardown
+{
+  DROP FUNCTION bg_try(text);
+  DROP TABLE bg_pids;
+  DROP EXTENSION pg_background;
+}
+
+session s1
+step s1_launch		{ SELECT set_config('bg.pid', pg_background_launch('SELECT pg_sleep(0.1); SELECT ''s1''::text')::text, false) IS NOT NULL AS launched; }
+step s1_quick		{ SELECT set_config('bg.pid', pg_background_launch('SELECT ''s1''::text')::text, false) IS NOT NULL AS launched; }
+step s1_flood		{ SELECT set_config('bg.pid', pg_background_launch('SELECT g::text FROM generate_series(1, 1000000) g', 16384)::text, false) IS NOT NULL AS launched; }
+step s1_share		{ INSERT INTO bg_pids VALUES ('s1', current_setting('bg.pid')::int); }
+step s1_result		{ SELECT * FROM pg_background_result(current_setting('bg.pid')::int) AS (r text); }
+step s1_try_result	{ SELECT bg_try('SELECT * FROM pg_background_result(' || current_setting('bg.pid') || ') AS (r text)') AS outcome; }
+step s1_detach		{ SELECT bg_try('SELECT pg_background_detach(' || current_setting('bg.pid') || ')') AS outcome; }
+step s1_cancel		{ SELECT pg_background_cancel(current_setting('bg.pid')::int) AS cancelled; }
+
+session s2
+step s2_launch		{ SELECT set_config('bg.pid', pg_background_launch('SELECT pg_sleep(0.1); SELECT ''s2''::text')::text, false) IS NOT NULL AS launched; }
+step s2_result		{ SELECT * FROM pg_background_result(current_setting('bg.pid')::int) AS (r text); }
+step s2_steal		{ SELECT bg_try('SELECT * FROM pg_background_result(' || pid || ') AS (r text)') AS outcome FROM bg_pids WHERE session = 's1'; }
+step s2_cancel_other	{ SELECT bg_try('SELECT pg_background_cancel(' || pid || ')') AS outcome FROM bg_pids WHERE session = 's1'; }
+step s2_detach_other	{ SELECT bg_try('SELECT pg_background_detach(' || pid || ')') AS outcome FROM bg_pids WHERE session = 's1'; }
+
+session s3
+step s3_launch		{ SELECT set_config('bg.pid', pg_background_launch('SELECT pg_sleep(0.1); SELECT ''s3''::text')::text, false) IS NOT NULL AS launched; }
+step s3_result		{ SELECT * FROM pg_background_result(current_setting('bg.pid')::int) AS (r text); }
+
+# Workers of several sessions running at once, read in a different order.
+permutation s1_launch s2_launch s3_launch s3_result s2_result s1_result
+
+# Detaching from a worker that may or may not have exited already, and from
+# one whose results have been read; either way the results are gone after.
+permutation s1_quick s1_detach s1_try_result
+permutation s1_launch s1_result s1_detach s1_try_result
+
+# Detaching from a worker blocked on a full queue leaves others unaffected.
+permutation s1_flood s1_detach s2_launch s2_result
+
+# A cancel request gets through while the worker waits for queue space.
+permutation s1_flood s1_cancel s1_try_result
+
+# Another session can't read, cancel or detach our worker by its PID, nor
+# can anyone use a PID whose results have been read, even if a new worker
+# has been started since.
+permutation s1_launch s1_share s2_steal s2_cancel_other s2_detach_other s1_result
+permutation s1_launch s1_share s1_result s2_launch s2_steal s2_result
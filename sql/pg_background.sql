@@ -5,3 +5,442 @@ CREATE TABLE t(id integer);
 SELECT * FROM pg_background_result(pg_background_launch('INSERT INTO t SELECT 1')) AS (result TEXT);
 
 SELECT * FROM t;
+
+CREATE TABLE t2(id integer, val text);
+
+SELECT pg_background_result_into(pg_background_launch('SELECT g, g::text FROM generate_series(1, 1500) g'), 't2');
+
+SELECT count(*), sum(id), max(val) FROM t2;
+
+SET pg_background.result_format = 'text';
+
+SELECT * FROM pg_background_result(pg_background_launch('SELECT 1::int, ''two''::text, NULL::numeric')) AS (a int, b text, c numeric);
+
+-- The client sees the worker's rows as the result of CALL.
+SELECT pg_background_launch('SELECT g AS n, repeat(''x'', g) AS xs, NULLIF(g, 2) AS maybe FROM generate_series(1, 3) g') AS pid \gset
+CALL pg_background_stream(:pid);
+
+RESET pg_background.result_format;
+
+SET pg_background.transport = 'ring';
+
+SELECT pg_background_result_into(pg_background_launch('SELECT g, repeat(''x'', 100) FROM generate_series(1, 2000) g', 1024), 't2');
+
+SELECT count(*), sum(id) FROM t2;
+
+RESET pg_background.transport;
+
+DO $$
+DECLARE
+  pid int4;
+BEGIN
+  pid := pg_background_launch('SELECT g FROM generate_series(1, 100000) g', 16384);
+  PERFORM pg_background_cancel(pid);
+  PERFORM * FROM pg_background_result(pid) AS (g int);
+EXCEPTION WHEN query_canceled THEN
+  RAISE NOTICE 'background worker canceled';
+END;
+$$;
+
+CREATE TABLE t3(id integer);
+
+SELECT pg_background_stats_reset();
+SELECT * FROM pg_background_result(pg_background_launch_chunked('fill_t3', $$
+  WITH ins AS (
+    INSERT INTO t3
+    SELECT g FROM generate_series(coalesce($1::int, 0) + 1, least(coalesce($1::int, 0) + 100, 450)) g
+    RETURNING id)
+  SELECT max(id)::text FROM ins
+$$)) AS (result TEXT);
+
+SELECT count(*), max(id) FROM t3;
+
+SELECT job_id, last_key, chunks, completed FROM pg_background_checkpoints;
+
+-- Each chunk, including the last one that found nothing to do, counts once.
+SELECT command, calls, portal_run_ms > 0 AS ok FROM pg_background_stats();
+
+-- A finished job has nothing left to do.
+SELECT * FROM pg_background_result(pg_background_launch_chunked('fill_t3', 'SELECT NULL::text')) AS (result TEXT);
+
+-- Another role can neither see nor take over someone else's job.
+CREATE ROLE regress_pg_background_other;
+SELECT grant_pg_background_privileges('regress_pg_background_other');
+SET ROLE regress_pg_background_other;
+SELECT count(*) FROM pg_background_checkpoints;
+DO $$
+BEGIN
+  PERFORM * FROM pg_background_result(pg_background_launch_chunked('fill_t3', 'SELECT NULL::text')) AS (result TEXT);
+EXCEPTION WHEN insufficient_privilege THEN
+  RAISE NOTICE 'job belongs to another role';
+END;
+$$;
+SET pg_background.orphan_policy = 'continue_and_spool';
+DO $$
+BEGIN
+  PERFORM pg_background_launch('SELECT 1');
+EXCEPTION WHEN insufficient_privilege THEN
+  RAISE NOTICE 'role may not spool';
+END;
+$$;
+RESET pg_background.orphan_policy;
+RESET ROLE;
+SELECT revoke_pg_background_privileges('regress_pg_background_other');
+DROP ROLE regress_pg_background_other;
+
+SELECT metric, unit, value >= 0 AS ok FROM pg_background_selfbench(1, 10, 100);
+
+SELECT pg_background_stats_reset();
+SELECT * FROM pg_background_result(pg_background_launch('SET work_mem = ''8MB''; SELECT 1; SELECT 2')) AS (result int);
+SELECT command, calls, parse_ms >= 0 AND plan_ms >= 0 AND portal_run_ms >= send_blocked_ms AS ok
+  FROM pg_background_stats() ORDER BY command;
+-- Statements are told apart by more than their command tag, but not by their
+-- constants, whether or not there are query IDs.
+SELECT pg_background_stats_reset();
+SELECT * FROM pg_background_result(pg_background_launch('SELECT 1; select  2 /* two */; SELECT 3 WHERE true')) AS (result int);
+SET compute_query_id = off;
+SELECT * FROM pg_background_result(pg_background_launch('SELECT 1; select  2 /* two */; SELECT 3 WHERE true')) AS (result int);
+RESET compute_query_id;
+SELECT command, query, calls FROM pg_background_stats() ORDER BY query, calls;
+
+CREATE TABLE t4 AS SELECT i FROM generate_series(1, 5000) i;
+INSERT INTO pg_background_hot_blocks VALUES ('t4', 3), ('t4', 1000);
+SELECT pg_background_prewarm(ARRAY['t4'::regclass], 3) =
+       pg_relation_size('t4') / current_setting('block_size')::int8 AS all_loaded;
+SELECT pg_background_prewarm_blocks('t4', 0, 10, true) AS hot,
+       pg_background_prewarm_blocks('t4', 0, 10, false) AS others;
+
+CALL pg_background_verify('everything');
+
+-- Whichever worker is ready first is collected first.
+DO $$
+DECLARE
+  slow int := pg_background_launch('SELECT 2 FROM pg_sleep(1)');
+  fast int := pg_background_launch('SELECT 1');
+BEGIN
+  RAISE NOTICE 'first ready: %',
+    CASE pg_background_wait_any(ARRAY[slow, fast]) WHEN fast THEN 'fast' ELSE 'slow' END;
+  PERFORM * FROM pg_background_result(fast) AS (r int);
+  PERFORM * FROM pg_background_result(slow) AS (r int);
+END;
+$$;
+
+-- A healthy database has nothing to report.
+CREATE EXTENSION amcheck;
+CALL pg_background_verify('indexes', 2);
+SELECT count(*) AS problems FROM pg_background_verify_problems;
+
+CREATE TABLE t5a AS SELECT i AS id, md5(i::text) AS v FROM generate_series(1, 3000) i;
+CREATE TABLE t5b AS SELECT * FROM t5a;
+DELETE FROM t5b WHERE id = 10;
+UPDATE t5b SET v = 'changed' WHERE id = 2000;
+INSERT INTO t5b VALUES (5000, 'new');
+ANALYZE t5a, t5b;
+SELECT * FROM pg_background_table_diff('t5a', 't5b', 'id', 2, 100) ORDER BY key_value::int;
+
+CREATE TABLE t6p (id int PRIMARY KEY);
+INSERT INTO t6p SELECT generate_series(1, 10);
+CREATE TABLE t6 (id int, p int);
+INSERT INTO t6 VALUES (1, 1), (2, 20);
+ALTER TABLE t6 ADD CONSTRAINT t6_p_fkey FOREIGN KEY (p) REFERENCES t6p NOT VALID;
+ALTER TABLE t6 ADD CONSTRAINT t6_id_check CHECK (id > 0) NOT VALID;
+SELECT relation, constraint_name, duration IS NOT NULL AS timed, result
+  FROM pg_background_validate_constraints(ARRAY['t6'::regclass]) ORDER BY constraint_name;
+
+CREATE TABLE t7 (id int, v text) PARTITION BY RANGE (id);
+CREATE TABLE t7_1 PARTITION OF t7 FOR VALUES FROM (1) TO (1001);
+CREATE TABLE t7_2 PARTITION OF t7 FOR VALUES FROM (1001) TO (2001);
+CREATE TABLE t7_3 PARTITION OF t7 FOR VALUES FROM (2001) TO (3001);
+SELECT pg_background_insert_partitioned('t7', 'SELECT i, i::text FROM generate_series(1, 3000) i', 2);
+SELECT tableoid::regclass, count(*), count(*) FILTER (WHERE v = id::text) AS ok
+  FROM t7 GROUP BY 1 ORDER BY 1;
+
+-- A worker whose notices fill its queue while we are still sending it rows
+-- doesn't hold us up.
+CREATE FUNCTION t7_chatty() RETURNS trigger LANGUAGE plpgsql
+  SET client_min_messages = notice
+  AS $$ BEGIN RAISE NOTICE 'inserting row %', NEW.id; RETURN NEW; END; $$;
+CREATE TRIGGER t7_chatty BEFORE INSERT ON t7 FOR EACH ROW EXECUTE FUNCTION t7_chatty();
+SET client_min_messages = warning;
+SELECT pg_background_insert_partitioned('t7', 'SELECT i, i::text FROM generate_series(1, 3000) i', 2);
+RESET client_min_messages;
+DROP TRIGGER t7_chatty ON t7;
+DROP FUNCTION t7_chatty();
+SELECT count(*) FROM t7;
+-- A partition's columns needn't be in the same order as its parent's.
+CREATE TABLE t7_4 (v text, id int);
+ALTER TABLE t7 ATTACH PARTITION t7_4 FOR VALUES FROM (3001) TO (4001);
+SELECT pg_background_insert_partitioned('t7', 'SELECT i, i::text FROM generate_series(2901, 3100) i', 2);
+SELECT tableoid::regclass, count(*), count(*) FILTER (WHERE v = id::text) AS ok
+  FROM t7 WHERE id > 3000 GROUP BY 1;
+-- Foreign keys are checked once the rows are in.
+CREATE TABLE t7_ref (id int PRIMARY KEY);
+INSERT INTO t7_ref SELECT generate_series(3001, 3200);
+ALTER TABLE t7_4 ADD FOREIGN KEY (id) REFERENCES t7_ref;
+DO $$
+BEGIN
+  PERFORM pg_background_insert_partitioned('t7', 'SELECT i, i::text FROM generate_series(3101, 3300) i', 2);
+EXCEPTION WHEN foreign_key_violation THEN
+  RAISE NOTICE 'foreign key checked';
+END
+$$;
+SELECT pg_background_insert_partitioned('t7', 'SELECT i, i::text FROM generate_series(3101, 3200) i', 2);
+-- Rows go straight into the partitions, so row-level security can't apply.
+CREATE ROLE regress_pg_background_other;
+SELECT grant_pg_background_privileges('regress_pg_background_other');
+GRANT INSERT ON t7, t7_1, t7_2, t7_3, t7_4 TO regress_pg_background_other;
+ALTER TABLE t7 ENABLE ROW LEVEL SECURITY;
+SET ROLE regress_pg_background_other;
+DO $$
+BEGIN
+  PERFORM pg_background_insert_partitioned('t7', 'SELECT 1, ''1''');
+EXCEPTION WHEN feature_not_supported THEN
+  RAISE NOTICE '%', SQLERRM;
+END
+$$;
+RESET ROLE;
+ALTER TABLE t7 DISABLE ROW LEVEL SECURITY;
+REVOKE ALL ON t7, t7_1, t7_2, t7_3, t7_4 FROM regress_pg_background_other;
+SELECT revoke_pg_background_privileges('regress_pg_background_other');
+DROP ROLE regress_pg_background_other;
+
+CREATE TABLE t8 (id int PRIMARY KEY, v text);
+INSERT INTO t8 SELECT i, i::text FROM generate_series(1, 3000) i;
+CREATE TABLE t8_new (id int NOT NULL, v text) PARTITION BY RANGE (id);
+CREATE TABLE t8_new_1 PARTITION OF t8_new FOR VALUES FROM (1) TO (1501);
+CREATE TABLE t8_new_2 PARTITION OF t8_new FOR VALUES FROM (1501) TO (3001);
+ALTER TABLE t8_new ADD PRIMARY KEY (id);
+CREATE VIEW t8_v AS SELECT id, v FROM t8;
+CREATE TABLE t8_ref (t8_id int REFERENCES t8);
+INSERT INTO t8_ref VALUES (7);
+GRANT SELECT ON t8 TO PUBLIC;
+CALL pg_background_repartition('t8', 't8_new', 'id', 2, 500, false);
+UPDATE t8 SET v = 'changed' WHERE id = 7;
+DELETE FROM t8 WHERE id = 8;
+-- A truncate can't be replayed on the copy.
+TRUNCATE t8, t8_ref;
+-- Each phase commits, so it can't run inside a transaction block.
+BEGIN;
+CALL pg_background_repartition('t8', 't8_new', 'id', 2, 500);
+ROLLBACK;
+CALL pg_background_repartition('t8', 't8_new', 'id', 2, 500);
+SELECT tableoid::regclass, count(*), count(*) FILTER (WHERE v = 'changed') AS changed
+  FROM t8 GROUP BY 1 ORDER BY 1;
+SELECT count(*) FROM t8_old;
+-- Views, foreign keys and privileges follow the data.
+SELECT DISTINCT d.refobjid::regclass AS view_reads
+  FROM pg_depend d JOIN pg_rewrite r ON r.oid = d.objid
+ WHERE r.ev_class = 't8_v'::regclass AND d.refclassid = 'pg_class'::regclass
+   AND d.refobjid <> 't8_v'::regclass;
+SELECT confrelid::regclass AS referenced_table, convalidated FROM pg_constraint
+ WHERE conrelid = 't8_ref'::regclass AND contype = 'f' AND conparentid = 0;
+SELECT has_table_privilege('public', 't8', 'SELECT') AS public_select;
+
+SELECT * FROM pg_background_result(pg_background_launch($$
+  SELECT * FROM pg_background_result(pg_background_launch(
+    'SELECT depth FROM pg_background_tree() WHERE pid = pg_backend_pid()')) AS r(depth int4)
+$$)) AS r(depth int4);
+SET pg_background.max_workers_per_tree = 1;
+DO $$
+BEGIN
+  PERFORM * FROM pg_background_result(pg_background_launch(
+    'SELECT pg_background_launch(''SELECT 1'')')) AS r(pid int4);
+EXCEPTION WHEN insufficient_resources THEN
+  RAISE NOTICE 'launch tree is full';
+END
+$$;
+SELECT count(*) FROM (SELECT pg_background_detach(pg_background_launch('SELECT 1'))
+                        FROM generate_series(1, 2)) AS d;
+RESET pg_background.max_workers_per_tree;
+
+CREATE TABLE t9 (outcome text);
+SET pg_background.on_success = $$INSERT INTO t9 VALUES ('success: ' || current_setting('pg_background.outcome_command'))$$;
+SET pg_background.on_failure = $$INSERT INTO t9 VALUES ('failure: ' || current_setting('pg_background.outcome_sqlstate'))$$;
+SELECT * FROM pg_background_result(pg_background_launch('SELECT 1')) AS (x int);
+DO $$
+BEGIN
+  PERFORM * FROM pg_background_result(pg_background_launch('SELECT 1/0')) AS (x int);
+EXCEPTION WHEN division_by_zero THEN
+  NULL;
+END
+$$;
+RESET pg_background.on_success;
+RESET pg_background.on_failure;
+-- A follow-up that fails is only logged; the result it follows is intact.
+SET pg_background.on_success = 'SELECT 1/0';
+SELECT * FROM pg_background_result(pg_background_launch('SELECT 2')) AS (x int);
+RESET pg_background.on_success;
+-- Follow-ups run once the result has been handed back, so wait for them.
+DO $$
+BEGIN
+  FOR i IN 1..300 LOOP
+    EXIT WHEN (SELECT count(*) FROM t9) = 2;
+    PERFORM pg_sleep(0.1);
+  END LOOP;
+END
+$$;
+SELECT * FROM t9 ORDER BY 1;
+
+-- A failed worker's trace is kept even if its error isn't logged.
+SET log_min_messages = panic;
+DO $$
+DECLARE
+  p int4 := pg_background_launch('SELECT 1/0');
+BEGIN
+  PERFORM set_config('pg_background_test.pid', p::text, false);
+  BEGIN
+    PERFORM * FROM pg_background_result(p) AS (x int);
+  EXCEPTION WHEN division_by_zero THEN
+    NULL;
+  END;
+END
+$$;
+SELECT event, detail
+  FROM pg_background_trace(current_setting('pg_background_test.pid')::int4)
+  WHERE event IN ('statement', 'error');
+-- Kept traces are only for the role that launched the worker.
+CREATE ROLE regress_pg_background_other;
+SELECT grant_pg_background_privileges('regress_pg_background_other');
+SET ROLE regress_pg_background_other;
+DO $$
+BEGIN
+  PERFORM * FROM pg_background_trace(current_setting('pg_background_test.pid')::int4);
+EXCEPTION WHEN insufficient_privilege THEN
+  RAISE NOTICE 'trace belongs to another role';
+END
+$$;
+RESET ROLE;
+SELECT revoke_pg_background_privileges('regress_pg_background_other');
+DROP ROLE regress_pg_background_other;
+-- Only with trace_errors on does an error carry the trace in its detail.
+DO $$
+DECLARE
+  setting text;
+  detail text;
+BEGIN
+  FOREACH setting IN ARRAY ARRAY['off', 'on'] LOOP
+    PERFORM set_config('pg_background.trace_errors', setting, true);
+    BEGIN
+      PERFORM * FROM pg_background_result(pg_background_launch('SELECT 1/0')) AS (x int);
+    EXCEPTION WHEN division_by_zero THEN
+      GET STACKED DIAGNOSTICS detail = PG_EXCEPTION_DETAIL;
+      RAISE NOTICE 'trace_errors %: %', setting,
+        coalesce(detail, '') LIKE 'Recent events of the background worker:%';
+    END;
+  END LOOP;
+END
+$$;
+RESET log_min_messages;
+
+-- The error is explained even when the worker doesn't log it.
+SET pg_background.cpu_limit = 100;
+SET log_min_messages = panic;
+DO $$
+BEGIN
+  PERFORM * FROM pg_background_result(pg_background_launch(
+    'SELECT count(*) FROM generate_series(1, 1000000000)')) AS (n int8);
+EXCEPTION WHEN query_canceled THEN
+  RAISE NOTICE '%', SQLERRM;
+END
+$$;
+RESET log_min_messages;
+RESET pg_background.cpu_limit;
+
+-- Temporary files are accounted for without going through the server log.
+SET log_min_messages = panic;
+SELECT pg_background_stats_reset();
+SELECT * FROM pg_background_result(pg_background_launch('SET work_mem = ''64kB''; SELECT count(*) FROM (SELECT i FROM generate_series(1, 100000) i ORDER BY i DESC OFFSET 0) s')) AS (n int8);
+SELECT command, temp_bytes > 0 AS spilled FROM pg_background_stats() ORDER BY command;
+SET pg_background.temp_limit = 64;
+DO $$
+BEGIN
+  PERFORM * FROM pg_background_result(pg_background_launch(
+    'SET work_mem = ''64kB''; SELECT count(*) FROM (SELECT i FROM generate_series(1, 100000) i ORDER BY i DESC OFFSET 0) s')) AS (n int8);
+EXCEPTION WHEN configuration_limit_exceeded THEN
+  RAISE NOTICE '%', SQLERRM;
+END
+$$;
+RESET pg_background.temp_limit;
+RESET log_min_messages;
+
+-- A sort that fits in work_mem needs megabytes; setting work_mem doesn't.
+SELECT pg_background_stats_reset();
+SELECT * FROM pg_background_result(pg_background_launch('SET work_mem = ''64MB''; SELECT count(*) FROM (SELECT i FROM generate_series(1, 200000) i ORDER BY i DESC OFFSET 0) s')) AS (n int8);
+SELECT command, peak_memory > 4 * 1024 * 1024 AS sorted_in_memory FROM pg_background_stats() ORDER BY command;
+-- The queue is sampled while a statement runs, even if it sends nothing...
+SELECT pg_background_stats_reset();
+SELECT * FROM pg_background_result(pg_background_launch('SELECT 1 FROM pg_sleep(0.5)')) AS (x int);
+SELECT array_length(queue_fill, 1) AS buckets, queue_fill[1] >= 10 AS sampled_while_idle FROM pg_background_stats();
+-- ...and a launcher that doesn't keep up leaves the worker blocked.
+SELECT pg_background_stats_reset();
+DO $$
+DECLARE
+  p int4 := pg_background_launch('SELECT repeat(''x'', 1000) FROM generate_series(1, 1000)', 4096);
+BEGIN
+  PERFORM pg_sleep(0.5);
+  PERFORM * FROM pg_background_result(p) AS (x text);
+END
+$$;
+SELECT queue_blocked >= 10 AS blocked FROM pg_background_stats();
+
+CREATE TABLE t10a AS SELECT i FROM generate_series(1, 1000) i;
+CREATE TABLE t10b AS SELECT i FROM generate_series(1, 1000) i;
+SET pg_background.script_workers = 2;
+SELECT * FROM pg_background_result(pg_background_launch('CREATE INDEX t10a_i ON t10a (i); CREATE INDEX t10b_i ON t10b (i); VACUUM ANALYZE t10a; ANALYZE t10b; SELECT count(*) FROM pg_stats WHERE tablename IN (''t10a'', ''t10b'')')) AS (analyzed int8);
+SELECT indexname FROM pg_indexes WHERE tablename IN ('t10a', 't10b') ORDER BY 1;
+SELECT * FROM pg_background_result(pg_background_launch('SET maintenance_work_mem = ''2MB''; CREATE TEMP TABLE t10t AS SELECT i FROM generate_series(1, 100) i; CREATE INDEX t10t_i ON t10t (i); CREATE INDEX t10a_j ON t10a (i); SELECT current_setting(''maintenance_work_mem''), count(*) FROM t10t')) AS (setting text, n int8);
+DO $$
+BEGIN
+  PERFORM * FROM pg_background_result(pg_background_launch('CREATE INDEX t10b_j ON t10b (i); INSERT INTO t10b VALUES (0); CREATE INDEX t10a_k ON t10a (nosuchcolumn); SELECT 1')) AS (x int);
+EXCEPTION WHEN undefined_column THEN
+  RAISE NOTICE 'script failed: %', SQLERRM;
+END
+$$;
+SELECT indexname FROM pg_indexes WHERE tablename IN ('t10a', 't10b') ORDER BY 1;
+SELECT count(*) FROM t10b;
+-- Statements that can't run alongside others still run in one transaction.
+DO $$
+BEGIN
+  PERFORM * FROM pg_background_result(pg_background_launch('CREATE INDEX t10a_l ON t10a (i); INSERT INTO t10b VALUES (-1); INSERT INTO t10b VALUES (1/0); SELECT 1')) AS (x int);
+EXCEPTION WHEN division_by_zero THEN
+  NULL;
+END
+$$;
+SELECT count(*) FILTER (WHERE i = -1) AS inserted,
+       (SELECT count(*) FROM pg_indexes WHERE indexname = 't10a_l') AS indexed
+  FROM t10b;
+RESET pg_background.script_workers;
+
+-- A worker that exits without reading its child's result orphans the child,
+-- which then follows the orphan policy it was launched with.
+CREATE TABLE t11 (policy text);
+CREATE FUNCTION orphan(policy text, command text) RETURNS int4 LANGUAGE plpgsql AS $$
+DECLARE
+  child int4;
+BEGIN
+  SELECT pid INTO child FROM pg_background_result(pg_background_launch(
+    format('SET pg_background.orphan_policy = %L; SELECT pg_background_launch(%L)',
+           policy, command))) AS (pid int4);
+  FOR i IN 1..300 LOOP
+    EXIT WHEN NOT EXISTS (SELECT 1 FROM pg_background_tree() t WHERE t.pid = child);
+    PERFORM pg_sleep(0.1);
+  END LOOP;
+  RETURN child;
+END
+$$;
+SELECT orphan('cancel', 'SELECT pg_sleep(1); INSERT INTO t11 VALUES (''cancel'')') > 0 AS orphaned;
+SELECT orphan('continue', 'SELECT pg_sleep(1); INSERT INTO t11 VALUES (''continue'')') > 0 AS orphaned;
+SELECT * FROM t11;
+SELECT * FROM pg_background_result(orphan('continue_and_spool', 'SELECT 42 FROM pg_sleep(1)')) AS (x int);
+-- The spooled result can be read only once.
+DO $$
+DECLARE
+  child int4 := orphan('continue_and_spool', 'SELECT 43 FROM pg_sleep(1)');
+BEGIN
+  PERFORM * FROM pg_background_result(child) AS (x int);
+  PERFORM * FROM pg_background_result(child) AS (x int);
+EXCEPTION WHEN undefined_object OR invalid_parameter_value THEN
+  RAISE NOTICE 'spooled result already read';
+END
+$$;
+DROP FUNCTION orphan(text, text);
@@ -0,0 +1,18 @@
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION pg_background_api_test" to load this file. \quit
+
+CREATE FUNCTION api_test_fetch(sql pg_catalog.text)
+    RETURNS TABLE (id pg_catalog.int4, val pg_catalog.text) STRICT
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION api_test_wait(sql pg_catalog.text)
+    RETURNS pg_catalog.int8 STRICT
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION api_test_cancel(sql pg_catalog.text)
+    RETURNS pg_catalog.int8 STRICT
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION api_test_detach(sql pg_catalog.text)
+    RETURNS pg_catalog.int4 STRICT
+	AS 'MODULE_PATHNAME' LANGUAGE C;
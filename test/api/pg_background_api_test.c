@@ -0,0 +1,171 @@
+/*--------------------------------------------------------------------------
+ *
+ * pg_background_api_test.c
+ *		Exercise pg_background's C API the way another extension would.
+ *
+ * Copyright (C) 2014, PostgreSQL Global Development Group
+ *
+ * IDENTIFICATION
+ *		contrib/pg_background/test/api/pg_background_api_test.c
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+
+#include "utils/builtins.h"
+#include "utils/tuplestore.h"
+
+#include "pg_background_api.h"
+
+PG_MODULE_MAGIC;
+
+PG_FUNCTION_INFO_V1(api_test_fetch);
+PG_FUNCTION_INFO_V1(api_test_wait);
+PG_FUNCTION_INFO_V1(api_test_cancel);
+PG_FUNCTION_INFO_V1(api_test_detach);
+
+/* Where api_test_fetch's row callback puts the rows. */
+typedef struct api_test_fetch_state
+{
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+} api_test_fetch_state;
+
+static const PgBackgroundAPI *get_api(void);
+static void api_test_row(void *arg, Datum *values, bool *isnull);
+static void api_test_command_complete(void *arg, const char *tag);
+
+/*
+ * Load pg_background if need be and find its API, checking that the
+ * rendezvous variable leads to the same place.
+ */
+static const PgBackgroundAPI *
+get_api(void)
+{
+	pg_background_get_api_fn get_api_fn;
+	const PgBackgroundAPI *api;
+	PgBackgroundAPI **rendezvous;
+
+	get_api_fn = (pg_background_get_api_fn)
+		load_external_function("pg_background", "pg_background_get_api",
+							   true, NULL);
+	api = get_api_fn();
+
+	rendezvous = (PgBackgroundAPI **)
+		find_rendezvous_variable(PG_BACKGROUND_API_RENDEZVOUS);
+	if (*rendezvous != api)
+		elog(ERROR, "pg_background API rendezvous variable is not set");
+	if (api->version < PG_BACKGROUND_API_VERSION)
+		elog(ERROR, "pg_background API version %d is too old", api->version);
+
+	return api;
+}
+
+/*
+ * Store each row fetch decodes.
+ */
+static void
+api_test_row(void *arg, Datum *values, bool *isnull)
+{
+	api_test_fetch_state *state = arg;
+
+	tuplestore_putvalues(state->tupstore, state->tupdesc, values, isnull);
+}
+
+/*
+ * Report each command tag fetch passes on.
+ */
+static void
+api_test_command_complete(void *arg, const char *tag)
+{
+	elog(NOTICE, "command complete: %s", tag);
+}
+
+/*
+ * Run sql in a task and return its rows, decoded by the API.
+ */
+Datum
+api_test_fetch(PG_FUNCTION_ARGS)
+{
+	char	   *sql = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	const PgBackgroundAPI *api = get_api();
+	PgBackgroundCallbacks callbacks = {api_test_row, api_test_command_complete};
+	api_test_fetch_state state;
+	PgBackgroundTask *task;
+	MemoryContext oldcontext;
+	int64		nrows;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		(rsinfo->allowedModes & SFRM_Materialize) == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (get_call_result_type(fcinfo, NULL, &state.tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	state.tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = state.tupstore;
+	rsinfo->setDesc = state.tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	task = api->launch(sql, 65536);
+	if (api->pid(task) <= 0)
+		elog(ERROR, "task has no worker PID");
+	nrows = api->fetch(task, state.tupdesc, &callbacks, &state);
+	elog(NOTICE, "fetched " INT64_FORMAT " rows", nrows);
+
+	return (Datum) 0;
+}
+
+/*
+ * Run sql in a task and wait for it, returning the number of rows.
+ */
+Datum
+api_test_wait(PG_FUNCTION_ARGS)
+{
+	char	   *sql = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	const PgBackgroundAPI *api = get_api();
+
+	PG_RETURN_INT64(api->wait(api->launch(sql, 65536)));
+}
+
+/*
+ * Run sql in a task, cancel it and wait for it.
+ */
+Datum
+api_test_cancel(PG_FUNCTION_ARGS)
+{
+	char	   *sql = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	const PgBackgroundAPI *api = get_api();
+	PgBackgroundTask *task;
+
+	task = api->launch(sql, 65536);
+	if (!api->cancel(task))
+		elog(ERROR, "could not cancel task");
+
+	PG_RETURN_INT64(api->wait(task));
+}
+
+/*
+ * Run sql in a task and leave it to run on without us, returning its PID.
+ */
+Datum
+api_test_detach(PG_FUNCTION_ARGS)
+{
+	char	   *sql = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	const PgBackgroundAPI *api = get_api();
+	PgBackgroundTask *task;
+
+	task = api->launch(sql, 65536);
+	api->detach(task);
+
+	PG_RETURN_INT32(api->pid(task));
+}
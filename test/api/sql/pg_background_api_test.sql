@@ -0,0 +1,37 @@
+CREATE EXTENSION pg_background;
+CREATE EXTENSION pg_background_api_test;
+
+-- Rows come back decoded as the caller's tuple descriptor describes.
+SELECT * FROM api_test_fetch('SELECT g, repeat(''x'', g) FROM generate_series(1, 3) g');
+
+-- Only the last statement's rows are returned, but every command tag is.
+CREATE TABLE t(id integer);
+SELECT * FROM api_test_fetch('INSERT INTO t VALUES (1), (2); SELECT id, id::text FROM t');
+
+SELECT api_test_wait('SELECT g FROM generate_series(1, 1000) g');
+
+-- Notices and errors are rethrown in the caller.
+SELECT api_test_wait('DO $x$ BEGIN RAISE NOTICE ''hello from the task''; END $x$');
+
+\set VERBOSITY terse
+SELECT * FROM api_test_fetch('SELECT 1/0, NULL::text');
+\set VERBOSITY default
+
+DO $$
+BEGIN
+  PERFORM api_test_cancel('SELECT pg_sleep(10)');
+EXCEPTION WHEN query_canceled THEN
+  RAISE NOTICE 'task canceled';
+END;
+$$;
+
+-- A detached task can't be waited for.
+DO $$
+DECLARE
+  pid int4 := api_test_detach('SELECT 1');
+BEGIN
+  PERFORM * FROM pg_background_result(pid) AS (result int);
+EXCEPTION WHEN undefined_object THEN
+  RAISE NOTICE 'task detached';
+END;
+$$;
@@ -3,6 +3,19 @@
 
 /* Add a prototype marked PGDLLEXPORT */
 PGDLLEXPORT Datum pg_background_launch(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pg_background_launch_chunked(PG_FUNCTION_ARGS);
 PGDLLEXPORT Datum pg_background_result(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pg_background_result_into(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pg_background_stream(PG_FUNCTION_ARGS);
 PGDLLEXPORT Datum pg_background_detach(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pg_background_cancel(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pg_background_wait_any(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pg_background_selfbench(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pg_background_stats(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pg_background_stats_reset(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pg_background_prewarm_blocks(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pg_background_inbound(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pg_background_insert_partitioned(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pg_background_tree(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pg_background_trace(PG_FUNCTION_ARGS);
 PGDLLEXPORT void pg_background_worker_main(Datum);